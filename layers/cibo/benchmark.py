@@ -0,0 +1,604 @@
+#!/usr/bin/env python3
+
+# This file is part of Cibo Tiler.
+# Copyright (C) 2024 Cibolabs.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+"""
+Local benchmarks for cibotiler. Needs no AWS or network access.
+
+The 'kernels' suite times the resampler's kernels for a range of dtypes,
+scale factors and with and without an ignore value. It also compares the
+vectorised kernels with the scalar ones. The fixed point bilinear ones
+(uint8 and uint16) must match exactly, otherwise the exit status is 1.
+
+The 'tiles' suite makes synthetic COGs (with overviews) and times
+getTile() and getTileMosaic() on them at zoom levels that use the
+overviews, read at full resolution and zoom in past it.
+
+The results are written as JSON (see --output) along with the machine,
+library versions and instruction set so runs on different layer versions
+and on arm64 and x86_64 can be compared with --compare.
+
+"""
+
+import os
+import sys
+import json
+import time
+import shutil
+import argparse
+import platform
+import datetime
+import resource
+import tempfile
+import statistics
+
+import numpy
+from osgeo import gdal
+from osgeo import osr
+
+from cibotiler import tiling
+from cibotiler.resamplerhelper import resampler
+
+gdal.UseExceptions()
+
+DFLT_REPEATS = 5
+DFLT_SIZE = 512
+DFLT_IMAGE_SIZE = 4096
+DFLT_THRESHOLD = 0.1
+
+# The dtypes the kernels are timed with
+KERNEL_DTYPES = ['uint8', 'uint16', 'int16', 'float32']
+# ratio of output to input pixels. < 1 zooms out.
+KERNEL_SCALES = [0.5, 2.0, 4.0]
+# name of the kernel, and whether it uses the ignore value
+KERNELS = [('nearest', False), ('bilinear', True), ('cubic', True),
+    ('lanczos', True), ('average', True), ('mode', True)]
+# margin of input pixels each kernel needs
+KERNEL_MARGINS = {'nearest': 0, 'bilinear': 1, 'cubic': 2, 'lanczos': 3,
+    'average': 1, 'mode': 1}
+# The GDAL types of the dtypes the synthetic COGs can be
+GDAL_TYPES = {'uint8': gdal.GDT_Byte, 'uint16': gdal.GDT_UInt16}
+
+# The images for the 'tiles' suite are at the resolution of this zoom
+# level, with the top left at this tile of zoom level TILE_ZOOM_BASE
+TILE_ZOOM_NATIVE = 12
+TILE_ZOOM_BASE = 9
+TILE_BASE_X = 460
+TILE_BASE_Y = 300
+TILE_NODATA = 0
+TILE_SIZE = 256
+# (name, z offset from TILE_ZOOM_NATIVE, resampling)
+TILE_CASES = [('overview', -3, 'near'), ('native', 0, 'near'),
+    ('zoomin', 2, 'near'), ('zoomin', 2, 'bilinear'),
+    ('zoomin', 2, 'cubic'), ('zoomout', -2, 'average')]
+
+
+def getCmdArgs():
+    """
+    Get the command line args
+    """
+    p = argparse.ArgumentParser(description="Run the local benchmarks")
+    p.add_argument('-s', '--suite', choices=['kernels', 'tiles', 'all'],
+        default='all', help="Which benchmarks to run. (default=%(default)s)")
+    p.add_argument('-o', '--output',
+        help="JSON file to write the results to. Otherwise to stdout")
+    p.add_argument('-r', '--repeats', type=int, default=DFLT_REPEATS,
+        help="Number of times to time each benchmark. The best and " +
+            "median are reported. (default=%(default)s)")
+    p.add_argument('-t', '--nthreads', type=int, default=1,
+        help="Threads for the kernels to use. 0 means all the CPUs. " +
+            "(default=%(default)s)")
+    p.add_argument('--size', type=int, default=DFLT_SIZE,
+        help="Size of the kernel outputs. (default=%(default)s)")
+    p.add_argument('--imagesize', type=int, default=DFLT_IMAGE_SIZE,
+        help="Size of the synthetic COGs. (default=%(default)s)")
+    p.add_argument('--tempdir',
+        help="Where to write the synthetic COGs. Default is a new " +
+            "temporary directory that is removed afterwards")
+    p.add_argument('--quick', default=False, action="store_true",
+        help="Only time uint8 and uint16 and 2x kernels, for a fast check")
+    p.add_argument('--compare',
+        help="A JSON file from an earlier run. Benchmarks more than " +
+            "--threshold slower are listed and the exit status is 1")
+    p.add_argument('--threshold', type=float, default=DFLT_THRESHOLD,
+        help="Fraction slower that counts as a regression for --compare." +
+            " (default=%(default)s)")
+    cmdargs = p.parse_args()
+    return cmdargs
+
+
+def getPeakRSS():
+    """
+    Returns the peak resident memory of this process in bytes. On Linux
+    this is since the last resetPeakRSS().
+    """
+    try:
+        with open('/proc/self/status') as f:
+            for line in f:
+                if line.startswith('VmHWM:'):
+                    return int(line.split()[1]) * 1024
+    except OSError:
+        pass
+    maxrss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    if sys.platform == 'darwin':
+        return maxrss
+    return maxrss * 1024
+
+
+def resetPeakRSS():
+    """
+    Reset the peak resident memory so each benchmark's can be reported.
+    Only possible on Linux - otherwise the peak is for the whole run.
+    """
+    try:
+        with open('/proc/self/clear_refs', 'w') as f:
+            f.write('5')
+    except OSError:
+        pass
+
+
+def timeRuns(fn, repeats):
+    """
+    Call fn once to warm up then repeats times.
+
+    Returns
+    -------
+    dict
+        'best' and 'median' times (seconds) and 'peakRSS' (bytes)
+
+    """
+    resetPeakRSS()
+    fn()
+    times = []
+    for n in range(repeats):
+        start = time.perf_counter()
+        fn()
+        times.append(time.perf_counter() - start)
+    return {'best': min(times), 'median': statistics.median(times),
+        'peakRSS': getPeakRSS()}
+
+
+def makeKernelInput(dtype, xsize, ysize, haveIgnore):
+    """
+    Make a smooth image with some noise (so it doesn't compress or
+    predict too well) and, if haveIgnore, blocks of the ignore value.
+
+    Returns
+    -------
+    tuple
+        The data and the ignore value (or None)
+
+    """
+    rng = numpy.random.default_rng(42)
+    rows, cols = numpy.mgrid[:ysize, :xsize]
+    if numpy.issubdtype(dtype, numpy.integer):
+        top = min(numpy.iinfo(dtype).max, 10000)
+    else:
+        top = 10000
+    data = (top / 2) * (1 + numpy.sin(rows / 37.0) * numpy.cos(cols / 53.0))
+    data += rng.normal(0, top / 50, size=data.shape)
+    data = numpy.clip(data, 1, top).astype(dtype)
+    if top < 256:
+        # mode needs repeated values to be meaningful
+        data = data // 8 + 1
+
+    ignore = None
+    if haveIgnore:
+        ignore = 0
+        # a few blocks of nodata, so some of the image is mixed
+        for n in range(8):
+            row = rng.integers(0, max(ysize - 32, 1))
+            col = rng.integers(0, max(xsize - 32, 1))
+            data[row:row + 32, col:col + 32] = ignore
+        # and 1% of single pixels
+        count = data.size // 100
+        data.flat[rng.integers(0, data.size, count)] = ignore
+    return data, ignore
+
+
+def runKernel(name, data, ignore, fullsize, margin, size, nthreads):
+    """
+    Run the given kernel to make a size x size output from the middle of
+    the input (which is fullsize x fullsize once resampled).
+    """
+    off = margin * fullsize // data.shape[-1]
+    if name == 'nearest':
+        return resampler.nearest(data, fullsize, fullsize, off, off,
+            size, size, nthreads)
+    elif name == 'bilinear':
+        return resampler.bilinear_window(data, ignore, fullsize, fullsize,
+            off, off, size, size, nthreads)
+    else:
+        fn = getattr(resampler, name)
+        return fn(data, ignore, fullsize, fullsize, off, off, size, size,
+            nthreads)
+
+
+def compareSIMD(name, data, ignore, fullsize, margin, size, nthreads):
+    """
+    Compare the result of the vectorised kernels with the scalar ones.
+
+    Returns
+    -------
+    tuple
+        Whether they are exactly the same and the largest difference.
+        (None, None) if there are no vectorised kernels.
+
+    """
+    if resampler.simd() == 'none':
+        return None, None
+    vector = runKernel(name, data, ignore, fullsize, margin, size, nthreads)
+    previous = resampler.use_simd(False)
+    try:
+        scalar = runKernel(name, data, ignore, fullsize, margin, size,
+            nthreads)
+    finally:
+        resampler.use_simd(previous)
+    exact = bool(numpy.array_equal(vector, scalar, equal_nan=True))
+    diff = numpy.abs(vector.astype(numpy.float64) - scalar)
+    return exact, float(numpy.nanmax(diff)) if diff.size > 0 else 0.0
+
+
+def runKernelSuite(cmdargs):
+    """
+    Time the resampler kernels.
+
+    Returns
+    -------
+    list of dict
+        One for each kernel, dtype, scale and with and without ignore
+
+    """
+    dtypes = KERNEL_DTYPES
+    scales = KERNEL_SCALES
+    if cmdargs.quick:
+        dtypes = ['uint8', 'uint16']
+        scales = [2.0]
+
+    size = cmdargs.size
+    results = []
+    for dtype in dtypes:
+        for scale in scales:
+            for name, usesIgnore in KERNELS:
+                if scale > 1 and name in ('average', 'mode'):
+                    # these are for zooming out
+                    continue
+                if scale < 1 and name not in ('nearest', 'average',
+                        'mode'):
+                    continue
+
+                for haveIgnore in ([False, True] if usesIgnore
+                        else [False]):
+                    margin = KERNEL_MARGINS[name]
+                    insize = int(numpy.ceil(size / scale)) + 2 * margin
+                    data, ignore = makeKernelInput(numpy.dtype(dtype),
+                        insize, insize, haveIgnore)
+                    fullsize = int(round(insize * scale))
+
+                    timing = timeRuns(lambda: runKernel(name, data, ignore,
+                        fullsize, margin, size, cmdargs.nthreads),
+                        cmdargs.repeats)
+                    result = {'suite': 'kernels', 'kernel': name,
+                        'dtype': dtype, 'scale': scale,
+                        'ignore': haveIgnore, 'size': size,
+                        'nthreads': cmdargs.nthreads}
+                    result['name'] = '{kernel}-{dtype}-x{scale}-{0}'.format(
+                        'ignore' if haveIgnore else 'noignore', **result)
+                    result.update(timing)
+                    result['mpixPerSec'] = size * size / timing['best'] / 1e6
+                    exact, maxDiff = compareSIMD(name, data, ignore,
+                        fullsize, margin, size, cmdargs.nthreads)
+                    result['simdExact'] = exact
+                    result['simdMaxDiff'] = maxDiff
+                    # only the fixed point kernels are promised to match
+                    result['simdMustMatch'] = (name == 'bilinear' and
+                        dtype in ('uint8', 'uint16'))
+                    results.append(result)
+                    print(formatResult(result), file=sys.stderr)
+
+    # fixed point against float bilinear. Not exact (the float
+    # version truncates) so report the largest difference.
+    for dtype in ('uint8', 'uint16'):
+        data, ignore = makeKernelInput(numpy.dtype(dtype), size // 2 + 2,
+            size // 2 + 2, False)
+        fullsize = (size // 2 + 2) * 2
+        fixed = runKernel('bilinear', data, ignore, fullsize, 1, size,
+            cmdargs.nthreads)
+        previous = resampler.use_fixed_point(False)
+        try:
+            timing = timeRuns(lambda: runKernel('bilinear', data, ignore,
+                fullsize, 1, size, cmdargs.nthreads), cmdargs.repeats)
+            floating = runKernel('bilinear', data, ignore, fullsize, 1,
+                size, cmdargs.nthreads)
+        finally:
+            resampler.use_fixed_point(previous)
+        result = {'suite': 'kernels', 'kernel': 'bilinear-float',
+            'dtype': dtype, 'scale': 2.0, 'ignore': False, 'size': size,
+            'nthreads': cmdargs.nthreads,
+            'name': 'bilinear-float-{}-x2.0-noignore'.format(dtype)}
+        result.update(timing)
+        result['mpixPerSec'] = size * size / timing['best'] / 1e6
+        result['maxFixedPointDiff'] = int(numpy.abs(fixed.astype(numpy.int64)
+            - floating.astype(numpy.int64)).max())
+        results.append(result)
+        print(formatResult(result), file=sys.stderr)
+
+    return results
+
+
+def getTileRes(z):
+    """
+    The size of the pixels of a tile of zoom level z, in metres
+    """
+    tlx, tly, brx, bry = tiling.getExtentforWebMTile(z, 0, 0)
+    return (brx - tlx) / tiling.MERCATOR_TILE_SIZE
+
+
+def makeCOG(filename, xoff, yoff, imageSize, dtype, nbands):
+    """
+    Make a synthetic COG at the resolution of TILE_ZOOM_NATIVE, offset
+    from the top left of the base tile by (xoff, yoff) pixels, with
+    overviews down to a tile in size and a nodata of TILE_NODATA.
+    """
+    tlx, tly, brx, bry = tiling.getExtentforWebMTile(TILE_ZOOM_BASE,
+        TILE_BASE_X, TILE_BASE_Y)
+    res = getTileRes(TILE_ZOOM_NATIVE)
+
+    tmpname = filename + '.tmp.tif'
+    ds = gdal.GetDriverByName('GTiff').Create(tmpname, imageSize,
+        imageSize, nbands, GDAL_TYPES[dtype], ['TILED=YES'])
+    ds.SetGeoTransform((tlx + xoff * res, res, 0, tly - yoff * res, 0,
+        -res))
+    sr = osr.SpatialReference()
+    sr.ImportFromEPSG(3857)
+    ds.SetProjection(sr.ExportToWkt())
+    for bandnum in range(1, nbands + 1):
+        data = makeKernelInput(numpy.dtype(dtype), imageSize, imageSize,
+            True)[0]
+        # each band a little different
+        valid = data != TILE_NODATA
+        data[valid] = numpy.maximum(data[valid] // bandnum, 1)
+        data[:, :imageSize // 16] = TILE_NODATA
+        band = ds.GetRasterBand(bandnum)
+        band.WriteArray(data)
+        band.SetNoDataValue(TILE_NODATA)
+
+    levels = []
+    level = 2
+    while imageSize // level >= tiling.MERCATOR_TILE_SIZE // 2:
+        levels.append(level)
+        level *= 2
+    ds.BuildOverviews('AVERAGE', levels)
+
+    driver = gdal.GetDriverByName('COG')
+    if driver is not None:
+        out = driver.CreateCopy(filename, ds,
+            options=['COMPRESS=DEFLATE', 'OVERVIEWS=FORCE_USE_EXISTING'])
+    else:
+        out = gdal.GetDriverByName('GTiff').CreateCopy(filename, ds,
+            options=['TILED=YES', 'COMPRESS=DEFLATE',
+                'COPY_SRC_OVERVIEWS=YES'])
+    out = None
+    ds = None
+    gdal.Unlink(tmpname)
+
+
+def getTilesForCase(zoffset, imageSize):
+    """
+    Returns a list of (z, x, y) of the tiles of zoom level
+    TILE_ZOOM_NATIVE + zoffset in the middle of the image.
+    """
+    z = TILE_ZOOM_NATIVE + zoffset
+    scale = 2 ** (z - TILE_ZOOM_BASE)
+    baseX = TILE_BASE_X * scale
+    baseY = TILE_BASE_Y * scale
+    # number of tiles across the image at this zoom
+    across = max(int(imageSize * 2 ** zoffset / tiling.MERCATOR_TILE_SIZE),
+        1)
+    # up to 4 x 4 tiles from the middle
+    first = max(across // 2 - 2, 0)
+    last = min(first + 4, across)
+    return [(z, baseX + x, baseY + y) for y in range(first, last)
+        for x in range(first, last)]
+
+
+def runTileSuite(cmdargs, tempdir):
+    """
+    Time getTile() and getTileMosaic() on synthetic COGs.
+
+    Returns
+    -------
+    list of dict
+        One for each case, dtype and whether a mosaic
+
+    """
+    imageSize = cmdargs.imagesize
+    # make every tile
+    tiling.tileCache.maxBytes = 0
+    tiling.diskCache.maxBytes = 0
+
+    dtypes = ['uint8', 'uint16']
+    if cmdargs.quick:
+        dtypes = ['uint16']
+
+    results = []
+    for dtype in dtypes:
+        filenames = []
+        # for the mosaic, the second overlaps the first by half
+        for n, xoff in enumerate((0, imageSize // 2)):
+            filename = os.path.join(tempdir, 'bench_{}_{}.tif'.format(
+                dtype, n))
+            makeCOG(filename, xoff, 0, imageSize, dtype, 3)
+            filenames.append(filename)
+
+        # see makeKernelInput()
+        top = 32 if dtype == 'uint8' else 10000
+        rescaling = [(0, top)] * 3
+        for caseName, zoffset, resampling in TILE_CASES:
+            tiles = getTilesForCase(zoffset, imageSize)
+            for mosaic in (False, True):
+                if mosaic:
+                    def makeTiles():
+                        for z, x, y in tiles:
+                            tiling.getTileMosaic(filenames, z, x, y,
+                                bands=[1, 2, 3], rescaling=rescaling,
+                                resampling=resampling, tileSize=TILE_SIZE,
+                                nthreads=cmdargs.nthreads)
+                else:
+                    def makeTiles():
+                        for z, x, y in tiles:
+                            tiling.getTile(filenames[0], z, x, y,
+                                bands=[1, 2, 3], rescaling=rescaling,
+                                resampling=resampling, tileSize=TILE_SIZE,
+                                nthreads=cmdargs.nthreads)
+
+                timing = timeRuns(makeTiles, cmdargs.repeats)
+                result = {'suite': 'tiles', 'case': caseName,
+                    'zoom': TILE_ZOOM_NATIVE + zoffset,
+                    'resampling': resampling, 'dtype': dtype,
+                    'mosaic': mosaic, 'ntiles': len(tiles),
+                    'nthreads': cmdargs.nthreads}
+                result['name'] = '{0}-{case}-{resampling}-{dtype}'.format(
+                    'mosaic' if mosaic else 'tile', **result)
+                result.update(timing)
+                result['tilesPerSec'] = len(tiles) / timing['best']
+                result['mpixPerSec'] = (len(tiles) * TILE_SIZE * TILE_SIZE /
+                    timing['best'] / 1e6)
+                # and where the time goes for one run
+                stats = tiling.TileStats()
+                z, x, y = tiles[0]
+                if mosaic:
+                    tiling.getTileMosaic(filenames, z, x, y,
+                        bands=[1, 2, 3], rescaling=rescaling,
+                        resampling=resampling, tileSize=TILE_SIZE,
+                        nthreads=cmdargs.nthreads, stats=stats)
+                else:
+                    tiling.getTile(filenames[0], z, x, y, bands=[1, 2, 3],
+                        rescaling=rescaling, resampling=resampling,
+                        tileSize=TILE_SIZE, nthreads=cmdargs.nthreads,
+                        stats=stats)
+                result['stats'] = stats.asDict()
+                results.append(result)
+                print(formatResult(result), file=sys.stderr)
+
+        tiling.datasetCache.invalidate()
+    return results
+
+
+def formatResult(result):
+    """
+    One line summary of a result for the progress output
+    """
+    line = '{:<45} best {:8.2f} ms {:10.1f} Mpix/s'.format(result['name'],
+        result['best'] * 1000, result['mpixPerSec'])
+    if 'tilesPerSec' in result:
+        line += ' {:8.1f} tiles/s'.format(result['tilesPerSec'])
+    if result.get('simdExact') is False:
+        line += ' SIMD differs by {}'.format(result['simdMaxDiff'])
+    return line
+
+
+def getMachineInfo():
+    """
+    Returns a dict describing where the benchmarks were run
+    """
+    return {'machine': platform.machine(), 'platform': platform.platform(),
+        'processor': platform.processor(), 'cpus': os.cpu_count(),
+        'python': platform.python_version(), 'numpy': numpy.__version__,
+        'gdal': gdal.__version__, 'simd': resampler.simd(),
+        'resampler': resampler.__name__,
+        'layerVersion': os.getenv('CIBO_LAYER_VERSION'),
+        'time': datetime.datetime.now(datetime.timezone.utc).isoformat()}
+
+
+def compareResults(results, previous, threshold):
+    """
+    Compare results with those of an earlier run (matched by name and
+    nthreads).
+
+    Returns
+    -------
+    list of str
+        A message for each benchmark that is more than threshold slower
+
+    """
+    before = {(result['name'], result['nthreads']): result
+        for result in previous['results']}
+    regressions = []
+    for result in results:
+        old = before.get((result['name'], result['nthreads']))
+        if old is None:
+            continue
+        change = result['best'] / old['best'] - 1
+        if change > threshold:
+            regressions.append('{}: {:.1f}% slower ({:.2f} ms was {:.2f} ms)'
+                .format(result['name'], change * 100, result['best'] * 1000,
+                    old['best'] * 1000))
+    return regressions
+
+
+def main():
+    """
+    Main function
+    """
+    cmdargs = getCmdArgs()
+
+    results = []
+    if cmdargs.suite in ('kernels', 'all'):
+        results.extend(runKernelSuite(cmdargs))
+
+    if cmdargs.suite in ('tiles', 'all'):
+        tempdir = cmdargs.tempdir
+        if tempdir is None:
+            tempdir = tempfile.mkdtemp(prefix='cibobench')
+        try:
+            results.extend(runTileSuite(cmdargs, tempdir))
+        finally:
+            if cmdargs.tempdir is None:
+                shutil.rmtree(tempdir)
+
+    output = {'info': getMachineInfo(), 'repeats': cmdargs.repeats,
+        'results': results}
+    if cmdargs.output is not None:
+        with open(cmdargs.output, 'w') as f:
+            json.dump(output, f, indent=2)
+    else:
+        json.dump(output, sys.stdout, indent=2)
+        print()
+
+    status = 0
+    mismatches = [result['name'] for result in results
+        if result.get('simdExact') is False and result['simdMustMatch']]
+    if len(mismatches) > 0:
+        print('Vectorised kernels differ from scalar:',
+            ', '.join(mismatches), file=sys.stderr)
+        status = 1
+
+    if cmdargs.compare is not None:
+        with open(cmdargs.compare) as f:
+            previous = json.load(f)
+        regressions = compareResults(results, previous, cmdargs.threshold)
+        for regression in regressions:
+            print(regression, file=sys.stderr)
+        if len(regressions) > 0:
+            status = 1
+
+    return status
+
+
+if __name__ == '__main__':
+    sys.exit(main())
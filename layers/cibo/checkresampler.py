@@ -0,0 +1,341 @@
+#!/usr/bin/env python3
+
+# This file is part of Cibo Tiler.
+# Copyright (C) 2024 Cibolabs.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+"""
+Checks of the resampler against simple numpy versions of what it should
+do. Needs only numpy and a built cibotiler (not GDAL or AWS).
+
+Prints each check and exits with a status of 1 if any fail.
+
+"""
+
+import sys
+import argparse
+
+import numpy
+
+from cibotiler.resamplerhelper import resampler
+
+DFLT_TRIALS = 50
+
+
+def getCmdArgs():
+    """
+    Get the command line args
+    """
+    p = argparse.ArgumentParser(description="Check the resampler")
+    p.add_argument('-n', '--trials', type=int, default=DFLT_TRIALS,
+        help="Number of random cases for each check. " +
+            "(default=%(default)s)")
+    p.add_argument('--seed', type=int, default=1,
+        help="Seed for the random cases. (default=%(default)s)")
+    cmdargs = p.parse_args()
+    return cmdargs
+
+
+def reportDiff(name, got, expected):
+    """
+    Print where got differs from expected (NaN matches NaN).
+
+    Returns
+    -------
+    bool
+        True if they are the same
+
+    """
+    differ = got != expected
+    if got.dtype.kind == 'f':
+        differ &= ~(numpy.isnan(got) & numpy.isnan(expected))
+    bad = numpy.argwhere(differ)
+    if len(bad) == 0:
+        return True
+    first = tuple(bad[0])
+    print('FAIL {}: {} differ, first at {} got {} expected {}'.format(name,
+        len(bad), first, got[first], expected[first]))
+    return False
+
+
+def checkMosaicIndexed(rng, trials):
+    """
+    Check mosaic() of several inputs with a colormap gives the same as
+    compose() of the first valid value of each pixel, both for the index
+    into the colormap (a paletted tile) and the colors.
+
+    Returns
+    -------
+    bool
+        True if all the cases pass
+
+    """
+    nColors = 200
+    nodata = 3.5
+    ok = True
+    for trial in range(trials):
+        tileSize = int(rng.integers(4, 100))
+        colormap = rng.integers(0, 256, (4, nColors), dtype=numpy.uint8)
+        inputs = []
+        for n in range(int(rng.integers(2, 5))):
+            ysize, xsize = rng.integers(1, tileSize + 1, 2)
+            yoff = int(rng.integers(0, tileSize - ysize + 1))
+            xoff = int(rng.integers(0, tileSize - xsize + 1))
+            # some values past the end of the colormap
+            data = rng.integers(0, nColors + 20,
+                (1, ysize, xsize)).astype(numpy.float32)
+            data[rng.random(data.shape) < 0.3] = nodata
+            inputs.append((data, xoff, yoff, nodata))
+
+        shape = (tileSize, tileSize)
+        index = numpy.full((1,) + shape, nColors, dtype=numpy.uint8)
+        resampler.mosaic(inputs, index, numpy.zeros(shape, numpy.uint8),
+            colormap=colormap)
+        colors = numpy.zeros((4,) + shape, dtype=numpy.uint8)
+        resampler.mosaic(inputs, colors, numpy.zeros(shape, numpy.uint8),
+            colormap=colormap)
+
+        # paint the lowest priority first so the first valid wins
+        combined = numpy.full((1,) + shape, nodata, dtype=numpy.float32)
+        for data, xoff, yoff, dataNodata in reversed(inputs):
+            window = combined[:, yoff:yoff + data.shape[1],
+                xoff:xoff + data.shape[2]]
+            valid = data != dataNodata
+            window[valid] = data[valid]
+        expected = numpy.empty((1,) + shape, dtype=numpy.uint8)
+        resampler.compose(combined, expected, 0, 0, colormap=colormap,
+            outside=nColors)
+        expected[combined == nodata] = nColors
+
+        name = 'mosaic indexed trial {}'.format(trial)
+        ok = reportDiff(name, index, expected) and ok
+        # the colors are the same as looking up the index, with 0 where
+        # nothing was painted
+        palette = numpy.concatenate([colormap,
+            numpy.zeros((4, 1), dtype=numpy.uint8)], axis=1)
+        name = 'mosaic colors trial {}'.format(trial)
+        ok = reportDiff(name, colors, palette[:, expected[0]]) and ok
+    return ok
+
+
+def fixedBilinearTable(inSize, fullSize, offset, outSize, nBits):
+    """
+    The input pixels each side of the output pixels and their weights
+    out of 2**nBits. The centre of each output pixel in the input is
+    found exactly as a fraction and the weight rounded to nearest.
+
+    Returns
+    -------
+    lower, upper, lowerWeight, upperWeight
+        int64 arrays of outSize
+
+    """
+    one = 1 << nBits
+    den = 2 * fullSize
+    # the centre of output pixel o is at num / den in the input
+    num = ((2 * (numpy.arange(outSize, dtype=numpy.int64) + offset) + 1) * 
+        inSize - fullSize)
+    before = num < 0
+    num[before] = 0
+    lower = num // den
+    weight = ((num % den) * one + den // 2) // den
+    upper = numpy.minimum(lower + 1, inSize - 1)
+    lower = numpy.minimum(lower, inSize - 1)
+    return lower, upper, one - weight, weight
+
+
+def fixedBilinear(data, ignore, fullWidth, fullHeight, xoff, yoff, width,
+        height):
+    """
+    Bilinear of a 2d uint8 or uint16 array, straight from the integer
+    weights of each of the four input pixels and rounded half up. Where
+    any of those is ignore the result is the weighted average of the 
+    valid ones (or ignore if none are).
+
+    """
+    if data.dtype == numpy.uint8:
+        rowBits, colBits = 8, 8
+    else:
+        rowBits, colBits = 15, 16
+    rl, ru, rwl, rwu = fixedBilinearTable(data.shape[0], fullHeight, yoff,
+        height, rowBits)
+    cl, cu, cwl, cwu = fixedBilinearTable(data.shape[1], fullWidth, xoff,
+        width, colBits)
+
+    pixels = data.astype(numpy.int64)
+    values = [pixels[rl][:, cl], pixels[rl][:, cu], pixels[ru][:, cl],
+        pixels[ru][:, cu]]
+    weights = [numpy.outer(rwl, cwl), numpy.outer(rwl, cwu),
+        numpy.outer(rwu, cwl), numpy.outer(rwu, cwu)]
+
+    shift = rowBits + colBits
+    total = sum(v * w for v, w in zip(values, weights))
+    result = (total + (1 << (shift - 1))) >> shift
+    if ignore is not None and not numpy.isnan(ignore):
+        valid = [v != ignore for v in values]
+        num = sum(v * w * m for v, w, m in zip(values, weights, valid))
+        den = sum(w * m for w, m in zip(weights, valid))
+        partial = numpy.where(den > 0, 
+            (num + den // 2) // numpy.maximum(den, 1), ignore)
+        someIgnored = ~(valid[0] & valid[1] & valid[2] & valid[3])
+        result = numpy.where(someIgnored, partial, result)
+    return result.astype(data.dtype)
+
+
+def checkFixedBilinear(rng, trials):
+    """
+    Check the fixed point bilinear for uint8 and uint16 exactly matches
+    fixedBilinear(), with and without the vectorised kernels. Covers
+    zooming in and out by a few factors, a window of the output, odd
+    widths (for the ends of the rows the vectorised kernels do one 
+    pixel at a time) and with and without an ignore value.
+
+    Returns
+    -------
+    bool
+        True if all the cases pass
+
+    """
+    scales = [0.25, 1 / 3, 0.5, 2 / 3, 1, 1.5, 2, 3, 4, 7.3]
+    oldFixed = resampler.use_fixed_point(True)
+    oldSIMD = resampler.use_simd(True)
+    ok = True
+    try:
+        for trial in range(trials):
+            dtype = [numpy.uint8, numpy.uint16][trial % 2]
+            maxValue = numpy.iinfo(dtype).max
+            ysize, xsize = rng.integers(1, 70, 2)
+            data = rng.integers(0, maxValue + 1, (ysize, xsize), 
+                dtype=dtype)
+            # the extremes are the most likely to overflow
+            data[rng.random(data.shape) < 0.1] = maxValue
+            ignore = [None, float(maxValue), 0.0, float('nan')][trial // 2 % 4]
+            if ignore is not None and not numpy.isnan(ignore):
+                data[rng.random(data.shape) < 0.2] = ignore
+            scale = scales[int(rng.integers(0, len(scales)))]
+            fullWidth = max(1, int(round(xsize * scale)))
+            fullHeight = max(1, int(round(ysize * scale)))
+            # odd so there's always a partial vector at the end
+            width = int(rng.integers(0, (fullWidth + 1) // 2)) * 2 + 1
+            width = min(width, fullWidth)
+            height = int(rng.integers(1, fullHeight + 1))
+            xoff = int(rng.integers(0, fullWidth - width + 1))
+            yoff = int(rng.integers(0, fullHeight - height + 1))
+            nthreads = int(rng.integers(1, 5))
+
+            expected = fixedBilinear(data, ignore, fullWidth, fullHeight, 
+                xoff, yoff, width, height)
+            expectedFull = fixedBilinear(data, ignore, fullWidth, fullHeight,
+                0, 0, fullWidth, fullHeight)
+            for simd in (True, False):
+                resampler.use_simd(simd)
+                desc = 'trial {} {} ignore {} simd {}'.format(trial, 
+                    numpy.dtype(dtype).name, ignore, simd)
+                got = resampler.bilinear_window(data, ignore, fullWidth, 
+                    fullHeight, xoff, yoff, width, height, nthreads=nthreads)
+                ok = reportDiff('fixed bilinear window ' + desc, got, 
+                    expected) and ok
+                got = resampler.bilinear(data, ignore, fullWidth, fullHeight,
+                    nthreads=nthreads)
+                ok = reportDiff('fixed bilinear ' + desc, got, 
+                    expectedFull) and ok
+    finally:
+        resampler.use_simd(oldSIMD)
+        resampler.use_fixed_point(oldFixed)
+    return ok
+
+
+def checkAverageModeNaN(rng, trials):
+    """
+    Check average() and mode() of float data with NaN holes as well as
+    an ignore value (or none, or NaN) leave out both, going down by
+    whole factors so every input pixel has the same weight.
+
+    Returns
+    -------
+    bool
+        True if all the cases pass
+
+    """
+    ok = True
+    for trial in range(trials):
+        dtype = [numpy.float32, numpy.float64][trial % 2]
+        ignore = [-9999.0, None, float('nan')][trial // 2 % 3]
+        factor = int(rng.integers(1, 5))
+        height, width = rng.integers(1, 30, 2)
+        # few values so there are ties for the mode
+        data = rng.integers(1, 5, (height * factor, width * factor))
+        data = data.astype(dtype)
+        data[rng.random(data.shape) < 0.3] = numpy.nan
+        if ignore is not None:
+            data[rng.random(data.shape) < 0.3] = ignore
+        nthreads = int(rng.integers(1, 5))
+
+        # the input pixels of each output pixel down the last axis
+        blocks = data.reshape(height, factor, width, factor)
+        blocks = blocks.transpose(0, 2, 1, 3).reshape(height, width, -1)
+        valid = ~numpy.isnan(blocks)
+        if ignore is not None:
+            valid &= blocks != ignore
+        count = valid.sum(axis=2)
+        noValue = numpy.nan if ignore is None else ignore
+
+        total = numpy.where(valid, blocks, 0).sum(axis=2)
+        expected = numpy.where(count > 0, 
+            total / numpy.maximum(count, 1), noValue).astype(dtype)
+        desc = 'trial {} {} ignore {}'.format(trial, 
+            numpy.dtype(dtype).name, ignore)
+        got = resampler.average(data, ignore, width, height, 0, 0,
+            width, height, nthreads=nthreads)
+        ok = reportDiff('average ' + desc, got, expected) and ok
+
+        # argmax takes the first, so ties go to the smallest
+        votes = numpy.stack([(valid & (blocks == value)).sum(axis=2)
+            for value in range(1, 5)])
+        expected = numpy.where(count > 0, votes.argmax(axis=0) + 1,
+            noValue).astype(dtype)
+        got = resampler.mode(data, ignore, width, height, 0, 0,
+            width, height, nthreads=nthreads)
+        ok = reportDiff('mode ' + desc, got, expected) and ok
+    return ok
+
+
+def main():
+    """
+    Main function
+    """
+    cmdargs = getCmdArgs()
+    rng = numpy.random.default_rng(cmdargs.seed)
+
+    checks = [('mosaic with a colormap', checkMosaicIndexed),
+        ('fixed point bilinear', checkFixedBilinear),
+        ('average and mode with NaN', checkAverageModeNaN)]
+    failed = []
+    for name, check in checks:
+        if check(rng, cmdargs.trials):
+            print('OK', name)
+        else:
+            print('FAILED', name)
+            failed.append(name)
+
+    if len(failed) > 0:
+        print('{} of {} checks failed ({})'.format(len(failed), len(checks),
+            resampler.__name__), file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
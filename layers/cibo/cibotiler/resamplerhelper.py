@@ -18,16 +18,47 @@
 Helper functions for doing resampling
 """
 
+import os
+import importlib
 import numpy
-from . import resampler
+from . import resampler as portableResampler
+
+
+def loadResampler():
+    """
+    Choose the build of the resampler to use. setup.py builds the 
+    portable resampler and resampler_tuned, which is compiled for the 
+    CPU of the Lambda (eg Graviton2 and later). resampler_tuned is used 
+    if it was built and this CPU can run it. Set the CIBO_RESAMPLER 
+    environment variable to 'portable' to always use the portable one.
+
+    Returns
+    -------
+    module
+        resampler or resampler_tuned. They have the same functions.
+
+    """
+    if os.getenv('CIBO_RESAMPLER') == 'portable':
+        return portableResampler
+    # check first - importing it on the wrong CPU could crash
+    if not portableResampler.tuned_supported():
+        return portableResampler
+    try:
+        return importlib.import_module('.resampler_tuned', __package__)
+    except ImportError:
+        return portableResampler
+
+
+# The one to use. tiling uses this too.
+resampler = loadResampler()
 
 
 # nearest neighbour - from TuiView
 def replicateArray(arr, outsize, dspLeftExtra, dspTopExtra, dspRightExtra, 
-        dspBottomExtra, ignore):
+        dspBottomExtra, ignore, nthreads=1, out=None):
     """
-    Replicate the data in the given 2-d array so that it increases
-    in size to be outsize (ysize, xsize). 
+    Replicate the data in the given 2-d (or 3-d (bands, rows, cols)) array
+    so that it increases in size to be outsize (ysize, xsize). 
     
     Replicates each pixel in both directions. 
     
@@ -39,7 +70,7 @@ def replicateArray(arr, outsize, dspLeftExtra, dspTopExtra, dspRightExtra,
     Parameters
     ----------
     arr : numpy.ndarray
-        2 dimensional input data
+        2 or 3 dimensional input data
     outsize : tuple of int
         The output size (xsize, ysize)
     dspLeftExtra : int
@@ -52,47 +83,46 @@ def replicateArray(arr, outsize, dspLeftExtra, dspTopExtra, dspRightExtra,
         number of pixels to be shaved off the bottom
     ignore: float
         ignore value for input - currently ignored
+    nthreads: int, optional
+        number of threads to split the resampling between. 0 means
+        use all CPUs.
+    out: numpy.ndarray, optional
+        array (or view) of the output size and the same dtype as arr to
+        write the result into, rather than creating a new array.
 
     Returns
     -------
     numpy.ndarray
+        Same number of dimensions as arr
 
     """
     (ysize, xsize) = outsize
-    (nrows, ncols) = arr.shape
+    (nrows, ncols) = arr.shape[-2:]
     nRptsX = float(xsize + dspLeftExtra + dspRightExtra) / float(ncols)
     nRptsY = float(ysize + dspTopExtra + dspBottomExtra) / float(nrows)
 
     rowCount = int(numpy.ceil(nrows * nRptsY))
     colCount = int(numpy.ceil(ncols * nRptsX))
     
-    # create the lookup table (up to nrows/ncols-1)
-    # using the complex number stuff in numpy.mgrid
-    # doesn't work too well since you end up with unevenly
-    # spaced divisions...
-    row, col = numpy.mgrid[dspTopExtra:rowCount - dspBottomExtra, 
-        dspLeftExtra:colCount - dspRightExtra]
-    # try to be a little frugal with memory
-    numpy.multiply(row, nrows / float(rowCount), out=row, casting='unsafe')
-    numpy.multiply(col, ncols / float(colCount), out=col, casting='unsafe')
-    # need to index with ints
-    row = row.astype(numpy.int32)
-    col = col.astype(numpy.int32)
-
-    # do the lookup
-    outarr = arr[row, col]
-
-    # chop out the extra pixels (if any)
-    outarr = outarr[0:ysize, 0:xsize]
+    # The lookup tables are created in the C++ and only the
+    # area we need is calculated. If ceil() above gives us an
+    # extra pixel on the bottom or right it isn't included.
+    outxsize = max(min(xsize, colCount - dspLeftExtra - dspRightExtra), 0)
+    outysize = max(min(ysize, rowCount - dspTopExtra - dspBottomExtra), 0)
+    if out is not None:
+        # any part not calculated is left as it was
+        out = out[..., :outysize, :outxsize]
+    outarr = resampler.nearest(arr, colCount, rowCount, dspLeftExtra, 
+        dspTopExtra, outxsize, outysize, nthreads, out)
 
     return outarr
 
     
 def bilinearResample(arr, outsize, dspLeftExtra, dspTopExtra, 
-        dspRightExtra, dspBottomExtra, ignore):
+        dspRightExtra, dspBottomExtra, ignore, nthreads=1, out=None):
     """
-    Use bilinear interpolation on the given 2-d array so that it increases
-    in size to be outsize (ysize, xsize). 
+    Use bilinear interpolation on the given 2-d (or 3-d (bands, rows, cols))
+    array so that it increases in size to be outsize (ysize, xsize). 
     
     dspLeftExtra, dspTopExtra are the number of pixels to be shaved off the
     top and left. dspRightExtra, dspBottomExtra are the number of pixels
@@ -102,7 +132,7 @@ def bilinearResample(arr, outsize, dspLeftExtra, dspTopExtra,
     Parameters
     ----------
     arr : numpy.ndarray
-        2 dimensional input data
+        2 or 3 dimensional input data
     outsize : tuple of int
         The output size (xsize, ysize)
     dspLeftExtra : int
@@ -113,27 +143,116 @@ def bilinearResample(arr, outsize, dspLeftExtra, dspTopExtra,
         number of pixels to be shaved off the right
     dspBottomExtra : int
         number of pixels to be shaved off the bottom
-    ignore: float
-        ignore value for input. Can be None.
+    ignore: float or sequence of floats
+        ignore value for input. Can be None. For 3 dimensional input
+        can be a sequence with a value (or None) for each band.
+    nthreads: int, optional
+        number of threads to split the resampling between. 0 means
+        use all CPUs.
+    out: numpy.ndarray, optional
+        array (or view) of the output size and the same dtype as arr to
+        write the result into, rather than creating a new array.
 
     Returns
     -------
     numpy.ndarray
+        Same number of dimensions as arr
 
     """    
     (ysize, xsize) = outsize
     
-    # do the biliear over the full area and chop out the bits we
-    # need. Did start changing the C++ code to only work
-    # over required area, but this got very complex...
+    # the bilinear is notionally done over the full area, but
+    # only the bits we need are calculated.
     rowCount = ysize + dspTopExtra + dspBottomExtra
     colCount = xsize + dspLeftExtra + dspRightExtra
-    outarr = resampler.bilinear(arr, ignore, colCount, rowCount)
+    outarr = resampler.bilinear_window(arr, ignore, colCount, rowCount,
+        dspLeftExtra, dspTopExtra, xsize, ysize, nthreads, out)
     
-    outarr = outarr[dspTopExtra:rowCount - dspBottomExtra, 
-        dspLeftExtra:colCount - dspRightExtra]
     return outarr
     
 
+def averageResample(arr, outsize, dspLeftExtra, dspTopExtra, 
+        dspRightExtra, dspBottomExtra, ignore, nthreads=1, out=None):
+    """
+    Resize the given 2-d (or 3-d (bands, rows, cols)) array to outsize
+    (ysize, xsize), with each output pixel the average of the input 
+    pixels it covers. For zooming out (where it avoids the aliasing of
+    nearest neighbour) but works for zooming in too.
+
+    Parameters are as for bilinearResample(). Pixels equal to ignore 
+    (and NaN) are left out of the average.
+
+    Returns
+    -------
+    numpy.ndarray
+        Same number of dimensions as arr
+
+    """
+    (ysize, xsize) = outsize
+    rowCount = ysize + dspTopExtra + dspBottomExtra
+    colCount = xsize + dspLeftExtra + dspRightExtra
+    outarr = resampler.average(arr, ignore, colCount, rowCount,
+        dspLeftExtra, dspTopExtra, xsize, ysize, nthreads, out)
+
+    return outarr
+
+
+def modeResample(arr, outsize, dspLeftExtra, dspTopExtra, 
+        dspRightExtra, dspBottomExtra, ignore, nthreads=1, out=None):
+    """
+    As averageResample() but each output pixel is the most common of 
+    the input pixels it covers. For thematic data.
+    """
+    (ysize, xsize) = outsize
+    rowCount = ysize + dspTopExtra + dspBottomExtra
+    colCount = xsize + dspLeftExtra + dspRightExtra
+    outarr = resampler.mode(arr, ignore, colCount, rowCount,
+        dspLeftExtra, dspTopExtra, xsize, ysize, nthreads, out)
+
+    return outarr
+
+
+def cubicResample(arr, outsize, dspLeftExtra, dspTopExtra, 
+        dspRightExtra, dspBottomExtra, ignore, nthreads=1, out=None):
+    """
+    As bilinearResample() but with a cubic (Catmull-Rom) filter, which
+    needs a margin of RESAMPLE_MARGINS['cubic'] pixels. Output pixels 
+    where less than half the filter is over valid (not ignore) pixels
+    are set to ignore.
+    """
+    (ysize, xsize) = outsize
+    rowCount = ysize + dspTopExtra + dspBottomExtra
+    colCount = xsize + dspLeftExtra + dspRightExtra
+    outarr = resampler.cubic(arr, ignore, colCount, rowCount,
+        dspLeftExtra, dspTopExtra, xsize, ysize, nthreads, out)
+
+    return outarr
+
+
+def lanczosResample(arr, outsize, dspLeftExtra, dspTopExtra, 
+        dspRightExtra, dspBottomExtra, ignore, nthreads=1, out=None):
+    """
+    As cubicResample() but with a 3 lobe Lanczos filter.
+    """
+    (ysize, xsize) = outsize
+    rowCount = ysize + dspTopExtra + dspBottomExtra
+    colCount = xsize + dspLeftExtra + dspRightExtra
+    outarr = resampler.lanczos(arr, ignore, colCount, rowCount,
+        dspLeftExtra, dspTopExtra, xsize, ysize, nthreads, out)
+
+    return outarr
+
+
 # Handy dictionary to lookup method in
-RESAMPLE_METHODS = {'near': replicateArray, 'bilinear': bilinearResample}
+RESAMPLE_METHODS = {'near': replicateArray, 'bilinear': bilinearResample,
+    'average': averageResample, 'mode': modeResample, 
+    'cubic': cubicResample, 'lanczos': lanczosResample}
+
+# The number of pixels of margin each method needs around the data when
+# zoomed in (the radius of the kernel).
+RESAMPLE_MARGINS = {'near': 0, 'bilinear': 1, 'average': 0, 'mode': 0,
+    'cubic': 2, 'lanczos': 3}
+
+# The methods that are also used when zoomed out. For the others GDAL 
+# decimates (nearest neighbour) the data as it is read.
+DOWNSAMPLE_METHODS = ('average', 'mode')
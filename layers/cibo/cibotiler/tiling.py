@@ -21,7 +21,29 @@ Based on code from TuiView.
 
 Main function is getTile(). An application may want to call
 createColorMapFromIntervals()/createColorMapFromPoints() to obtain
-a colormap in the correct format to getTile(). 
+a colormap in the correct format to getTile(). getTiles() gets many
+tiles from the one file at once and getMetaTile() a block of 
+neighbouring tiles.
+
+Files opened by filename are kept open (with their Metadata) in
+datasetCache so later calls (eg warm Lambda invocations) don't need to
+open them again. Encoded tiles are kept in tileCache so popular tiles
+aren't made again. Both are refreshed after DATASET_CACHE_TTL seconds,
+or call invalidate() as soon as a file changes.
+This can be backed by diskCache (eg in the /tmp of a warm Lambda) by 
+setting diskCache.maxBytes. getTile(..., prefetch=True) makes the 
+neighbouring tiles in the background (see prefetcher) so they are in
+tileCache when the client pans or zooms.
+
+getTileAsync() and getTileMosaicAsync() are for asyncio applications.
+They (and getTileMosaic()) do their reads and CPU work in the shared 
+thread pools of executors, so the number of reads (eg S3 requests) and
+tiles being made at once is bounded across all requests. See 
+executors.setLimits().
+
+Pass a TileStats as the stats parameter of these functions to find out 
+where the time making a tile goes (opening, reading, resampling, 
+encoding etc).
 
 The other functions in this module are for internal use
 and not intended for use by an application.
@@ -29,19 +51,101 @@ and not intended for use by an application.
 """
 
 import io
+import os
+import time
+import asyncio
+import hashlib
+import tempfile
 import threading
+import contextlib
+import collections
 import concurrent.futures
 import numpy
 from osgeo import gdal
 from osgeo import gdal_array
 
 from . import resamplerhelper
+from .resamplerhelper import resampler
+from . import encoder as nativeencoder
 
 gdal.UseExceptions()
 
 
 MERCATOR_TILE_SIZE = 512
 
+# Defaults for executors. Number of files getTileMosaic() and the async
+# functions read at once (same as the default for 
+# concurrent.futures.ThreadPoolExecutor) and the number of tiles the
+# async functions compose and encode at once.
+MOSAIC_READ_THREADS = min(32, (os.cpu_count() or 1) + 4)
+TILE_CPU_THREADS = os.cpu_count() or 1
+
+# zlib compression level and filter used for PNG with each of the
+# profiles accepted by getTile(). 'balanced' matches GDAL's defaults.
+PNG_PROFILES = {
+    'fast': (1, nativeencoder.FILTER_SUB),
+    'balanced': (6, nativeencoder.FILTER_ADAPTIVE),
+    'small': (9, nativeencoder.FILTER_ADAPTIVE)}
+
+# Encoded tiles that are all one color (usually empty tiles that are 
+# transparent) keyed on everything that went into them. They can be 
+# returned without encoding again. Cleared when it gets to 
+# SINGLE_COLOR_TILES_MAX entries.
+SINGLE_COLOR_TILES_MAX = 256
+singleColorTiles = {}
+singleColorTilesLock = threading.Lock()
+
+# When getFileKey() last had GDAL check each file. Cleared when it gets
+# to FILE_KEY_TIMES_MAX entries.
+FILE_KEY_TIMES_MAX = 1024
+fileKeyTimes = {}
+fileKeyTimesLock = threading.Lock()
+
+# Defaults for datasetCache. The number of files kept open, 
+# the number of seconds before they are opened again and the
+# number of datasets kept for each file (for concurrent readers).
+DATASET_CACHE_SIZE = 64
+DATASET_CACHE_TTL = 300
+DATASET_POOL_SIZE = min(8, os.cpu_count() or 1)
+
+# Default memory budget (in bytes) for tileCache. Well within the 
+# 512MB the Lambda has. And the number of seconds before a tile is 
+# made again (and the size and modification time of the file, which 
+# GDAL caches for network files, are checked again).
+TILE_CACHE_BYTES = 64 * 1024 * 1024
+TILE_CACHE_TTL = DATASET_CACHE_TTL
+
+# Defaults for diskCache. Where it goes, the most it can use (0 
+# disables it) and whether to cache the data read from the files as 
+# well as the encoded tiles.
+DISK_CACHE_DIR = os.path.join(tempfile.gettempdir(), 'cibotiler-cache')
+DISK_CACHE_BYTES = 0
+DISK_CACHE_BLOCKS = False
+
+# Defaults for prefetcher. Number of threads making the prefetched
+# tiles and the most pixels read from the file for the tiles prefetched
+# after each request.
+PREFETCH_THREADS = 2
+PREFETCH_READ_PIXELS = 4 * 1024 * 1024
+
+# Default for getRawImageChunk(). Whether to read all the bands with
+# one (dataset level) read rather than one read per band. For pixel
+# interleaved files this decodes each block once rather than once per 
+# band.
+MULTIBAND_READ = True
+
+# Default for RawImageChunk. Whether to ask GDAL if the window to read
+# is all empty (eg sparse tiles of a COG) and skip the read if so.
+# Only done when all the bands have a nodata value, as that is what
+# GDAL fills empty blocks with.
+CHECK_DATA_COVERAGE = True
+
+# Number of tiles getTiles() makes at once and the largest area (in 
+# pixels of the overview) it reads in one go. Tiles further apart
+# than this are read separately.
+BATCH_TILE_THREADS = os.cpu_count() or 1
+SHARED_READ_MAX_PIXELS = 4096 * 4096
+
 # Don't use the numbers from: http://epsg.io/3857
 # The correct numbers are here: https://github.com/OSGeo/gdal/blob/master/gdal/swig/python/gdal-utils/osgeo_utils/gdal2tiles.py#L278
 # Not sure why the difference...
@@ -51,7 +155,8 @@ MERCATOR_Y_ORIGIN = 20037508.342789244
 
 def getTile(filename, z, x, y, bands=None, rescaling=None, colormap=None, 
         resampling='near', fmt='PNG', tileSize=256, outTileType=numpy.uint8,
-        metadata=None):
+        metadata=None, nthreads=1, encoder='gdal', profile='balanced',
+        palette=True, prefetch=False, stats=None):
     """
     Main function. By opening the given file the correct web mercator
     tile is selected and extracted and converted into an image
@@ -84,8 +189,12 @@ def getTile(filename, z, x, y, bands=None, rescaling=None, colormap=None,
         A numpy array of shape (4, maxPixelValue) that defines the colormap
         to be applied to a single band image.
     resampling : str, optional
-        Name of resampling method to be used when zoomed in more than the 
-        image supported. Currently only 'near' and 'bilinear' is supported.
+        Name of resampling method. 'near', 'bilinear', 'cubic' and 
+        'lanczos' are used when zoomed in more than the image supports 
+        (GDAL decimates the data when zoomed out). 'average' (area 
+        weighted, leaving out nodata) and 'mode' (for thematic data) are
+        used at all zoom levels, which means the file can get away with
+        fewer overviews.
     fmt : str, optional
         Name of GDAL driver that creates the image format that needs to be
         returned. Defaults to 'PNG'
@@ -93,22 +202,98 @@ def getTile(filename, z, x, y, bands=None, rescaling=None, colormap=None,
         Size in pixels of the returned tile. The returned tile will be this
         size in both the x and y dimensions. Defaults to 256x256.
     outTileType : numpy dtype, optional
-        The type of the returned image. Defaults to uint8.
+        The type of the returned image. Either numpy.uint8 or numpy.uint16.
+        Defaults to uint8.
     metadata : instance of Metadata, optional
         If previously obtained, an instance of a Metadata for filename.
         Default is this will be obtained withing the function.
+    nthreads : int, optional
+        Number of threads each band is split between when resampling.
+        0 means use all CPUs. Defaults to 1.
+    encoder : str, optional
+        'gdal' to create the image with the GDAL driver named by fmt or
+        'native' to use the built in encoder which avoids the copies
+        through GDAL. 'native' only supports fmt of 'PNG' or 'WEBP'
+        (lossless, if built with WebP support). Defaults to 'gdal'.
+    profile : str, optional
+        How hard to try to compress PNG tiles. 'fast' (quickest to 
+        encode), 'balanced' or 'small' (smallest tiles). Defaults to 
+        'balanced'.
+    palette : bool, optional
+        If True and a colormap is given, a paletted PNG is returned
+        when the colormap fits in one (uint8 with up to 256 colors). This
+        is quicker to encode and smaller than RGBA. Defaults to True.
+    prefetch : bool, optional
+        If True, the neighbouring tiles (and the parent and children) 
+        are made in the background by prefetcher and put in tileCache.
+        This doesn't delay returning this tile. Only done when filename 
+        is a str and tileCache (or diskCache) is enabled. Defaults to 
+        False.
+    stats : TileStats, optional
+        If given, where the time making the tile went (and some counters)
+        is added to this. Defaults to None (not collected).
     
     Returns:
     io.BytesIO
         The binary data that contains the image tile.
 
     """
-    if isinstance(filename, gdal.Dataset):
-        ds = filename
-    else:
-        ds = gdal.Open(filename)
+    cacheKey = tileCache.makeKey([filename], z, x, y, bands, rescaling, 
+        colormap, resampling, fmt, tileSize, outTileType, encoder, profile,
+        palette)
+    if prefetch and cacheKey is not None:
+        prefetcher.schedule(filename, z, x, y, bands=bands, 
+            rescaling=rescaling, colormap=colormap, resampling=resampling,
+            fmt=fmt, tileSize=tileSize, outTileType=outTileType,
+            encoder=encoder, profile=profile, palette=palette)
+
+    result = tileCache.get(cacheKey)
+    if result is not None:
+        addCount(stats, 'tileCacheHits')
+        return result
+
+    # concurrent requests for the same tile wait for the first
+    return singleFlight.run(cacheKey, renderTile, filename, z, x, y, bands,
+        rescaling, colormap, resampling, fmt, tileSize, outTileType, 
+        metadata, nthreads, encoder, profile, palette, cacheKey, stats,
+        stats=stats)
+
+
+def renderTile(filename, z, x, y, bands, rescaling, colormap, resampling, 
+        fmt, tileSize, outTileType, metadata, nthreads, encoder, profile,
+        palette, cacheKey, stats):
+    """
+    Internal method. Makes the tile for getTile() (which has the same 
+    parameters) and puts it in tileCache under cacheKey.
+    """
+    tileData, data, dataslice, tilePalette, outsideIndex, nodataForBands = \
+        readTile(filename, z, x, y, bands, colormap, resampling, fmt, 
+            tileSize, outTileType, metadata, nthreads, palette, stats)
+    result = finishTile(tileData, data, dataslice, tilePalette, outsideIndex,
+        rescaling, colormap, nodataForBands, fmt, encoder, profile, stats)
+    tileCache.put(cacheKey, result)
+    return result
+
+
+def readTile(filename, z, x, y, bands, colormap, resampling, fmt, tileSize, 
+        outTileType, metadata, nthreads, palette, stats=None):
+    """
+    Internal method. Reads (and resamples) the data for renderTile().
+    Parameters are as for getTile().
+
+    Returns
+    -------
+    tuple of (tileData, data, dataslice, tilePalette, outsideIndex, 
+        nodataForBands)
+        To pass to finishTile()
+
+    """
+    ds, cachedMetadata = datasetCache.acquire(filename, stats)
     if metadata is None:
-        metadata = Metadata(ds)
+        metadata = cachedMetadata
+    if metadata is None:
+        with timeStage(stats, 'metadata'):
+            metadata = Metadata(ds)
 
     # TODO: should we always assume WebMercator tiling?
     tlx, tly, brx, bry = getExtentforWebMTile(z, x, y)
@@ -116,7 +301,51 @@ def getTile(filename, z, x, y, bands=None, rescaling=None, colormap=None,
     # bands
     if bands is None:
         bands = range(1, ds.RasterCount + 1)
-    elif len(bands) != 1 and len(bands) != 3 and len(bands) != 4:
+    numOutBands, tilePalette, outsideIndex = getOutputBands(bands, colormap,
+        fmt, outTileType, palette)
+
+    # final tile. The data is read straight into it when the types
+    # match and then converted in place by compose().
+    tileData = numpy.empty((numOutBands, tileSize, tileSize), 
+        dtype=outTileType)
+
+    try:
+        data, dataslice = getRawImageChunk(ds, metadata, 
+            tileSize, tileSize, tlx, tly, brx, bry, bands,
+            resampling, nthreads, tileData[:len(bands)], stats=stats)
+    finally:
+        # done with the file
+        datasetCache.release(filename, ds, cachedMetadata)
+    addCount(stats, 'outputPixels', tileSize * tileSize)
+
+    nodataForBands = [metadata.allIgnore[n - 1] for n in bands]
+    return (tileData, data, dataslice, tilePalette, outsideIndex, 
+        nodataForBands)
+
+
+def getOutputBands(bands, colormap, fmt, outTileType, palette):
+    """
+    Internal method. Checks the bands and works out the bands of the
+    final tile for getTile() and friends.
+
+    Parameters
+    ----------
+    bands : sequence of ints
+    colormap : numpy.array or None
+    fmt : str
+    outTileType : numpy dtype
+    palette : bool
+        As for getTile()
+
+    Returns
+    -------
+    tuple of (numOutBands, tilePalette, outsideIndex)
+        tilePalette and outsideIndex are as returned by 
+        getPaletteForColormap() when a paletted tile is to be written
+        (numOutBands is then 1).
+
+    """
+    if len(bands) != 1 and len(bands) != 3 and len(bands) != 4:
         raise ValueError('invalid number of bands (valid: 1, 3 or 4)')
 
     numOutBands = len(bands)
@@ -129,110 +358,273 @@ def getTile(filename, z, x, y, bands=None, rescaling=None, colormap=None,
         numOutBands = 4
     # otherwise we 4 bands already or have single band data (?)
 
-    data, dataslice = getRawImageChunk(ds, metadata, 
-        tileSize, tileSize, tlx, tly, brx, bry, bands,
-        resampling)
+    tilePalette, outsideIndex = None, 0
+    if colormap is not None and palette:
+        tilePalette, outsideIndex = getPaletteForColormap(colormap, fmt, 
+            outTileType)
+        if tilePalette is not None:
+            # just the index into the palette
+            numOutBands = 1
 
-    nodataForBands = [metadata.allIgnore[n - 1] for n in bands]
-    maxOutVal = numpy.iinfo(outTileType).max
+    return numOutBands, tilePalette, outsideIndex
 
-    # output MEM dataset to write into
-    gdalType = gdal_array.NumericTypeCodeToGDALTypeCode(outTileType)
-    mem = gdal.GetDriverByName('MEM').Create('', tileSize, 
-        tileSize, numOutBands, gdalType)
 
-    alphaset = False
-    nodataMask = None  # used (if set) when alphaset == False
+def finishTile(tileData, data, dataslice, tilePalette, outsideIndex, 
+        rescaling, colormap, nodataForBands, fmt, encoder, profile, 
+        stats=None):
+    """
+    Internal method. Turns the data read for a tile into the final 
+    encoded tile.
+
+    Parameters
+    ----------
+    tileData : numpy.array
+        The (numOutBands, tileSize, tileSize) array for the final tile.
+        data may be a view of this.
+    data, dataslice : 
+        As returned by getRawImageChunk()
+    tilePalette, outsideIndex : 
+        As returned by getOutputBands()
+    rescaling, colormap, fmt, encoder, profile : 
+        As for getTile()
+    nodataForBands : list of floats
+        The nodata value (or None) for each band
+    stats : TileStats, optional
+        As for getTile()
+
+    Returns
+    -------
+    io.BytesIO
+        The binary data that contains the image tile.
+
+    """
     if data is None:
         # no data available for this area - return all zeros
-        for n in range(4):
-            band = mem.GetRasterBand(n + 1)
-            band.Fill(0)
-        alphaset = True
-    else:
-        imgData = numpy.zeros((tileSize, tileSize), dtype=outTileType)
-        # rescale.
-        if rescaling is not None:
-            if len(rescaling) == 1:
-                # same rescaling to every band
-                minVal, maxVal = rescaling[0]
-                minMaxRange = maxVal - minVal
-                for n in range(len(bands)):
-                    # cope with 2d/3d
-                    databand = data
-                    if len(bands) > 1:
-                        databand = data[n]
-                    rescaleddata = (databand.astype(float) - minVal).clip(min=0) * (maxOutVal / minMaxRange)
-                    imgData[dataslice] = rescaleddata.clip(min=0, max=maxOutVal)
-                    band = mem.GetRasterBand(n + 1)
-                    band.WriteArray(imgData)
-                    if nodataForBands[n] is not None:
-                        mask = databand == nodataForBands[n]
-                        if nodataMask is None:
-                            nodataMask = mask
-                        else:
-                            nodataMask |= mask
+        numOutBands = tileData.shape[0]
+        if tilePalette is not None:
+            numOutBands = 4
+        with timeStage(stats, 'encode'):
+            return getSingleColorTile((0,) * numOutBands, tileData.shape[1:],
+                tileData.dtype, fmt, encoder, profile)
+
+    # rescale or apply the colormap and work out the alpha band
+    # (when not already supplied) from the nodata in one pass
+    with timeStage(stats, 'compose', kernel=True):
+        resampler.compose(data, tileData, dataslice[1].start, 
+            dataslice[0].start, rescaling, colormap, nodataForBands, 
+            outsideIndex)
+
+    with timeStage(stats, 'encode'):
+        result = encodeTile(tileData, fmt, encoder, profile, tilePalette)
+    return result
+
+
+def getTiles(filename, tiles, bands=None, rescaling=None, colormap=None,
+        resampling='near', fmt='PNG', tileSize=256, outTileType=numpy.uint8,
+        metadata=None, nthreads=1, encoder='gdal', profile='balanced',
+        palette=True):
+    """
+    Get many tiles from the one file. The same as calling getTile() for 
+    each tile but the data needed for all the tiles at each overview 
+    level is read at once and the tiles are then cut from that in 
+    parallel. Best for tiles that are near each other (eg when seeding
+    a cache or for a map view).
+
+    Parameters
+    ----------
+    filename : str or gdal.Dataset
+        The name of the file to extract the tiles from or an open GDAL
+        dataset object. As for getTile().
+    tiles : sequence of (z, x, y) tuples
+        The tiles to get.
+    bands, rescaling, colormap, resampling, fmt, tileSize, outTileType,
+    metadata, nthreads, encoder, profile, palette : 
+        As for getTile()
+
+    Returns
+    -------
+    list of io.BytesIO
+        The binary data that contains each image tile, in the same order
+        as tiles.
+
+    """
+    ds, cachedMetadata = datasetCache.acquire(filename)
+    if metadata is None:
+        metadata = cachedMetadata
+    if metadata is None:
+        metadata = Metadata(ds)
+
+    # bands
+    if bands is None:
+        bands = range(1, ds.RasterCount + 1)
+    numOutBands, tilePalette, outsideIndex = getOutputBands(bands, colormap,
+        fmt, outTileType, palette)
+    nodataForBands = [metadata.allIgnore[n - 1] for n in bands]
 
+    chunks = []
+    sharedReads = {}
+    try:
+        # work out what each tile needs and group by overview
+        groups = {}
+        for z, x, y in tiles:
+            tlx, tly, brx, bry = getExtentforWebMTile(z, x, y)
+            chunk = RawImageChunk(ds, metadata, tileSize, tileSize, tlx, tly, 
+                brx, bry, bands, resampling)
+            chunks.append(chunk)
+            if not chunk.empty:
+                groups.setdefault(chunk.selectedovi.index, []).append(chunk)
+
+        # do all the reading with the one dataset. Each tile gets the 
+        # buffer it is to be cut from and where that is in the overview.
+        for group in groups.values():
+            left = min(chunk.readxoff for chunk in group)
+            top = min(chunk.readyoff for chunk in group)
+            right = max(chunk.readxoff + chunk.readxsize for chunk in group)
+            bottom = max(chunk.readyoff + chunk.readysize for chunk in group)
+            if (right - left) * (bottom - top) <= SHARED_READ_MAX_PIXELS:
+                windows = [(left, top, right - left, bottom - top, group)]
             else:
-                if len(rescaling) != len(bands):
-                    raise ValueError("length of rescaling doesn't math number of bands")
-                for n, (minVal, maxVal) in enumerate(rescaling):
-                    minMaxRange = maxVal - minVal
-                    rescaleddata = (data[n].astype(float) - minVal).clip(min=0) * (maxOutVal / minMaxRange)
-                    imgData[dataslice] = rescaleddata.clip(min=0, max=maxOutVal)
-                    band = mem.GetRasterBand(n + 1)
-                    band.WriteArray(imgData)
-                    if nodataForBands[n] is not None:
-                        mask = data[n] == nodataForBands[n]
-                        if nodataMask is None:
-                            nodataMask = mask
-                        else:
-                            nodataMask |= mask
-
-            alphaset = len(bands) >= 4
-
-        elif colormap is not None:
-            # Note: currently can't specify rescaling AND colormap
-            _, maxCol = colormap.shape
-            data = data.clip(min=0, max=(maxCol - 1))
-            for n in range(4):
-                imgData[dataslice] = colormap[n][data]
-                band = mem.GetRasterBand(n + 1)
-                band.WriteArray(imgData)
-            alphaset = True
+                # too spread out - read each separately
+                windows = [(chunk.readxoff, chunk.readyoff, chunk.readxsize,
+                    chunk.readysize, [chunk]) for chunk in group]
+
+            for xoff, yoff, xsize, ysize, windowChunks in windows:
+                buffer = numpy.empty((len(bands), ysize, xsize), 
+                    dtype=group[0].dtype)
+                readBands(group[0].gdalBands, bands, xoff, yoff, xsize, ysize,
+                    buffer, MULTIBAND_READ)
+                for chunk in windowChunks:
+                    sharedReads[id(chunk)] = (buffer, xoff, yoff)
+    finally:
+        # done with the file
+        datasetCache.release(filename, ds, cachedMetadata)
+
+    def makeTile(chunk):
+        tileData = numpy.empty((numOutBands, tileSize, tileSize), 
+            dtype=outTileType)
+        data = None
+        if not chunk.empty:
+            buffer, xoff, yoff = sharedReads[id(chunk)]
+            # each thread reads through its own MEM dataset over the buffer
+            memDS = gdal_array.OpenArray(buffer)
+            memBands = [memDS.GetRasterBand(n + 1) for n in range(len(bands))]
+            data = chunk.read(memBands, range(1, len(bands) + 1), 
+                nodataForBands, nthreads, tileData[:len(bands)], 
+                xoff, yoff)
+        return finishTile(tileData, data, chunk.dataslice, tilePalette, 
+            outsideIndex, rescaling, colormap, nodataForBands, fmt, encoder,
+            profile)
+
+    if len(chunks) <= 1:
+        return [makeTile(chunk) for chunk in chunks]
+
+    with concurrent.futures.ThreadPoolExecutor(
+            max_workers=min(BATCH_TILE_THREADS, len(chunks))) as executor:
+        return list(executor.map(makeTile, chunks))
+
+
+def getMetaTile(filename, z, x, y, n=4, bands=None, rescaling=None, 
+        colormap=None, resampling='near', fmt='PNG', tileSize=256, 
+        outTileType=numpy.uint8, metadata=None, nthreads=1, encoder='gdal', 
+        profile='balanced', palette=True):
+    """
+    Get the n x n block of tiles (a "metatile") that contains the
+    given tile. The whole (n * tileSize) square is read, resampled and
+    composed at once so there are no extra reads (or resampling margins)
+    at the edges between the tiles. They are then encoded separately.
 
-        else:
-            # just copy data
-            for n in range(len(bands)):
-                # cope with 2d/3d
-                databand = data
-                if len(bands) > 1:
-                    databand = data[n]
-                imgData[dataslice] = databand
-                band = mem.GetRasterBand(n + 1)
-                band.WriteArray(imgData)
-                if nodataForBands[n] is not None:
-                    mask = databand == nodataForBands[n]
-                    if nodataMask is None:
-                        nodataMask = mask
-                    else:
-                        nodataMask |= mask
-
-            alphaset = len(bands) >= 4
-
-    if not alphaset:
-        band = mem.GetRasterBand(4)
-        if nodataMask is not None:
-            band.WriteArray(numpy.where(nodataMask, 
-                outTileType(0), outTileType(maxOutVal)))
-        else:
-            band.Fill(maxOutVal)
+    The metatiles are aligned so that their top left tile has x and y
+    that are multiples of n.
 
-    result = createBytesIOFromMEM(mem, fmt)
-    return result
+    Parameters
+    ----------
+    filename : str or gdal.Dataset
+        The name of the file to extract the tiles from or an open GDAL
+        dataset object. As for getTile().
+    z : int
+        Zoom level
+    x : int
+        X position on the web mercator grid of any tile in the metatile
+    y : int
+        Y position on the web mercator grid of any tile in the metatile
+    n : int, optional
+        The number of tiles across (and down) the metatile. Must be a 
+        power of 2 so the metatiles fit the tile grid exactly. Is 
+        reduced to the number of tiles at zoom level z if that is less. 
+        Defaults to 4.
+    bands, rescaling, colormap, resampling, fmt, tileSize, outTileType,
+    metadata, nthreads, encoder, profile, palette : 
+        As for getTile()
+
+    Returns
+    -------
+    dict of (z, x, y) tuples to io.BytesIO
+        The binary data that contains each of the n * n image tiles.
 
+    """
+    n = int(n)
+    if n < 1 or n & (n - 1) != 0:
+        raise ValueError('n must be a power of 2')
+    n = min(n, 2 ** int(z))
+    metaX = x - x % n
+    metaY = y - y % n
+    tlx, tly, _, _ = getExtentforWebMTile(z, metaX, metaY)
+    _, _, brx, bry = getExtentforWebMTile(z, metaX + n - 1, metaY + n - 1)
+    metaSize = n * tileSize
+
+    ds, cachedMetadata = datasetCache.acquire(filename)
+    if metadata is None:
+        metadata = cachedMetadata
+    if metadata is None:
+        metadata = Metadata(ds)
 
-def getDataForFile(filename, tileSize, tlx, tly, brx, bry, bands, resampling):
+    # bands
+    if bands is None:
+        bands = range(1, ds.RasterCount + 1)
+    numOutBands, tilePalette, outsideIndex = getOutputBands(bands, colormap,
+        fmt, outTileType, palette)
+
+    # read straight into the metatile as for getTile()
+    metaData = numpy.empty((numOutBands, metaSize, metaSize), 
+        dtype=outTileType)
+
+    try:
+        data, dataslice = getRawImageChunk(ds, metadata, 
+            metaSize, metaSize, tlx, tly, brx, bry, bands,
+            resampling, nthreads, metaData[:len(bands)])
+    finally:
+        # done with the file
+        datasetCache.release(filename, ds, cachedMetadata)
+
+    tiles = {}
+    if data is None:
+        # no data for any of them
+        if tilePalette is not None:
+            numOutBands = 4
+        for row in range(n):
+            for col in range(n):
+                tiles[(z, metaX + col, metaY + row)] = getSingleColorTile(
+                    (0,) * numOutBands, (tileSize, tileSize), outTileType,
+                    fmt, encoder, profile)
+        return tiles
+
+    nodataForBands = [metadata.allIgnore[bandnum - 1] for bandnum in bands]
+    resampler.compose(data, metaData, dataslice[1].start, 
+        dataslice[0].start, rescaling, colormap, nodataForBands, 
+        outsideIndex)
+
+    for row in range(n):
+        for col in range(n):
+            tileData = metaData[:, row * tileSize:(row + 1) * tileSize,
+                col * tileSize:(col + 1) * tileSize]
+            tiles[(z, metaX + col, metaY + row)] = encodeTile(tileData, 
+                fmt, encoder, profile, tilePalette)
+
+    return tiles
+
+
+def getDataForFile(filename, tileSize, tlx, tly, brx, bry, bands, resampling,
+        nthreads=1, stats=None):
     """
     Internal method. Intended to be called from a sub thread.
 
@@ -245,21 +637,26 @@ def getDataForFile(filename, tileSize, tlx, tly, brx, bry, bands, resampling):
         Bounds of the tile in webmercator
     bands : sequence of ints
     resampling: str    
+    nthreads: int
+    stats : TileStats or None
     
     Returns
     -------
     tuple of (data, dataslice, list of nodata)
 
     """
-    if isinstance(filename, gdal.Dataset):
-        ds = filename
-    else:
-        ds = gdal.Open(filename)
-    metadata = Metadata(ds)
+    ds, cachedMetadata = datasetCache.acquire(filename, stats)
+    metadata = cachedMetadata
+    if metadata is None:
+        with timeStage(stats, 'metadata'):
+            metadata = Metadata(ds)
 
-    data, dataslice = getRawImageChunk(ds, metadata, 
-        tileSize, tileSize, tlx, tly, brx, bry, bands,
-        resampling)
+    try:
+        data, dataslice = getRawImageChunk(ds, metadata,
+            tileSize, tileSize, tlx, tly, brx, bry, bands,
+            resampling, nthreads, stats=stats)
+    finally:
+        datasetCache.release(filename, ds, cachedMetadata)
 
     nodataForBands = [metadata.allIgnore[n - 1] for n in bands]
 
@@ -268,7 +665,8 @@ def getDataForFile(filename, tileSize, tlx, tly, brx, bry, bands, resampling):
 
 def getTileMosaic(filenames, z, x, y, bands=None, rescaling=None, colormap=None, 
         resampling='near', fmt='PNG', tileSize=256, outTileType=numpy.uint8,
-        metadata=None):
+        metadata=None, nthreads=1, stopWhenFull=False, encoder='gdal',
+        profile='balanced', palette=True, stats=None):
     """
     Similar to getTile() but takes a list of filenames. They are opened
     and read in parallel then mosaiced together.
@@ -305,8 +703,12 @@ def getTileMosaic(filenames, z, x, y, bands=None, rescaling=None, colormap=None,
         A numpy array of shape (4, maxPixelValue) that defines the colormap
         to be applied to a single band image.
     resampling : str, optional
-        Name of resampling method to be used when zoomed in more than the 
-        image supported. Currently only 'near' and 'bilinear' is supported.
+        Name of resampling method. 'near', 'bilinear', 'cubic' and 
+        'lanczos' are used when zoomed in more than the image supports 
+        (GDAL decimates the data when zoomed out). 'average' (area 
+        weighted, leaving out nodata) and 'mode' (for thematic data) are
+        used at all zoom levels, which means the file can get away with
+        fewer overviews.
     fmt : str, optional
         Name of GDAL driver that creates the image format that needs to be
         returned. Defaults to 'PNG'
@@ -314,10 +716,30 @@ def getTileMosaic(filenames, z, x, y, bands=None, rescaling=None, colormap=None,
         Size in pixels of the returned tile. The returned tile will be this
         size in both the x and y dimensions. Defaults to 256x256.
     outTileType : numpy dtype, optional
-        The type of the returned image. Defaults to uint8.
+        The type of the returned image. Either numpy.uint8 or numpy.uint16.
+        Defaults to uint8.
     metadata : instance of Metadata, optional
         If previously obtained, an instance of a Metadata for filename.
         Default is this will be obtained withing the function.
+    nthreads : int, optional
+        Number of threads each band is split between when resampling.
+        0 means use all CPUs. Defaults to 1.
+    stopWhenFull : bool, optional
+        If True, the files are read in priority order (last first) with
+        only as many reads outstanding as there are reading threads. Once
+        every pixel of the tile has valid data, the files not yet read are
+        skipped and reads still in progress are abandoned. Otherwise all 
+        the files are read at once. Defaults to False.
+    encoder : str, optional
+        'gdal' or 'native'. See getTile(). Defaults to 'gdal'.
+    profile : str, optional
+        'fast', 'balanced' or 'small'. See getTile(). Defaults to 
+        'balanced'.
+    palette : bool, optional
+        Whether to return a paletted PNG when a colormap is given. See 
+        getTile(). Defaults to True.
+    stats : TileStats, optional
+        See getTile(). The reads of all the files are added to it.
     
     Returns
     -------
@@ -325,136 +747,251 @@ def getTileMosaic(filenames, z, x, y, bands=None, rescaling=None, colormap=None,
         The binary data that contains the image tile.
 
     """
-
+    cacheKey = tileCache.makeKey(filenames, z, x, y, bands, rescaling, 
+        colormap, resampling, fmt, tileSize, outTileType, encoder, profile,
+        palette)
+    result = tileCache.get(cacheKey)
+    if result is not None:
+        addCount(stats, 'tileCacheHits')
+        return result
+
+    return singleFlight.run(cacheKey, renderTileMosaic, filenames, z, x, y,
+        bands, rescaling, colormap, resampling, fmt, tileSize, outTileType,
+        nthreads, stopWhenFull, encoder, profile, palette, cacheKey, stats,
+        stats=stats)
+
+
+def renderTileMosaic(filenames, z, x, y, bands, rescaling, colormap, 
+        resampling, fmt, tileSize, outTileType, nthreads, stopWhenFull, 
+        encoder, profile, palette, cacheKey, stats):
+    """
+    Internal method. Makes the tile for getTileMosaic() (which has the
+    same parameters) and puts it in tileCache under cacheKey.
+    """
     # TODO: should we always assume WebMercator tiling?
     tlx, tly, brx, bry = getExtentforWebMTile(z, x, y)
 
     # bands
-    if len(bands) != 1 and len(bands) != 3 and len(bands) != 4:
-        raise ValueError('invalid number of bands (valid: 1, 3 or 4)')
+    numOutBands, tilePalette, outsideIndex = getOutputBands(bands, colormap,
+        fmt, outTileType, palette)
+
+    tileData = numpy.full((numOutBands, tileSize, tileSize), outsideIndex,
+        dtype=outTileType)
+    filled = numpy.zeros((tileSize, tileSize), dtype=numpy.uint8)
+
+    # later files take priority so are read (and painted) first. Each 
+    # pixel is set from the first file that has data there.
+    priority = list(reversed(filenames))
+
+    # open and read the data in parallel. Results are painted as soon as
+    # all those with a higher priority have been.
+    executor = executors.io()
+    futures = {}
+    results = {}
+    nextSubmit = 0
+    nextPaint = 0
+    try:
+        while nextPaint < len(priority):
+            while nextSubmit < len(priority) and (not stopWhenFull or 
+                    len(futures) < executors.ioThreads):
+                future = executor.submit(getDataForFile, priority[nextSubmit], 
+                    tileSize, tlx, tly, brx, bry, bands, resampling, nthreads,
+                    stats)
+                futures[future] = nextSubmit
+                nextSubmit += 1
+
+            done, _ = concurrent.futures.wait(futures, 
+                return_when=concurrent.futures.FIRST_COMPLETED)
+            for future in done:
+                results[futures.pop(future)] = future.result()
+
+            inputs = []
+            while nextPaint in results:
+                data, dataslice, nodataForBands = results.pop(nextPaint)
+                nextPaint += 1
+                # None data will be outside of tile bounds
+                if data is not None:
+                    inputs.append((data, dataslice[1].start, dataslice[0].start,
+                        nodataForBands))
+
+            if len(inputs) > 0:
+                with timeStage(stats, 'compose', kernel=True):
+                    remaining = resampler.mosaic(inputs, tileData, filled, 
+                        rescaling, colormap)
+                if remaining == 0 and stopWhenFull:
+                    # tile complete - don't need anything else
+                    break
+    finally:
+        # the reads still going finish in the background
+        for future in futures:
+            future.cancel()
+    # if nothing painted then no data available for this area - all zeros
+    addCount(stats, 'outputPixels', tileSize * tileSize)
+
+    with timeStage(stats, 'encode'):
+        result = encodeTile(tileData, fmt, encoder, profile, tilePalette)
+    tileCache.put(cacheKey, result)
+    return result
 
-    numOutBands = len(bands)
-    if colormap is not None:
-        # color map when applied will give us 4 bands
-        numOutBands = 4
-        assert len(bands) == 1
-    elif len(bands) == 3:
-        # we'll fake an alpha here
-        numOutBands = 4
-    # otherwise we 4 bands already or have single band data (?)
 
-    # open and read all the data in parallel
-    with concurrent.futures.ThreadPoolExecutor() as executor:
-        futures = {executor.submit(getDataForFile, filename, tileSize, 
-            tlx, tly, brx, bry, bands, resampling): filename for filename in filenames}
-        results = []
-        for future in concurrent.futures.as_completed(futures):
-            results.append(future.result())
-            
-    maxOutVal = numpy.iinfo(outTileType).max
+async def getTileAsync(filename, z, x, y, bands=None, rescaling=None, 
+        colormap=None, resampling='near', fmt='PNG', tileSize=256, 
+        outTileType=numpy.uint8, metadata=None, nthreads=1, encoder='gdal',
+        profile='balanced', palette=True, prefetch=False, stats=None):
+    """
+    asyncio version of getTile(), with the same parameters and result.
+    The file is read in executors.io() and the tile composed and encoded 
+    in executors.cpu() so the event loop isn't blocked.
 
-    # output MEM dataset to write into
-    gdalType = gdal_array.NumericTypeCodeToGDALTypeCode(outTileType)
-    mem = gdal.GetDriverByName('MEM').Create('', tileSize, 
-        tileSize, numOutBands, gdalType)
+    Returns
+    -------
+    io.BytesIO
+        The binary data that contains the image tile.
 
-    # remove any None data in results - will be outside of tile bounds
-    results = [x for x in results if x[0] is not None]
+    """
+    loop = asyncio.get_running_loop()
+    # getting the cache key looks at the file, which may be on S3
+    cacheKey, result = await loop.run_in_executor(executors.io(), 
+        lookupTile, [filename], z, x, y, bands, rescaling, colormap, 
+        resampling, fmt, tileSize, outTileType, encoder, profile, palette)
+    if prefetch and cacheKey is not None:
+        prefetcher.schedule(filename, z, x, y, bands=bands, 
+            rescaling=rescaling, colormap=colormap, resampling=resampling,
+            fmt=fmt, tileSize=tileSize, outTileType=outTileType,
+            encoder=encoder, profile=profile, palette=palette)
+    if result is not None:
+        addCount(stats, 'tileCacheHits')
+        return result
+
+    async def render():
+        tileData, data, dataslice, tilePalette, outsideIndex, \
+            nodataForBands = await loop.run_in_executor(executors.io(), 
+                readTile, filename, z, x, y, bands, colormap, resampling, 
+                fmt, tileSize, outTileType, metadata, nthreads, palette, 
+                stats)
+        result = await loop.run_in_executor(executors.cpu(), finishTile, 
+            tileData, data, dataslice, tilePalette, outsideIndex, rescaling,
+            colormap, nodataForBands, fmt, encoder, profile, stats)
+        tileCache.put(cacheKey, result)
+        return result
+
+    return await singleFlight.runAsync(cacheKey, render, stats=stats)
+
+
+async def getTileMosaicAsync(filenames, z, x, y, bands=None, rescaling=None, 
+        colormap=None, resampling='near', fmt='PNG', tileSize=256, 
+        outTileType=numpy.uint8, metadata=None, nthreads=1, 
+        stopWhenFull=False, encoder='gdal', profile='balanced', 
+        palette=True, stats=None):
+    """
+    asyncio version of getTileMosaic(), with the same parameters and 
+    result. The files are read in executors.io() (with stopWhenFull, no 
+    more at once than it has threads) and the mosaicing and encoding done
+    in executors.cpu().
 
-    alphaset = False
-    if len(results) == 0:
-        # no data available for this area - return all zeros
-        for n in range(numOutBands):
-            band = mem.GetRasterBand(n + 1)
-            band.Fill(0)
-        alphaset = True
-    else:
-        imgData = numpy.zeros((numOutBands, tileSize, tileSize), dtype=outTileType)
-        nodataMask = numpy.ones((tileSize, tileSize), dtype=bool)  # start with all nodata
+    Returns
+    -------
+    io.BytesIO
+        The binary data that contains the image tile.
 
-        # rescale.
-        if rescaling is not None:
-            if len(rescaling) == 1:
-                # same rescaling to every band
-                minVal, maxVal = rescaling[0]
-                minMaxRange = maxVal - minVal
-                for data, dataslice, nodataForBands in results:
-                    for n in range(len(bands)):
-                        # cope with 2d/3d
-                        databand = data
-                        if len(bands) > 1:
-                            databand = data[n]
-                        mask = databand == nodataForBands[n]
-                        # Note logic different from getTile as we are filling in
-                        nodataMask[dataslice] &= mask
-
-                        rescaleddata = (databand.astype(float) - minVal).clip(min=0) * (maxOutVal / minMaxRange)
-                        rescaleddata = rescaleddata.clip(min=0, max=maxOutVal)
-                        imgData[n][dataslice] = numpy.where(mask, imgData[n][dataslice], rescaleddata)
+    """
+    loop = asyncio.get_running_loop()
+    cacheKey, result = await loop.run_in_executor(executors.io(), 
+        lookupTile, filenames, z, x, y, bands, rescaling, colormap, 
+        resampling, fmt, tileSize, outTileType, encoder, profile, palette)
+    if result is not None:
+        addCount(stats, 'tileCacheHits')
+        return result
+
+    async def render():
+        result = await renderTileMosaicAsync(filenames, z, x, y, bands, 
+            rescaling, colormap, resampling, fmt, tileSize, outTileType, 
+            nthreads, stopWhenFull, encoder, profile, palette, stats)
+        tileCache.put(cacheKey, result)
+        return result
+
+    return await singleFlight.runAsync(cacheKey, render, stats=stats)
+
+
+async def renderTileMosaicAsync(filenames, z, x, y, bands, rescaling, 
+        colormap, resampling, fmt, tileSize, outTileType, nthreads, 
+        stopWhenFull, encoder, profile, palette, stats):
+    """
+    Internal method. As renderTileMosaic() but for getTileMosaicAsync()
+    and doesn't put the tile in tileCache.
+    """
+    loop = asyncio.get_running_loop()
+    tlx, tly, brx, bry = getExtentforWebMTile(z, x, y)
+    numOutBands, tilePalette, outsideIndex = getOutputBands(bands, colormap,
+        fmt, outTileType, palette)
+
+    tileData = numpy.full((numOutBands, tileSize, tileSize), outsideIndex,
+        dtype=outTileType)
+    filled = numpy.zeros((tileSize, tileSize), dtype=numpy.uint8)
+
+    # same order and painting as renderTileMosaic()
+    priority = list(reversed(filenames))
+    ioExecutor = executors.io()
+    futures = {}
+    results = {}
+    nextSubmit = 0
+    nextPaint = 0
+    try:
+        while nextPaint < len(priority):
+            while nextSubmit < len(priority) and (not stopWhenFull or 
+                    len(futures) < executors.ioThreads):
+                future = loop.run_in_executor(ioExecutor, getDataForFile, 
+                    priority[nextSubmit], tileSize, tlx, tly, brx, bry, 
+                    bands, resampling, nthreads, stats)
+                futures[future] = nextSubmit
+                nextSubmit += 1
+
+            done, _ = await asyncio.wait(futures, 
+                return_when=asyncio.FIRST_COMPLETED)
+            for future in done:
+                results[futures.pop(future)] = future.result()
+
+            inputs = []
+            while nextPaint in results:
+                data, dataslice, nodataForBands = results.pop(nextPaint)
+                nextPaint += 1
+                if data is not None:
+                    inputs.append((data, dataslice[1].start, dataslice[0].start,
+                        nodataForBands))
+
+            if len(inputs) > 0:
+                remaining = await loop.run_in_executor(executors.cpu(), 
+                    timedCall, stats, 'compose', True, resampler.mosaic, 
+                    inputs, tileData, filled, rescaling, colormap)
+                if remaining == 0 and stopWhenFull:
+                    break
+    finally:
+        for future in futures:
+            future.cancel()
+    addCount(stats, 'outputPixels', tileSize * tileSize)
 
-            else:
-                if len(rescaling) != len(bands):
-                    raise ValueError("length of rescaling doesn't math number of bands")
-                for data, dataslice, nodataForBands in results:
-                    for n, (minVal, maxVal) in enumerate(rescaling):
-                        minMaxRange = maxVal - minVal
-
-                        mask = data[n] == nodataForBands[n]
-                        # Note logic different from getTile as we are filling in
-                        nodataMask[dataslice] &= mask
-
-                        rescaleddata = (data[n].astype(float) - minVal).clip(min=0) * (maxOutVal / minMaxRange)
-                        rescaleddata = rescaleddata.clip(min=0, max=maxOutVal)
-                        imgData[n][dataslice] = numpy.where(mask, imgData[n][dataslice], rescaleddata)
-
-            alphaset = len(bands) >= 4
-
-        elif colormap is not None:
-            # Note: currently can't specify rescaling AND colormap
-            _, maxCol = colormap.shape
-            for data, dataslice, nodataForBands in results:
-                data = data.clip(min=0, max=(maxCol - 1))
-                mask = data == nodataForBands[0]  # always single band
-                nodataMask[dataslice] &= mask
-                for n in range(4):
-
-                    imgData[n][dataslice] = numpy.where(mask, 
-                        imgData[n][dataslice], colormap[n][data])
-            alphaset = True
+    return await loop.run_in_executor(executors.cpu(), timedCall, stats, 
+        'encode', False, encodeTile, tileData, fmt, encoder, profile, 
+        tilePalette)
 
-        else:
-            # just copy data
-            for data, dataslice, nodataForBands in results:
-                for n in range(len(bands)):
-                    # cope with 2d/3d
-                    databand = data
-                    if len(bands) > 1:
-                        databand = data[n]
-
-                    mask = databand == nodataForBands[n]
-                    # Note logic different from getTile as we are filling in
-                    nodataMask[dataslice] &= mask
-
-                    imgData[n][dataslice] = numpy.where(mask, 
-                        imgData[n][dataslice], databand)
-
-            alphaset = len(bands) >= 4
-
-        # now write the data to the mem dataset
-        for n in range(numOutBands):
-            band = mem.GetRasterBand(n + 1)
-            band.WriteArray(imgData[n])
-
-        if not alphaset and numOutBands >= 4:
-            band = mem.GetRasterBand(4)
-            if nodataMask is not None:
-                band.WriteArray(numpy.where(nodataMask, 
-                outTileType(0), outTileType(maxOutVal)))
-            else:
-                band.Fill(maxOutVal)
 
-    result = createBytesIOFromMEM(mem, fmt)
-    return result
+def lookupTile(filenames, z, x, y, bands, rescaling, colormap, resampling, 
+        fmt, tileSize, outTileType, encoder, profile, palette):
+    """
+    Internal method. For the async functions. Parameters are as for
+    getTileMosaic().
+
+    Returns
+    -------
+    tuple of (key, io.BytesIO)
+        The key in tileCache (or None) and the tile if it is in there
+        (otherwise None).
+
+    """
+    cacheKey = tileCache.makeKey(filenames, z, x, y, bands, rescaling, 
+        colormap, resampling, fmt, tileSize, outTileType, encoder, profile,
+        palette)
+    return cacheKey, tileCache.get(cacheKey)
 
 
 def getExtentforWebMTile(z, x, y):
@@ -602,7 +1139,199 @@ def createColorMapFromRAT(filename, band=1):
     return result
 
 
-def createBytesIOFromMEM(mem, fmt):
+def getPaletteForColormap(colormap, fmt, outTileType):
+    """
+    Work out the palette to use for the paletted version of a tile with
+    the given colormap, if possible.
+
+    Parameters
+    ----------
+    colormap : numpy.array
+        A numpy array of shape (4, maxPixelValue) as passed to getTile().
+    fmt : str
+        Name of the image format. Only PNG supports a palette.
+    outTileType : numpy dtype
+        The type of the tile. Must be numpy.uint8 for a palette.
+
+    Returns
+    -------
+    tuple of (numpy.array, int)
+        The (4, n) uint8 palette and the index into it to use for
+        transparent pixels outside the data. The palette is the colormap
+        with a transparent color added if it doesn't already have one. 
+        (None, 0) if a palette can't be used.
+
+    """
+    colormap = numpy.asarray(colormap)
+    if (fmt.upper() != 'PNG' or numpy.dtype(outTileType) != numpy.uint8 or
+            colormap.dtype != numpy.uint8 or colormap.ndim != 2 or 
+            colormap.shape[0] != 4 or colormap.shape[1] > 256):
+        return None, 0
+
+    transparent = numpy.flatnonzero((colormap == 0).all(axis=0))
+    if len(transparent) > 0:
+        return colormap, int(transparent[0])
+
+    numColors = colormap.shape[1]
+    if numColors == 256:
+        # no room to add one
+        return None, 0
+    tilePalette = numpy.zeros((4, numColors + 1), dtype=numpy.uint8)
+    tilePalette[:, :numColors] = colormap
+    return tilePalette, numColors
+
+
+def getSingleColor(tileData):
+    """
+    Check whether a tile is all one color.
+
+    Parameters
+    ----------
+    tileData : numpy.array
+        A 3d array of (bands, rows, cols) with the tile.
+
+    Returns
+    -------
+    tuple of ints
+        The value of each band if the tile is all one color, otherwise
+        None.
+
+    """
+    first = tileData[:, :1, :1]
+    # check the first row before the whole tile so most tiles
+    # are quickly rejected
+    if not (tileData[:, 0] == first[:, 0]).all() or not (tileData == first).all():
+        return None
+    return tuple(int(val) for val in first.ravel())
+
+
+def getSingleColorTile(color, shape, dtype, fmt, encoder='gdal', 
+        profile='balanced'):
+    """
+    Get an encoded tile that is all one color. These are kept so they 
+    only need to be encoded once.
+
+    Parameters
+    ----------
+    color : tuple of ints
+        The value for each band.
+    shape : tuple of (int, int)
+        The size (rows, cols) of the tile.
+    dtype : numpy dtype
+        The type of the tile.
+    fmt, encoder, profile : str
+        As for encodeTile().
+
+    Returns
+    -------
+    io.BytesIO
+        The binary data that contains the image tile.
+
+    """
+    key = (color, tuple(shape), numpy.dtype(dtype).str, fmt, encoder, profile)
+    with singleColorTilesLock:
+        imageData = singleColorTiles.get(key)
+
+    if imageData is None:
+        tileData = numpy.empty((len(color),) + tuple(shape), dtype=dtype)
+        tileData[...] = numpy.array(color, dtype=dtype).reshape(-1, 1, 1)
+        imageData = encodeTileData(tileData, fmt, encoder, profile).getvalue()
+        with singleColorTilesLock:
+            if len(singleColorTiles) >= SINGLE_COLOR_TILES_MAX:
+                singleColorTiles.clear()
+            singleColorTiles[key] = imageData
+
+    return io.BytesIO(imageData)
+
+
+def encodeTile(tileData, fmt, encoder='gdal', profile='balanced', 
+        tilePalette=None):
+    """
+    Encode the final tile into the requested image format. Tiles that are
+    all one color are returned from those kept by getSingleColorTile().
+
+    Parameters
+    ----------
+    tileData : numpy.array
+        A 3d uint8 or uint16 array of (bands, rows, cols) with the tile
+        to encode.
+    fmt : str
+        Name of the image format. With encoder='gdal' this is the name 
+        of the GDAL driver to use. With encoder='native' this must be
+        'PNG' or 'WEBP'.
+    encoder : str, optional
+        'gdal' or 'native'. Defaults to 'gdal'.
+    profile : str, optional
+        One of the names in PNG_PROFILES. Defaults to 'balanced'.
+    tilePalette : numpy.array, optional
+        The (4, n) uint8 palette if tileData is a single band of indices
+        into it (only for PNG). See getPaletteForColormap().
+
+    Returns
+    -------
+    io.BytesIO
+        The binary data that contains the image tile.
+
+    """
+    color = getSingleColor(tileData)
+    if color is not None:
+        if tilePalette is not None:
+            color = tuple(int(val) for val in tilePalette[:, color[0]])
+        return getSingleColorTile(color, tileData.shape[1:], tileData.dtype,
+            fmt, encoder, profile)
+
+    return encodeTileData(tileData, fmt, encoder, profile, tilePalette)
+
+
+def encodeTileData(tileData, fmt, encoder='gdal', profile='balanced',
+        tilePalette=None):
+    """
+    Does the work for encodeTile(). Parameters and return are the same.
+    """
+    if profile not in PNG_PROFILES:
+        raise ValueError('profile must be one of %s' % ', '.join(PNG_PROFILES))
+    level, pngFilter = PNG_PROFILES[profile]
+
+    if encoder == 'native':
+        fmtUpper = fmt.upper()
+        if fmtUpper == 'PNG':
+            imageData = nativeencoder.encode_png(tileData, level, pngFilter,
+                tilePalette)
+        elif fmtUpper == 'WEBP':
+            if not nativeencoder.have_webp():
+                raise ValueError('native encoder not built with WebP support')
+            imageData = nativeencoder.encode_webp(tileData)
+        else:
+            raise ValueError('native encoder only supports PNG and WEBP')
+        return io.BytesIO(imageData)
+    elif encoder != 'gdal':
+        raise ValueError("encoder must be 'gdal' or 'native'")
+
+    # output MEM dataset to write into
+    numOutBands, ysize, xsize = tileData.shape
+    gdalType = gdal_array.NumericTypeCodeToGDALTypeCode(tileData.dtype)
+    mem = gdal.GetDriverByName('MEM').Create('', xsize, 
+        ysize, numOutBands, gdalType)
+    for n in range(numOutBands):
+        band = mem.GetRasterBand(n + 1)
+        band.WriteArray(tileData[n])
+
+    if tilePalette is not None:
+        colorTable = gdal.ColorTable()
+        for n in range(tilePalette.shape[1]):
+            colorTable.SetColorEntry(n, 
+                tuple(int(val) for val in tilePalette[:, n]))
+        mem.GetRasterBand(1).SetColorTable(colorTable)
+
+    options = []
+    if fmt.upper() == 'PNG':
+        options.append('ZLEVEL=%d' % level)
+
+    result = createBytesIOFromMEM(mem, fmt, options)
+    return result
+
+
+def createBytesIOFromMEM(mem, fmt, options=None):
     """
     Given a GDAL in memory dataset ("MEM" driver)
     convert to the given format and dump as a io.BytesIO for returning
@@ -616,6 +1345,8 @@ def createBytesIOFromMEM(mem, fmt):
     fmt : str
         Name of GDAL driver that creates the image format that needs to be
         returned. 
+    options : list of str, optional
+        Creation options for the driver.
 
     Returns
     -------
@@ -634,7 +1365,9 @@ def createBytesIOFromMEM(mem, fmt):
     # make the filename unique to this thread
     memName = '/vsimem/output_%d.png' % threading.get_ident()
 
-    ds = gdal.GetDriverByName(fmt).CreateCopy(memName, mem)
+    if options is None:
+        options = []
+    ds = gdal.GetDriverByName(fmt).CreateCopy(memName, mem, options=options)
     ds.FlushCache()
     
     f = gdal.VSIFOpenL(memName, 'rb')
@@ -828,64 +1561,1238 @@ class Metadata:
         self.tInverse = gdal.InvGeoTransform(self.transform)
 
 
-def pixel2displayF(col, row, origCol, origRow, imgPixPerWinPix):
+class DatasetCacheEntry:
     """
-    From tuiview - convert pixel coordinates to display as float
+    The Metadata and open datasets for one file in a DatasetCache.
 
-    Parameters
+    Attributes
     ----------
-    col : int
-        The column
-    row : int
-        The row
-    origCol : int
-        The column of the origin of the tile
-    origRow : int
-        The row of the origin of the tile
-    imgPixPerWinPix : float
-        The number of image pixels per tile pixel
-
-    Returns
-    -------
-    tuple of float
-        (x, y)
-
+    metadata : Metadata
+        The Metadata of the file
+    datasets : list of gdal.Dataset
+        The pool of datasets for the file that aren't being used
+    expires : float
+        time.monotonic() after which the file should be opened again
     """
-    x = (col - origCol) / imgPixPerWinPix
-    y = (row - origRow) / imgPixPerWinPix
-    return (x, y)
+    def __init__(self, metadata, expires):
+        self.metadata = metadata
+        self.datasets = []
+        self.expires = expires
 
 
-def pixel2display(col, row, origCol, origRow, imgPixPerWinPix):
+class DatasetCache:
     """
-    From tuiview - convert pixel coordinates to display - integer version
+    Thread safe LRU cache of open datasets and their Metadata, keyed on
+    filename.
+
+    GDAL datasets can't be used by more than one thread at a time so
+    each file has a pool of datasets. acquire() hands one out to the 
+    caller which must then give it back with release(). If they are all
+    in use (eg several threads reading the same file) another one is 
+    opened and kept in the pool when released (up to poolSize). So 
+    concurrent reads of a file don't wait for each other and, once
+    warm, don't open it again.
 
     Parameters
     ----------
-    col : int
-        The column
-    row : int
-        The row
-    origCol : int
-        The column of the origin of the tile
-    origRow : int
-        The row of the origin of the tile
-    imgPixPerWinPix : float
-        The number of image pixels per tile pixel
+    maxSize : int, optional
+        The maximum number of files to keep. 0 disables the cache.
+    ttl : float, optional
+        Number of seconds after a file is opened before it is opened 
+        again (to pick up any changes).
+    poolSize : int, optional
+        The maximum number of datasets kept for each file.
 
-    Returns
-    -------
-    tuple of int
-        (x, y)
+    Attributes
+    ----------
+    maxSize : int
+    ttl : float
+    poolSize : int
+        As above. May be changed at any time.
     """
-    x = int((col - origCol) / imgPixPerWinPix)
-    y = int((row - origRow) / imgPixPerWinPix)
-    return (x, y)
+    def __init__(self, maxSize=DATASET_CACHE_SIZE, ttl=DATASET_CACHE_TTL,
+            poolSize=DATASET_POOL_SIZE):
+        self.maxSize = maxSize
+        self.ttl = ttl
+        self.poolSize = poolSize
+        self.lock = threading.Lock()
+        self.entries = collections.OrderedDict()
+
+    def acquire(self, filename, stats=None):
+        """
+        Get an open dataset and the Metadata for filename.
 
+        Parameters
+        ----------
+        filename : str or gdal.Dataset
+            If a gdal.Dataset is passed it is returned as is.
+        stats : TileStats, optional
+            To add the time opening the file and reading the Metadata to.
 
-def getRawImageChunk(ds, metadata, xsize, ysize, tlx, tly, brx, bry, bands,
-        resampling):
-    """
+        Returns
+        -------
+        tuple of (gdal.Dataset, Metadata)
+            Metadata is None if filename is a gdal.Dataset
+
+        """
+        if isinstance(filename, gdal.Dataset):
+            return filename, None
+
+        ds = None
+        metadata = None
+        with self.lock:
+            entry = self.entries.get(filename)
+            if entry is not None:
+                if time.monotonic() > entry.expires:
+                    del self.entries[filename]
+                else:
+                    self.entries.move_to_end(filename)
+                    metadata = entry.metadata
+                    if len(entry.datasets) > 0:
+                        ds = entry.datasets.pop()
+
+        if ds is None:
+            with timeStage(stats, 'open'):
+                ds = gdal.Open(filename)
+        if metadata is None:
+            with timeStage(stats, 'metadata'):
+                metadata = Metadata(ds)
+            self.add(filename, metadata)
+
+        return ds, metadata
+
+    def add(self, filename, metadata):
+        """
+        Internal method. Adds a new entry for filename, dropping the
+        least recently used ones when there are too many.
+        """
+        with self.lock:
+            if self.maxSize <= 0:
+                return
+            entry = self.entries.get(filename)
+            if entry is not None and time.monotonic() <= entry.expires:
+                # another thread got there first
+                return
+            self.entries[filename] = DatasetCacheEntry(metadata, 
+                time.monotonic() + self.ttl)
+            self.entries.move_to_end(filename)
+            while len(self.entries) > self.maxSize:
+                self.entries.popitem(last=False)
+
+    def release(self, filename, ds, metadata):
+        """
+        Give back a dataset obtained by acquire(). It goes back in the 
+        pool for the next caller unless the pool is full or the entry has
+        since expired, been dropped or replaced.
+
+        Parameters
+        ----------
+        filename : str or gdal.Dataset
+        ds : gdal.Dataset
+        metadata : Metadata
+            As passed to and returned by acquire().
+
+        """
+        if isinstance(filename, gdal.Dataset):
+            return
+
+        with self.lock:
+            entry = self.entries.get(filename)
+            if (entry is not None and entry.metadata is metadata and 
+                    len(entry.datasets) < self.poolSize and 
+                    time.monotonic() <= entry.expires):
+                entry.datasets.append(ds)
+        # otherwise ds is closed when the last reference goes
+
+    def invalidate(self, filename=None):
+        """
+        Drop filename from the cache so it is opened again next time.
+
+        Parameters
+        ----------
+        filename : str, optional
+            The file to drop. If None, everything is dropped.
+
+        """
+        with self.lock:
+            if filename is None:
+                self.entries.clear()
+            else:
+                self.entries.pop(filename, None)
+
+
+# the cache used by getTile() and getTileMosaic()
+datasetCache = DatasetCache()
+
+
+class TileCache:
+    """
+    Thread safe LRU cache of encoded tiles with a memory budget. 
+    Optionally backed by a DiskCache which is checked when a tile isn't 
+    in memory.
+
+    The key includes the modification time and size of the files (see
+    getFileKey()) so tiles of a file that has since changed are made 
+    again once those are checked again, within TILE_CACHE_TTL seconds.
+    Tiles are also dropped from memory ttl seconds after being made as 
+    the modification time only has a resolution of one second (so may 
+    not change when a local file is rewritten at the same size).
+    invalidate() drops the tiles of a file straight away. Tiles from a
+    gdal.Dataset rather than a filename aren't cached.
+
+    Parameters
+    ----------
+    maxBytes : int, optional
+        Total size of the encoded tiles to keep. 0 disables the cache
+        (apart from diskCache).
+    diskCache : DiskCache, optional
+        The cache to check for tiles not in memory.
+    ttl : float, optional
+        Number of seconds a tile is kept in memory.
+
+    Attributes
+    ----------
+    maxBytes : int
+    ttl : float
+        As above. May be changed at any time.
+    hits : int
+        Number of tiles returned from the cache. Includes diskHits.
+    diskHits : int
+        Number of tiles returned from diskCache
+    misses : int
+        Number of tiles that had to be made
+    """
+    def __init__(self, maxBytes=TILE_CACHE_BYTES, diskCache=None,
+            ttl=TILE_CACHE_TTL):
+        self.maxBytes = maxBytes
+        self.diskCache = diskCache
+        self.ttl = ttl
+        self.lock = threading.Lock()
+        # values are (imageData, expires)
+        self.entries = collections.OrderedDict()
+        self.totalBytes = 0
+        self.hits = 0
+        self.diskHits = 0
+        self.misses = 0
+
+    def makeKey(self, filenames, z, x, y, bands, rescaling, colormap, 
+            resampling, fmt, tileSize, outTileType, encoder, profile,
+            palette):
+        """
+        Make the key for a tile. Parameters are as for getTileMosaic().
+
+        Returns
+        -------
+        tuple
+            The key, or None if the tile can't be cached (or the cache is
+            disabled).
+
+        """
+        if self.maxBytes <= 0 and (self.diskCache is None or 
+                self.diskCache.maxBytes <= 0):
+            return None
+
+        files = []
+        for filename in filenames:
+            if not isinstance(filename, str):
+                return None
+            files.append(getFileKey(filename))
+
+        if bands is not None:
+            bands = tuple(bands)
+        if rescaling is not None:
+            rescaling = tuple(tuple(minMax) for minMax in rescaling)
+        if colormap is not None:
+            colormap = numpy.ascontiguousarray(colormap)
+            colormap = (colormap.shape, colormap.dtype.str, 
+                hashlib.sha1(colormap.tobytes()).hexdigest())
+
+        return (tuple(files), z, x, y, bands, rescaling, colormap, resampling,
+            fmt, tileSize, numpy.dtype(outTileType).str, encoder, profile, 
+            bool(palette))
+
+    def get(self, key):
+        """
+        Get the tile for key (from makeKey()).
+
+        Returns
+        -------
+        io.BytesIO
+            The binary data of the tile, or None if not in the cache
+            (or key is None).
+
+        """
+        if key is None:
+            return None
+        with self.lock:
+            entry = self.entries.get(key)
+            if entry is not None:
+                imageData, expires = entry
+                if time.monotonic() > expires:
+                    self.remove(key)
+                else:
+                    self.entries.move_to_end(key)
+                    self.hits += 1
+                    return io.BytesIO(imageData)
+
+        imageData = None
+        if self.diskCache is not None:
+            imageData = self.diskCache.getTile(key)
+        if imageData is None:
+            with self.lock:
+                self.misses += 1
+            return None
+
+        with self.lock:
+            self.hits += 1
+            self.diskHits += 1
+        self.add(key, imageData)
+        return io.BytesIO(imageData)
+
+    def contains(self, key):
+        """
+        Returns True if the tile for key (from makeKey()) is in the cache.
+        Unlike get() this doesn't count as a hit or miss.
+        """
+        if key is None:
+            return False
+        with self.lock:
+            entry = self.entries.get(key)
+            if entry is not None and time.monotonic() <= entry[1]:
+                return True
+        return self.diskCache is not None and self.diskCache.hasTile(key)
+
+    def put(self, key, result):
+        """
+        Add the tile for key (from makeKey()). Does nothing if key is 
+        None.
+
+        Parameters
+        ----------
+        key : tuple
+        result : io.BytesIO
+            The encoded tile as returned by getTile()
+
+        """
+        if key is None:
+            return
+        imageData = result.getvalue()
+        self.add(key, imageData)
+        if self.diskCache is not None:
+            self.diskCache.putTile(key, imageData)
+
+    def add(self, key, imageData):
+        """
+        Internal method. Adds imageData to the tiles in memory, dropping
+        the least recently used ones to keep within maxBytes.
+        """
+        with self.lock:
+            if len(imageData) > self.maxBytes:
+                return
+            self.remove(key)
+            self.entries[key] = (imageData, time.monotonic() + self.ttl)
+            self.totalBytes += len(imageData)
+            while self.totalBytes > self.maxBytes:
+                _, (old, _) = self.entries.popitem(last=False)
+                self.totalBytes -= len(old)
+
+    def remove(self, key):
+        """
+        Internal method. Drops the tile for key (if there) from memory.
+        Must be called with lock held.
+        """
+        entry = self.entries.pop(key, None)
+        if entry is not None:
+            self.totalBytes -= len(entry[0])
+
+    def invalidate(self, filename):
+        """
+        Drop the tiles made from filename (including mosaics of it with
+        other files) from memory. Tiles in diskCache aren't dropped but
+        won't be used once the file is found to have changed (see 
+        getFileKey()).
+
+        Parameters
+        ----------
+        filename : str
+            The file whose tiles to drop.
+
+        """
+        with self.lock:
+            keys = [key for key in self.entries 
+                if any(fileKey[0] == filename for fileKey in key[0])]
+            for key in keys:
+                self.remove(key)
+
+    def stats(self):
+        """
+        Returns
+        -------
+        dict
+            With 'hits', 'diskHits', 'misses', 'tiles' (number in memory)
+            and 'bytes' (their total size).
+
+        """
+        with self.lock:
+            return {'hits': self.hits, 'diskHits': self.diskHits, 
+                'misses': self.misses, 'tiles': len(self.entries), 
+                'bytes': self.totalBytes}
+
+    def clear(self):
+        """
+        Drop all the tiles (but not the counters).
+        """
+        with self.lock:
+            self.entries.clear()
+            self.totalBytes = 0
+
+
+class TileStats:
+    """
+    Optional instrumentation for getTile(), getTileMosaic() and their 
+    async versions (the stats parameter). Collects the wall and CPU time
+    of each stage of making the tiles and some counters. Thread safe, so 
+    can be shared by the parallel reads of a mosaic (or many tiles).
+
+    The stages are 'open' (gdal.Open), 'metadata' (building Metadata), 
+    'overview' (choosing the overview and window to read), 'read' (GDAL 
+    reading the data), 'resample', 'compose' (rescaling or the colormap,
+    or mosaicing) and 'encode'. The CPU times are those of the Python 
+    thread doing the stage. For 'resample' and 'compose' the time inside
+    the resampler's kernels (over all the threads they use) is also 
+    collected, which is only measured while stats are being collected.
+
+    Attributes
+    ----------
+    stages : dict
+        Of stage name to a dict of 'wall' and 'cpu' (seconds) and 'count'
+    kernel : dict
+        'calls', 'pixels', 'wall' and 'cpu' of the resampler kernels (see
+        resampler.stop_timing())
+    counters : dict
+        Counts of 'tileCacheHits', 'coalesced' (waited for another 
+        request making the same tile), 'blockCacheHits' (reads from 
+        diskCache), 'emptyReads' (outside the file or no data there),
+        'bytesRead' and 'outputPixels'
+    overviews : list of int
+        The overview read from for each read (0 is full resolution)
+    """
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.stages = {}
+        self.kernel = {'calls': 0, 'pixels': 0, 'wall': 0.0, 'cpu': 0.0}
+        self.counters = collections.Counter()
+        self.overviews = []
+
+    @contextlib.contextmanager
+    def stage(self, name, kernel=False):
+        """
+        Context manager that adds the time spent in it to the stage 
+        called name. If kernel is True the time in the resampler's 
+        kernels is also collected.
+        """
+        if kernel:
+            resampler.start_timing()
+        wall = time.perf_counter()
+        cpu = time.thread_time()
+        try:
+            yield
+        finally:
+            wall = time.perf_counter() - wall
+            cpu = time.thread_time() - cpu
+            kernelTimes = resampler.stop_timing() if kernel else None
+            with self.lock:
+                times = self.stages.setdefault(name, 
+                    {'wall': 0.0, 'cpu': 0.0, 'count': 0})
+                times['wall'] += wall
+                times['cpu'] += cpu
+                times['count'] += 1
+                if kernelTimes is not None:
+                    for key, value in kernelTimes.items():
+                        self.kernel[key] += value
+
+    def add(self, name, value=1):
+        """
+        Add value to the counter called name.
+        """
+        with self.lock:
+            self.counters[name] += value
+
+    def addOverview(self, index):
+        """
+        Record a read from the given overview (0 is full resolution).
+        """
+        with self.lock:
+            self.overviews.append(index)
+
+    def asDict(self):
+        """
+        Returns
+        -------
+        dict
+            A copy of everything collected: 'stages', 'kernel', 'overviews'
+            and the counters. Also 'gdalCacheUsed', the bytes in GDAL's 
+            block cache now (GDAL doesn't count its hits).
+
+        """
+        with self.lock:
+            result = {'stages': {name: dict(times) 
+                    for name, times in self.stages.items()},
+                'kernel': dict(self.kernel), 
+                'overviews': list(self.overviews)}
+            for name in ('tileCacheHits', 'coalesced', 'blockCacheHits', 
+                    'emptyReads', 'bytesRead', 'outputPixels'):
+                result[name] = self.counters[name]
+        result['gdalCacheUsed'] = gdal.GetCacheUsed()
+        return result
+
+
+def timeStage(stats, name, kernel=False):
+    """
+    Internal method. Returns stats.stage(name, kernel), or a context 
+    manager that does nothing if stats is None.
+    """
+    if stats is None:
+        return contextlib.nullcontext()
+    return stats.stage(name, kernel)
+
+
+def addCount(stats, name, value=1):
+    """
+    Internal method. stats.add(name, value) if stats is not None.
+    """
+    if stats is not None:
+        stats.add(name, value)
+
+
+def timedCall(stats, name, kernel, fn, *args):
+    """
+    Internal method. Returns fn(*args), timed as the given stage of 
+    stats. For running in an executor.
+    """
+    with timeStage(stats, name, kernel):
+        return fn(*args)
+
+
+class SingleFlight:
+    """
+    Thread safe deduplication of concurrent requests for the same tile.
+    The first caller for a key makes the tile and any others that ask
+    for it in the meantime wait for that rather than making it again.
+    Uses the keys from TileCache.makeKey() so only applies to tiles
+    that can be cached.
+
+    Attributes
+    ----------
+    coalesced : int
+        Number of requests that waited for another's tile rather than
+        making it.
+    """
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.inflight = {}
+        self.coalesced = 0
+
+    def run(self, key, fn, *args, stats=None):
+        """
+        Calls fn(*args), unless it is already running for key in another
+        thread in which case waits for that and returns a copy of its 
+        result (or raises its exception). Always calls fn if key is None.
+
+        Parameters
+        ----------
+        key : tuple
+            From TileCache.makeKey(), or None
+        fn : function
+            Makes the tile, returning an io.BytesIO
+        stats : TileStats, optional
+            To count the request if it waits for another
+
+        Returns
+        -------
+        io.BytesIO
+            The binary data of the tile
+
+        """
+        if key is None:
+            return fn(*args)
+
+        leader, future = self.join(key)
+        if not leader:
+            addCount(stats, 'coalesced')
+            # each gets their own BytesIO as from the cache
+            return io.BytesIO(future.result())
+
+        try:
+            result = fn(*args)
+        except BaseException as e:
+            self.finish(key, future, exception=e)
+            raise
+        self.finish(key, future, result)
+        return result
+
+    async def runAsync(self, key, fn, *args, stats=None):
+        """
+        As run() but fn is an async function and the waiting is done
+        without blocking the event loop. Shares the requests in flight
+        with run().
+        """
+        if key is None:
+            return await fn(*args)
+
+        leader, future = self.join(key)
+        if not leader:
+            addCount(stats, 'coalesced')
+            return io.BytesIO(await asyncio.wrap_future(future))
+
+        try:
+            result = await fn(*args)
+        except BaseException as e:
+            self.finish(key, future, exception=e)
+            raise
+        self.finish(key, future, result)
+        return result
+
+    def join(self, key):
+        """
+        Internal method. Returns a tuple of (leader, future). leader is
+        True if the caller needs to make the tile and pass future to
+        finish(). Otherwise future gives the bytes of the tile.
+        """
+        with self.lock:
+            future = self.inflight.get(key)
+            if future is not None:
+                self.coalesced += 1
+                return False, future
+            future = concurrent.futures.Future()
+            self.inflight[key] = future
+            return True, future
+
+    def finish(self, key, future, result=None, exception=None):
+        """
+        Internal method. Passes the tile made (an io.BytesIO), or the 
+        exception raised, to those waiting on future.
+        """
+        with self.lock:
+            del self.inflight[key]
+        if exception is not None:
+            future.set_exception(exception)
+        else:
+            future.set_result(result.getvalue())
+
+    def stats(self):
+        """
+        Returns
+        -------
+        dict
+            With 'coalesced' and 'inflight' (the number of tiles being 
+            made now).
+
+        """
+        with self.lock:
+            return {'coalesced': self.coalesced, 
+                'inflight': len(self.inflight)}
+
+
+class TileExecutors:
+    """
+    The thread pools shared by getTileMosaic() and the async functions.
+    One for reading the files (which waits on S3 much of the time) and 
+    one for composing and encoding the tiles. Each is created on first 
+    use. The kernels release the GIL so the CPU pool can use all the 
+    CPUs.
+
+    Parameters
+    ----------
+    ioThreads : int, optional
+        Most files read at once
+    cpuThreads : int, optional
+        Most tiles composed and encoded at once
+
+    Attributes
+    ----------
+    ioThreads, cpuThreads : int
+        As above. Use setLimits() to change them.
+    """
+    def __init__(self, ioThreads=MOSAIC_READ_THREADS, 
+            cpuThreads=TILE_CPU_THREADS):
+        self.lock = threading.Lock()
+        self.ioThreads = ioThreads
+        self.cpuThreads = cpuThreads
+        self.ioExecutor = None
+        self.cpuExecutor = None
+
+    def setLimits(self, ioThreads=None, cpuThreads=None):
+        """
+        Change the number of threads in either pool (None leaves it as 
+        is). A pool already created is replaced. The old one isn't shut
+        down, as mosaics being made may still be submitting reads to it,
+        but its threads exit once it has no work and nothing refers to 
+        it.
+        """
+        # check both before changing either
+        if ioThreads is not None and ioThreads < 1:
+            raise ValueError('ioThreads must be at least 1')
+        if cpuThreads is not None and cpuThreads < 1:
+            raise ValueError('cpuThreads must be at least 1')
+
+        with self.lock:
+            if ioThreads is not None and ioThreads != self.ioThreads:
+                self.ioThreads = ioThreads
+                self.ioExecutor = None
+            if cpuThreads is not None and cpuThreads != self.cpuThreads:
+                self.cpuThreads = cpuThreads
+                self.cpuExecutor = None
+
+    def io(self):
+        """
+        Returns
+        -------
+        concurrent.futures.ThreadPoolExecutor
+            The pool for reading files
+        """
+        with self.lock:
+            if self.ioExecutor is None:
+                self.ioExecutor = concurrent.futures.ThreadPoolExecutor(
+                    max_workers=self.ioThreads, 
+                    thread_name_prefix='cibotiler-io')
+            return self.ioExecutor
+
+    def cpu(self):
+        """
+        Returns
+        -------
+        concurrent.futures.ThreadPoolExecutor
+            The pool for composing and encoding tiles
+        """
+        with self.lock:
+            if self.cpuExecutor is None:
+                self.cpuExecutor = concurrent.futures.ThreadPoolExecutor(
+                    max_workers=self.cpuThreads, 
+                    thread_name_prefix='cibotiler-cpu')
+            return self.cpuExecutor
+
+
+def getFileKey(filename):
+    """
+    Identify the current version of a file for the caches.
+
+    Parameters
+    ----------
+    filename : str
+        The file. Anything GDAL can open, eg /vsis3 paths. 
+
+    Returns
+    -------
+    tuple of (filename, mtime, size)
+        From gdal.VSIStatL(). mtime and size are None if it can't stat 
+        the file.
+
+    """
+    # GDAL caches the stat of network files for the life of the 
+    # process so clear that every TILE_CACHE_TTL seconds to see changes
+    now = time.monotonic()
+    with fileKeyTimesLock:
+        checked = fileKeyTimes.get(filename)
+        expired = checked is not None and now - checked > TILE_CACHE_TTL
+        if checked is None or expired:
+            if len(fileKeyTimes) >= FILE_KEY_TIMES_MAX:
+                fileKeyTimes.clear()
+            fileKeyTimes[filename] = now
+    if expired:
+        gdal.VSICurlPartialClearCache(filename)
+
+    try:
+        stat = gdal.VSIStatL(filename)
+    except RuntimeError:
+        stat = None
+    if stat is None:
+        return (filename, None, None)
+    return (filename, stat.mtime, stat.size)
+
+
+class DiskCache:
+    """
+    Cache of encoded tiles, and optionally the data read from the files,
+    in a directory (eg the /tmp that a warm Lambda keeps between 
+    invocations).
+
+    Safe for many threads and processes to share the directory. Files 
+    are written elsewhere and then renamed into place so are never seen
+    half written, and files being removed by another process are just
+    misses. The oldest (by last use) are removed when the total size 
+    gets over maxBytes. Data is stored as .npy files that are memory 
+    mapped when read so aren't copied.
+
+    Parameters
+    ----------
+    directory : str, optional
+        Where to keep the cache. Created if needed.
+    maxBytes : int, optional
+        The most the cache can use. 0 disables it.
+    cacheBlocks : bool, optional
+        Whether to cache the data read from the files as well.
+
+    Attributes
+    ----------
+    directory : str
+    maxBytes : int
+    cacheBlocks : bool
+        As above. May be changed at any time.
+    """
+    def __init__(self, directory=DISK_CACHE_DIR, maxBytes=DISK_CACHE_BYTES,
+            cacheBlocks=DISK_CACHE_BLOCKS):
+        self.directory = directory
+        self.maxBytes = maxBytes
+        self.cacheBlocks = cacheBlocks
+        self.lock = threading.Lock()
+        # bytes this process has written since the size was last checked
+        self.bytesSinceTrim = 0
+
+    def getPath(self, key, ext):
+        """
+        Internal method. The path of the file for key.
+        """
+        name = hashlib.sha1(repr(key).encode()).hexdigest()
+        return os.path.join(self.directory, name + ext)
+
+    def touch(self, path):
+        """
+        Internal method. Mark path as just used for the LRU.
+        """
+        try:
+            os.utime(path)
+        except OSError:
+            pass
+
+    def write(self, path, writeFunc):
+        """
+        Internal method. Calls writeFunc with a file object for a 
+        temporary file and then renames it to path.
+        """
+        try:
+            os.makedirs(self.directory, exist_ok=True)
+            fd, tmpPath = tempfile.mkstemp(dir=self.directory, 
+                prefix='.tmp')
+        except OSError:
+            return
+        try:
+            with os.fdopen(fd, 'wb') as fileObj:
+                writeFunc(fileObj)
+            size = os.path.getsize(tmpPath)
+            os.replace(tmpPath, path)
+        except OSError:
+            # eg out of space
+            try:
+                os.remove(tmpPath)
+            except OSError:
+                pass
+            return
+
+        with self.lock:
+            self.bytesSinceTrim += size
+            trim = self.bytesSinceTrim > self.maxBytes // 16
+            if trim:
+                self.bytesSinceTrim = 0
+        if trim:
+            self.trim()
+
+    def trim(self):
+        """
+        Remove the least recently used files until the cache is within
+        maxBytes (with some room to spare so this isn't done every time).
+        """
+        entries = []
+        total = 0
+        now = time.time()
+        try:
+            names = os.listdir(self.directory)
+        except OSError:
+            return
+        for name in names:
+            path = os.path.join(self.directory, name)
+            try:
+                stat = os.stat(path)
+            except OSError:
+                continue
+            if name.startswith('.tmp'):
+                # left by a process that died while writing?
+                if now - stat.st_mtime > 3600:
+                    entries.append((0, stat.st_size, path))
+                continue
+            entries.append((stat.st_mtime, stat.st_size, path))
+            total += stat.st_size
+
+        entries.sort()
+        target = self.maxBytes * 0.9
+        for mtime, size, path in entries:
+            if total <= target and mtime != 0:
+                break
+            try:
+                os.remove(path)
+            except OSError:
+                continue
+            if mtime != 0:
+                total -= size
+
+    def getTile(self, key):
+        """
+        Returns
+        -------
+        bytes
+            The encoded tile for key (from TileCache.makeKey()) or None.
+        """
+        if self.maxBytes <= 0:
+            return None
+        path = self.getPath(key, '.tile')
+        try:
+            with open(path, 'rb') as fileObj:
+                imageData = fileObj.read()
+        except OSError:
+            return None
+        self.touch(path)
+        return imageData
+
+    def hasTile(self, key):
+        """
+        Returns True if the encoded tile for key is in the cache.
+        """
+        if self.maxBytes <= 0:
+            return False
+        return os.path.exists(self.getPath(key, '.tile'))
+
+    def putTile(self, key, imageData):
+        """
+        Add the encoded tile (bytes) for key to the cache.
+        """
+        if self.maxBytes <= 0:
+            return
+        self.write(self.getPath(key, '.tile'), 
+            lambda fileObj: fileObj.write(imageData))
+
+    def makeBlockKey(self, filename, overview, bands, xoff, yoff, xsize, 
+            ysize, shape, dtype):
+        """
+        Make the key for some data read from a file.
+
+        Parameters
+        ----------
+        filename : str
+            The file read from.
+        overview : int
+            The index of the overview (0 for full res).
+        bands : tuple of ints
+            The bands read.
+        xoff, yoff, xsize, ysize : int
+            The window read.
+        shape : tuple of ints
+            The shape of the data read.
+        dtype : numpy dtype
+            The type of the data read.
+
+        Returns
+        -------
+        tuple
+            The key, or None if blocks aren't being cached (or this 
+            data can't be).
+
+        """
+        if self.maxBytes <= 0 or not self.cacheBlocks or not filename:
+            return None
+        return (getFileKey(filename), overview, bands, xoff, yoff, xsize,
+            ysize, shape, numpy.dtype(dtype).str)
+
+    def getBlock(self, key):
+        """
+        Returns
+        -------
+        numpy.ndarray
+            A read only memory map of the data for key (from 
+            makeBlockKey()), or None if not in the cache (or key is None).
+        """
+        if key is None:
+            return None
+        path = self.getPath(key, '.npy')
+        try:
+            data = numpy.load(path, mmap_mode='r')
+        except (OSError, ValueError):
+            return None
+        self.touch(path)
+        return data
+
+    def putBlock(self, key, data):
+        """
+        Add the data for key to the cache. Does nothing if key is None.
+        """
+        if key is None:
+            return
+        self.write(self.getPath(key, '.npy'), 
+            lambda fileObj: numpy.save(fileObj, data))
+
+
+class PrefetchJob:
+    """
+    The tiles being prefetched after one request. Returned by 
+    Prefetcher.schedule().
+
+    Attributes
+    ----------
+    tiles : list of (z, x, y) tuples
+        The tiles made so far. 
+    pixelsRead : int
+        The (estimated) number of pixels read from the file for them.
+    """
+    def __init__(self):
+        self.cancelled = threading.Event()
+        self.done = threading.Event()
+        self.tiles = []
+        self.pixelsRead = 0
+
+    def cancel(self):
+        """
+        Stop making tiles. The one being made is finished.
+        """
+        self.cancelled.set()
+
+
+class Prefetcher:
+    """
+    Makes the tiles around a requested one in the background so they are
+    in tileCache when the client pans or zooms. The neighbours at the 
+    same zoom level are done first, then the parent and then the 
+    children.
+
+    Jobs are only run on idle threads: if all the threads are busy the
+    request isn't prefetched for rather than queued. Each job stops when
+    the next tile would take the pixels read from the file over its 
+    budget. 
+
+    Parameters
+    ----------
+    nthreads : int, optional
+        Number of threads making tiles. 0 disables prefetching.
+    maxPixels : int, optional
+        The most pixels each job can read from the file (summed over
+        the bands and including the margins for resampling).
+
+    Attributes
+    ----------
+    nthreads : int
+    maxPixels : int
+        As above. maxPixels may be changed at any time.
+    """
+    def __init__(self, nthreads=PREFETCH_THREADS, 
+            maxPixels=PREFETCH_READ_PIXELS):
+        self.nthreads = nthreads
+        self.maxPixels = maxPixels
+        self.lock = threading.Lock()
+        self.executor = None
+        self.jobs = set()
+
+    def schedule(self, filename, z, x, y, **kwargs):
+        """
+        Start prefetching around a tile.
+
+        Parameters
+        ----------
+        filename : str
+        z, x, y : int
+            The tile requested.
+        kwargs
+            The other arguments to getTile() for the tiles.
+
+        Returns
+        -------
+        PrefetchJob
+            So it can be cancelled, or None if there are no idle threads.
+
+        """
+        job = PrefetchJob()
+        with self.lock:
+            if len(self.jobs) >= self.nthreads:
+                return None
+            if self.executor is None:
+                self.executor = concurrent.futures.ThreadPoolExecutor(
+                    self.nthreads, thread_name_prefix='cibotiler-prefetch')
+            self.jobs.add(job)
+            self.executor.submit(self.run, job, filename, z, x, y, kwargs)
+        return job
+
+    def cancel(self):
+        """
+        Cancel all the running jobs.
+        """
+        with self.lock:
+            for job in self.jobs:
+                job.cancel()
+
+    def run(self, job, filename, z, x, y, kwargs):
+        """
+        Internal method. Makes the tiles for job.
+        """
+        try:
+            for tile in self.planTiles(job, filename, z, x, y, kwargs):
+                if job.cancelled.is_set():
+                    break
+                getTile(filename, *tile, **kwargs)
+                job.tiles.append(tile)
+        except Exception:
+            # these are just guesses so errors are for the real request
+            pass
+        finally:
+            with self.lock:
+                self.jobs.discard(job)
+            job.done.set()
+
+    def planTiles(self, job, filename, z, x, y, kwargs):
+        """
+        Internal method. Returns the tiles around (z, x, y) to make that 
+        aren't already in tileCache and are within the budget.
+        """
+        ntiles = 2**z
+        candidates = []
+        for dy in (-1, 0, 1):
+            for dx in (-1, 0, 1):
+                if dx != 0 or dy != 0:
+                    # x wraps around the antimeridian
+                    candidates.append((z, (x + dx) % ntiles, y + dy))
+        if z > 0:
+            candidates.append((z - 1, x // 2, y // 2))
+        for dy in (0, 1):
+            for dx in (0, 1):
+                candidates.append((z + 1, x * 2 + dx, y * 2 + dy))
+
+        tileSize = kwargs['tileSize']
+        ds, metadata = datasetCache.acquire(filename)
+        try:
+            bands = kwargs['bands']
+            if bands is None:
+                bands = range(1, ds.RasterCount + 1)
+
+            tiles = []
+            for tile in candidates:
+                tz, tx, ty = tile
+                if ty < 0 or ty >= 2**tz:
+                    continue
+                key = tileCache.makeKey([filename], tz, tx, ty, 
+                    kwargs['bands'], kwargs['rescaling'], 
+                    kwargs['colormap'], kwargs['resampling'], kwargs['fmt'],
+                    tileSize, kwargs['outTileType'], kwargs['encoder'], 
+                    kwargs['profile'], kwargs['palette'])
+                if tileCache.contains(key):
+                    continue
+
+                tlx, tly, brx, bry = getExtentforWebMTile(tz, tx, ty)
+                chunk = RawImageChunk(ds, metadata, tileSize, tileSize, 
+                    tlx, tly, brx, bry, bands, kwargs['resampling'])
+                if chunk.empty:
+                    continue
+                pixels = chunk.readxsize * chunk.readysize * len(bands)
+                if job.pixelsRead + pixels > self.maxPixels:
+                    break
+                job.pixelsRead += pixels
+                tiles.append(tile)
+        finally:
+            datasetCache.release(filename, ds, metadata)
+
+        return tiles
+
+
+# the caches (and request coalescing) used by getTile() and getTileMosaic()
+diskCache = DiskCache()
+tileCache = TileCache(diskCache=diskCache)
+singleFlight = SingleFlight()
+# the thread pools used by getTileMosaic() and the async functions
+executors = TileExecutors()
+# used by getTile(..., prefetch=True)
+prefetcher = Prefetcher()
+
+
+def invalidate(filename=None):
+    """
+    Call when a file has changed (or been removed) so the next tiles are
+    made from the new version rather than coming from the caches. Drops
+    the file from datasetCache, its tiles from tileCache and GDAL's 
+    cache of its size, modification time and data (for network files).
+
+    Parameters
+    ----------
+    filename : str, optional
+        The file that changed. If None, all the files are dropped.
+
+    """
+    datasetCache.invalidate(filename)
+    with fileKeyTimesLock:
+        if filename is None:
+            fileKeyTimes.clear()
+        else:
+            fileKeyTimes.pop(filename, None)
+    if filename is None:
+        tileCache.clear()
+        gdal.VSICurlClearCache()
+    else:
+        tileCache.invalidate(filename)
+        gdal.VSICurlPartialClearCache(filename)
+
+
+def pixel2displayF(col, row, origCol, origRow, imgPixPerWinPix):
+    """
+    From tuiview - convert pixel coordinates to display as float
+
+    Parameters
+    ----------
+    col : int
+        The column
+    row : int
+        The row
+    origCol : int
+        The column of the origin of the tile
+    origRow : int
+        The row of the origin of the tile
+    imgPixPerWinPix : float
+        The number of image pixels per tile pixel
+
+    Returns
+    -------
+    tuple of float
+        (x, y)
+
+    """
+    x = (col - origCol) / imgPixPerWinPix
+    y = (row - origRow) / imgPixPerWinPix
+    return (x, y)
+
+
+def pixel2display(col, row, origCol, origRow, imgPixPerWinPix):
+    """
+    From tuiview - convert pixel coordinates to display - integer version
+
+    Parameters
+    ----------
+    col : int
+        The column
+    row : int
+        The row
+    origCol : int
+        The column of the origin of the tile
+    origRow : int
+        The row of the origin of the tile
+    imgPixPerWinPix : float
+        The number of image pixels per tile pixel
+
+    Returns
+    -------
+    tuple of int
+        (x, y)
+    """
+    x = int((col - origCol) / imgPixPerWinPix)
+    y = int((row - origRow) / imgPixPerWinPix)
+    return (x, y)
+
+
+def getRawImageChunk(ds, metadata, xsize, ysize, tlx, tly, brx, bry, bands,
+        resampling, nthreads=1, out=None, multiband=None, stats=None):
+    """
     Also adapted from tuiview. returns requested chunk of image. Returns 
     the data and the dataslice that the data fits into the (ysize, xsize)
     output data.
@@ -905,15 +2812,28 @@ def getRawImageChunk(ds, metadata, xsize, ysize, tlx, tly, brx, bry, bands,
     bands : sequence of ints
         The bands to read from
     resampling : str
-        Name of resampling method to be used when zoomed in more than the 
-        image supported. Currently only 'near' is supported.
+        Name of resampling method. See getTile().
+    nthreads : int, optional
+        Number of threads the resampling of the bands is split between.
+    out : numpy.ndarray, optional
+        A (len(bands), ysize, xsize) array to write the data into (at
+        the returned slice) rather than allocating a new one. Only used
+        if it has the same dtype as the bands, in which case the returned
+        data is a view of it.
+    multiband : bool, optional
+        Whether to read all the bands at once. See readBands(). Defaults
+        to MULTIBAND_READ.
+    stats : TileStats, optional
+        To add the 'overview', 'read' and 'resample' times (and counts)
+        to.
 
     Returns
     -------
     tuple 
         The output data and slice. The first element of the tuple is the data
         read from the file. This may be None if the requested bounds are outside 
-        of the file. If a single band was requested this will be a 2 dimensional
+        of the file, or the file has no data there (see CHECK_DATA_COVERAGE).
+        If a single band was requested this will be a 2 dimensional
         array, otherwise it will be 3 dimensional
         The second element of the tuple is a slice object that defines where
         in the output tile to write the data. If the size of the returned
@@ -922,35 +2842,89 @@ def getRawImageChunk(ds, metadata, xsize, ysize, tlx, tly, brx, bry, bands,
         requested bounds is within the image.
 
     """
-    
-    if resampling not in resamplerhelper.RESAMPLE_METHODS:
-        raise ValueError('Unknown resample method {}'.format(resampling))
-    resampleMethod = resamplerhelper.RESAMPLE_METHODS[resampling]
-
-    # work out number of pixels
-    imgPix_x = (brx - tlx) / metadata.transform[1]
-    imgPix_y = (bry - tly) / metadata.transform[5]
-    imgPixPerWinPix = imgPix_x / xsize
-
-    # now work out which overview to use
-    origPixLeft, origPixTop = gdal.ApplyGeoTransform(metadata.tInverse, tlx, tly)
-    origPixRight = origPixLeft + imgPix_x
-    origPixBottom = origPixTop + imgPix_y
-    imgPixPerWinPix = (origPixRight - origPixLeft) / xsize
-    selectedovi = metadata.overviews.findBestOverview(imgPixPerWinPix)
-
-    # from TuiView
-    # first check that we are out of the area
-    dataslice = None
-    if origPixTop < 0 and origPixBottom < 0:
-        data = None
-    elif origPixLeft < 0 and origPixRight < 0:
-        data = None
-    elif origPixLeft > metadata.RasterXSize and origPixRight > metadata.RasterXSize:
-        data = None
-    elif origPixTop > metadata.RasterYSize and origPixBottom > metadata.RasterYSize:
-        data = None
-    else:
+    with timeStage(stats, 'overview'):
+        chunk = RawImageChunk(ds, metadata, xsize, ysize, tlx, tly, brx, bry, 
+            bands, resampling)
+    if chunk.outside or chunk.empty:
+        addCount(stats, 'emptyReads')
+        return None, None
+    if stats is not None:
+        stats.addOverview(chunk.selectedovi.index)
+
+    ignore = [metadata.allIgnore[bandnum - 1] for bandnum in bands]
+    data = chunk.read(chunk.gdalBands, bands, ignore, nthreads, out, 
+        multiband=multiband, cacheBlocks=True, stats=stats)
+    return data, chunk.dataslice
+
+
+class RawImageChunk:
+    """
+    Works out where (and from which overview) the data for a chunk of
+    image comes from and where it goes in the output. Used by
+    getRawImageChunk(), and getTiles() which uses the same information
+    to read many chunks at once.
+
+    Parameters are the same as getRawImageChunk().
+
+    Attributes
+    ----------
+    outside : bool
+        True if the requested bounds are outside of the file. The other
+        attributes are then not set (dataslice is None).
+    empty : bool
+        True if the file has no data for the window to read (see 
+        CHECK_DATA_COVERAGE), so it would be all nodata. Also True when 
+        outside.
+    selectedovi : OverviewInfo
+        The overview to read from
+    gdalBands : list of gdal.Band
+        The bands (or overviews) of ds to read from
+    dtype : numpy dtype
+        The type to read the bands as
+    readxoff, readyoff, readxsize, readysize : int
+        The window of selectedovi to read, including any margin the
+        resampling needs.
+    readNative : bool
+        Whether the window is read at the resolution of selectedovi and
+        then resampled. Otherwise GDAL decimates it as it is read.
+    dataslice : tuple of slices
+        Where the data goes in the (ysize, xsize) output.
+    """
+    def __init__(self, ds, metadata, xsize, ysize, tlx, tly, brx, bry, bands,
+            resampling):
+        if resampling not in resamplerhelper.RESAMPLE_METHODS:
+            raise ValueError('Unknown resample method {}'.format(resampling))
+        self.resampleMethod = resamplerhelper.RESAMPLE_METHODS[resampling]
+        self.outside = False
+        self.empty = False
+
+        # work out number of pixels
+        imgPix_x = (brx - tlx) / metadata.transform[1]
+        imgPix_y = (bry - tly) / metadata.transform[5]
+        imgPixPerWinPix = imgPix_x / xsize
+
+        # now work out which overview to use
+        origPixLeft, origPixTop = gdal.ApplyGeoTransform(metadata.tInverse, tlx, tly)
+        origPixRight = origPixLeft + imgPix_x
+        origPixBottom = origPixTop + imgPix_y
+        imgPixPerWinPix = (origPixRight - origPixLeft) / xsize
+        selectedovi = metadata.overviews.findBestOverview(imgPixPerWinPix)
+
+        # from TuiView
+        # first check that we are out of the area
+        if origPixTop < 0 and origPixBottom < 0:
+            self.outside = True
+        elif origPixLeft < 0 and origPixRight < 0:
+            self.outside = True
+        elif origPixLeft > metadata.RasterXSize and origPixRight > metadata.RasterXSize:
+            self.outside = True
+        elif origPixTop > metadata.RasterYSize and origPixBottom > metadata.RasterYSize:
+            self.outside = True
+        if self.outside:
+            self.dataslice = None
+            self.empty = True
+            return
+
         fullrespixperovpix = selectedovi.fullrespixperpix
 
         pixTop = max(origPixTop, 0)
@@ -1007,67 +2981,217 @@ def getRawImageChunk(ds, metadata, xsize, ysize, tlx, tly, brx, bry, bands,
             dspRightExtra = max(dspRightExtra, 0)
             dspBottomExtra = max(dspBottomExtra, 0)
 
-        dataslice = (slice(dspRastTop, dspRastTop + dspRastYSize),
+        self.dataslice = (slice(dspRastTop, dspRastTop + dspRastYSize),
             slice(dspRastLeft, dspRastLeft + dspRastXSize))
 
-        datalist = []
+        self.filename = ds.GetDescription()
+        self.bands = tuple(bands)
+        self.gdalBands = []
         for bandnum in bands:
             band = ds.GetRasterBand(bandnum)
             if selectedovi.index > 0:
                 band = band.GetOverview(selectedovi.index - 1)
+            self.gdalBands.append(band)
+
+        # All bands are read into one (bands, rows, cols) array so the
+        # resampler can do them all in the one call.
+        self.dtype = numpy.result_type(*[gdal_array.GDALTypeCodeToNumericTypeCode(
+            band.DataType) for band in self.gdalBands])
+
+        self.selectedovi = selectedovi
+        self.imgPixPerWinPix = imgPixPerWinPix
+        self.dspRastXSize = dspRastXSize
+        self.dspRastYSize = dspRastYSize
+        self.readNative = (imgPixPerWinPix < 1 or 
+            resampling in resamplerhelper.DOWNSAMPLE_METHODS)
+        if imgPixPerWinPix >= 1:
+            self.readxoff = ovleft
+            self.readyoff = ovtop
+            self.readxsize = ovxsize
+            self.readysize = ovysize
+            # reduced to exactly the display size
+            self.extras = (0, 0, 0, 0)
+        else:
+            # margins only depend on the size of the band which is
+            # the same for all of them
+            marg = MarginsForResample(resampling, ovleft, ovtop,
+                ovxsize, ovysize, self.gdalBands[0])
+            self.readxoff = ovleft - marg.left
+            self.readyoff = ovtop - marg.top
+            self.readxsize = ovxsize + marg.left + marg.right
+            self.readysize = ovysize + marg.top + marg.bottom
+            self.extras = (
+                dspLeftExtra + int(round(marg.left / imgPixPerWinPix)),
+                dspTopExtra + int(round(marg.top / imgPixPerWinPix)),
+                dspRightExtra + int(round(marg.right / imgPixPerWinPix)),
+                dspBottomExtra + int(round(marg.bottom / imgPixPerWinPix)))
+
+        if CHECK_DATA_COVERAGE and all(metadata.allIgnore[bandnum - 1] 
+                is not None for bandnum in bands):
+            self.empty = self.isEmpty()
+
+    def isEmpty(self):
+        """
+        Returns True if GDAL reports that none of the bands have any data
+        in the window to read. For a COG this is when all the blocks 
+        covered are sparse (not written), which GDAL works out from the 
+        block offsets without reading them. Drivers that can't tell are
+        assumed to have data.
+        """
+        for band in self.gdalBands:
+            flags, _ = band.GetDataCoverageStatus(self.readxoff, 
+                self.readyoff, self.readxsize, self.readysize)
+            if flags != gdal.GDAL_DATA_COVERAGE_STATUS_EMPTY:
+                return False
+        return True
+
+    def read(self, gdalBands, bands, ignore, nthreads=1, out=None, 
+            bandsxoff=0, bandsyoff=0, multiband=None, cacheBlocks=False,
+            stats=None):
+        """
+        Read the data for the chunk.
+
+        Parameters
+        ----------
+        gdalBands : list of gdal.Band
+            The bands to read from. Normally self.gdalBands but can be
+            (eg MEM) bands with part of them.
+        bands : sequence of ints
+            The 1-based band indices of gdalBands in their dataset.
+        ignore : list of floats
+            The ignore value (or None) for each band
+        nthreads, out, multiband : 
+            As for getRawImageChunk()
+        bandsxoff, bandsyoff : int, optional
+            Where the top left of gdalBands is in self.selectedovi.
+        cacheBlocks : bool, optional
+            Whether the data read may come from (and is put in) diskCache.
+            The data returned may then be a read only memory map of the 
+            cached data rather than in out.
+        stats : TileStats, optional
+            As for getRawImageChunk()
 
-            if imgPixPerWinPix >= 1:
-                data = band.ReadAsArray(ovleft, ovtop, 
-                    ovxsize, ovysize,
-                    dspRastXSize, dspRastYSize)
+        Returns
+        -------
+        numpy.ndarray
+            The data as returned by getRawImageChunk()
+
+        """
+        dtype = self.dtype
+        dataslice = self.dataslice
+
+        if out is not None and out.dtype == dtype:
+            # written straight into the caller's array
+            outData = out[(slice(None),) + dataslice]
+        else:
+            outData = None
+
+        if multiband is None:
+            multiband = MULTIBAND_READ
+
+        if self.readNative:
+            shape = (len(gdalBands), self.readysize, self.readxsize)
+        else:
+            shape = (len(gdalBands), self.dspRastYSize, self.dspRastXSize)
+        blockKey = None
+        cached = None
+        if cacheBlocks:
+            blockKey = diskCache.makeBlockKey(self.filename, 
+                self.selectedovi.index, self.bands, self.readxoff, 
+                self.readyoff, self.readxsize, self.readysize, shape, dtype)
+            cached = diskCache.getBlock(blockKey)
+            if cached is not None:
+                addCount(stats, 'blockCacheHits')
+
+        if not self.readNative:
+            if cached is not None:
+                data = cached
             else:
-                marg = MarginsForResample(resampling, ovleft, ovtop,
-                    ovxsize, ovysize, band)
-                dataTmp = band.ReadAsArray(
-                    ovleft - marg.left,
-                    ovtop - marg.top,
-                    ovxsize + marg.left + marg.right,
-                    ovysize + marg.top + marg.bottom)
-                ignore = metadata.allIgnore[bandnum - 1]
-                data = resampleMethod(dataTmp,
-                    (dspRastYSize, dspRastXSize),
-                    dspLeftExtra + int(round(marg.left / imgPixPerWinPix)),
-                    dspTopExtra + int(round(marg.top / imgPixPerWinPix)),
-                    dspRightExtra + int(round(marg.right / imgPixPerWinPix)),
-                    dspBottomExtra + int(round(marg.bottom / imgPixPerWinPix)),
-                    ignore)
-
-            datalist.append(data)
-
-        if len(datalist) == 1:
-            # For single band, we return a 2-d array
-            data = datalist[0]
+                data = outData
+                if data is None:
+                    data = numpy.empty(shape, dtype=dtype)
+                with timeStage(stats, 'read'):
+                    readBands(gdalBands, bands, self.readxoff - bandsxoff, 
+                        self.readyoff - bandsyoff, self.readxsize, 
+                        self.readysize, data, multiband)
+                addCount(stats, 'bytesRead', data.nbytes)
+                diskCache.putBlock(blockKey, data)
         else:
-            # A 3-d array of all bands
-            data = numpy.array(datalist)
+            dataTmp = cached
+            if dataTmp is None:
+                dataTmp = numpy.empty(shape, dtype=dtype)
+                with timeStage(stats, 'read'):
+                    readBands(gdalBands, bands, self.readxoff - bandsxoff, 
+                        self.readyoff - bandsyoff, self.readxsize, 
+                        self.readysize, dataTmp, multiband)
+                addCount(stats, 'bytesRead', dataTmp.nbytes)
+                diskCache.putBlock(blockKey, dataTmp)
+
+            left, top, right, bottom = self.extras
+            with timeStage(stats, 'resample', kernel=True):
+                data = self.resampleMethod(dataTmp,
+                    (self.dspRastYSize, self.dspRastXSize),
+                    left, top, right, bottom, ignore, nthreads, outData)
+
+        if len(gdalBands) == 1:
+            # For single band, we return a 2-d array
+            data = data[0]
 
-    return data, dataslice
+        return data
+
+
+def readBands(gdalBands, bands, xoff, yoff, xsize, ysize, data, 
+        multiband=True):
+    """
+    Read a window of the given bands into data, resampling (nearest 
+    neighbour) to the size of data if needed.
+
+    Parameters
+    ----------
+    gdalBands : sequence of gdal.Band
+        The bands to read. Either all full resolution bands or all the 
+        same overview.
+    bands : sequence of ints
+        The 1-based band indices of gdalBands.
+    xoff, yoff, xsize, ysize : int
+        The window to read, in the pixels of gdalBands.
+    data : numpy.ndarray
+        A (len(bands), rows, cols) array to read into. May be a view.
+    multiband : bool, optional
+        If True and there is more than one band, the bands are read with
+        one read of their dataset (for an overview, the dataset the 
+        overview belongs to, if the driver has one). Otherwise, or if 
+        there isn't a suitable dataset, they are read one at a time.
+
+    """
+    if multiband and len(gdalBands) > 1:
+        readDS = gdalBands[0].GetDataset()
+        if (readDS is not None and 
+                readDS.RasterXSize == gdalBands[0].XSize and 
+                readDS.RasterYSize == gdalBands[0].YSize and
+                readDS.RasterCount >= max(bands)):
+            readDS.ReadAsArray(xoff, yoff, xsize, ysize, buf_obj=data,
+                band_list=list(bands))
+            return
+            
+    for n, band in enumerate(gdalBands):
+        band.ReadAsArray(xoff, yoff, xsize, ysize, buf_obj=data[n])
 
 
 class MarginsForResample:
     """
     handle the margin information.
-    TODO: add this to resamplehelper.py
+    The margin is the radius of the kernel (see 
+    resamplerhelper.RESAMPLE_MARGINS) but not past the edge of the file.
     """
     def __init__(self, resampling, ovleft, ovtop, ovxsize, ovysize, band):
-        if resampling == 'bilinear':
-            # Desired margin
-            margin = 1
-            # For each block edge, the amount of margin actually possible
-            # without going off the edge of the file
-            self.left = min(margin, ovleft)
-            self.right = min(margin, band.XSize - (ovleft + ovxsize))
-            self.top = min(margin, ovtop)
-            self.bottom = min(margin, band.YSize - (ovtop + ovysize))
-        elif resampling == 'near':
-            self.left = 0
-            self.right = 0
-            self.top = 0
-            self.bottom = 0
-        else:
+        if resampling not in resamplerhelper.RESAMPLE_MARGINS:
             raise ValueError("Unknown resampling method '{}'".format(resampling))
+        # Desired margin
+        margin = resamplerhelper.RESAMPLE_MARGINS[resampling]
+        # For each block edge, the amount of margin actually possible
+        # without going off the edge of the file
+        self.left = min(margin, ovleft)
+        self.right = min(margin, band.XSize - (ovleft + ovxsize))
+        self.top = min(margin, ovtop)
+        self.bottom = min(margin, band.YSize - (ovtop + ovysize))
@@ -1,8 +1,135 @@
+import os
+import platform
 from setuptools import setup, Extension
 from numpy import get_include as numpy_get_include
 
+# Flags for the resampler. Both builds are optimised with LTO.
+RESAMPLER_FLAGS = ['-O3', '-flto=auto', '-fno-semantic-interposition']
+# The flags resampler_tuned is built with for each machine (the
+# Architecture in template.yaml). arm64 is Graviton2 or later.
+# For x86_64 the instructions of Haswell and later, which all Lambdas have.
+# resampler.tuned_supported() must check for these.
+TUNED_FLAGS = {'aarch64': ['-mcpu=neoverse-n1'],
+    'arm64': ['-mcpu=neoverse-n1'],
+    'x86_64': ['-mavx2', '-mfma', '-mbmi', '-mbmi2', '-mtune=haswell'],
+    'AMD64': ['-mavx2', '-mfma', '-mbmi', '-mbmi2', '-mtune=haswell']}
+
+# Profile guided optimisation. Set CIBO_PGO to 'generate' to build
+# an instrumented resampler, run benchmark.py with it then rebuild
+# with CIBO_PGO set to 'use'. The profiles are in CIBO_PGO_DIR.
+PGO = os.getenv('CIBO_PGO')
+PGO_DIR = os.path.abspath(os.getenv('CIBO_PGO_DIR', 'pgo'))
+PGO_FLAGS = {'generate': ['-fprofile-generate=' + PGO_DIR,
+        '-fprofile-update=atomic'],
+    'use': ['-fprofile-use=' + PGO_DIR, '-fprofile-partial-training',
+        '-fprofile-correction']}
+
+# Set to 0 to only build the portable resampler
+BUILD_TUNED = os.getenv('CIBO_TUNED', '1') != '0'
+
+
+def getCompiler():
+    """
+    Returns the compiler setuptools will build the extensions with.
+    """
+    from setuptools._distutils.ccompiler import new_compiler
+    from setuptools._distutils.sysconfig import customize_compiler
+    compiler = new_compiler()
+    customize_compiler(compiler)
+    return compiler
+
+
+def haveWebP():
+    """
+    Returns True if libwebp (and its headers) can be found so the
+    native encoder can support lossless WebP.
+    """
+    try:
+        compiler = getCompiler()
+        return compiler.has_function('WebPEncodeLosslessRGBA',
+            includes=['webp/encode.h'], libraries=['webp'])
+    except Exception:
+        return False
+
+
+def supportedFlags(flags):
+    """
+    Returns the flags the compiler accepts. Each is tried by compiling
+    and linking an empty program with it, so the build still works 
+    (less optimised) with an older or different compiler.
+    """
+    import tempfile
+    try:
+        compiler = getCompiler()
+    except Exception:
+        return []
+    supported = []
+    with tempfile.TemporaryDirectory() as tempDir:
+        fname = os.path.join(tempDir, 'flag.c')
+        with open(fname, 'w') as f:
+            f.write('int main(void) { return 0; }\n')
+        for flag in flags:
+            try:
+                objects = compiler.compile([fname], output_dir=tempDir,
+                    extra_postargs=[flag])
+                compiler.link_executable(objects, 'flag', 
+                    output_dir=tempDir, extra_postargs=[flag])
+                supported.append(flag)
+            except Exception:
+                pass
+    return supported
+
+
+def getResamplerFlags(tuned):
+    """
+    Returns the flags to compile and link the resampler with. tuned is
+    whether for resampler_tuned.
+    """
+    flags = RESAMPLER_FLAGS[:]
+    if tuned:
+        flags.extend(TUNED_FLAGS.get(platform.machine(), []))
+    if PGO is not None:
+        flags.extend(PGO_FLAGS[PGO])
+    flags = supportedFlags(flags)
+    if '-flto=auto' not in flags:
+        # older compilers only have -flto
+        flags.extend(supportedFlags(['-flto']))
+    return flags
+
+
+resamplerMacros = [('NPY_NO_DEPRECATED_API', 'NPY_1_7_API_VERSION')]
+
+# The portable build. resamplerhelper uses resampler_tuned instead
+# where the CPU supports it.
+resamplerFlags = getResamplerFlags(False)
 ext_module = Extension(name='cibotiler.resampler', sources=['src/resampler.cpp'],
     include_dirs=[numpy_get_include()],
-    define_macros=[('NPY_NO_DEPRECATED_API', 'NPY_1_7_API_VERSION')])
+    define_macros=resamplerMacros,
+    extra_compile_args=resamplerFlags,
+    extra_link_args=resamplerFlags)
+
+encoderLibraries = ['z']
+encoderMacros = [('NPY_NO_DEPRECATED_API', 'NPY_1_7_API_VERSION')]
+if haveWebP():
+    encoderLibraries.append('webp')
+    encoderMacros.append(('ENCODER_HAVE_WEBP', '1'))
+
+encoder_module = Extension(name='cibotiler.encoder', sources=['src/encoder.cpp'],
+    include_dirs=[numpy_get_include()],
+    libraries=encoderLibraries,
+    define_macros=encoderMacros)
+
+ext_modules = [ext_module, encoder_module]
+
+if BUILD_TUNED and platform.machine() in TUNED_FLAGS:
+    tunedFlags = getResamplerFlags(True)
+    tuned_module = Extension(name='cibotiler.resampler_tuned',
+        sources=['src/resampler_tuned.cpp'],
+        depends=['src/resampler.cpp'],
+        include_dirs=[numpy_get_include()],
+        define_macros=resamplerMacros,
+        extra_compile_args=tunedFlags,
+        extra_link_args=tunedFlags)
+    ext_modules.append(tuned_module)
 
-setup(ext_modules=[ext_module])
+setup(ext_modules=ext_modules)
@@ -0,0 +1,598 @@
+/*
+# This file is part of Cibo Tiler.
+# Copyright (C) 2024 Cibolabs.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <Python.h>
+#include "numpy/arrayobject.h"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+#include <zlib.h>
+
+// Lossless WebP is only available if setup.py found libwebp
+#if defined(ENCODER_HAVE_WEBP)
+    #include <webp/encode.h>
+#endif
+
+/* An exception object for this module */
+/* created in the init function */
+struct EncoderState
+{
+    PyObject *error;
+};
+
+#define GETSTATE(m) ((struct EncoderState*)PyModule_GetState(m))
+
+// PNG filter types. FILTER_ADAPTIVE picks the best for each row
+// the same way libpng does.
+#define FILTER_NONE 0
+#define FILTER_SUB 1
+#define FILTER_UP 2
+#define FILTER_AVERAGE 3
+#define FILTER_PAETH 4
+#define FILTER_ADAPTIVE -1
+
+/* A tile to be encoded. The bands are separate planes (as returned */
+/* by getTile()) and are interleaved a row at a time by the encoders. */
+struct EncodeImage
+{
+    std::vector<const char*> bands;
+    npy_intp nXSize;
+    npy_intp nYSize;
+    npy_intp nRowStride;    // in bytes, same for all bands
+    npy_intp nPixelStride;  // in bytes
+    int nBytesPerSample;    // 1 or 2
+    // for a paletted image (single uint8 band of indices) the
+    // colors, otherwise empty
+    std::vector<unsigned char> paletteRGB;
+    std::vector<unsigned char> paletteAlpha;
+};
+
+// row n of the image pixel interleaved as PNG wants it
+// (16 bit samples are big endian)
+static void interleaveRow(const EncodeImage &image, npy_intp nRow,
+        unsigned char *pOut)
+{
+    const size_t nBands = image.bands.size();
+    for( size_t b = 0; b < nBands; b++ )
+    {
+        const char *pIn = image.bands[b] + nRow * image.nRowStride;
+        if( image.nBytesPerSample == 1 )
+        {
+            unsigned char *p = pOut + b;
+            for( npy_intp c = 0; c < image.nXSize; c++, p += nBands )
+                *p = *(const unsigned char*)(pIn + c * image.nPixelStride);
+        }
+        else
+        {
+            unsigned char *p = pOut + b * 2;
+            for( npy_intp c = 0; c < image.nXSize; c++, p += nBands * 2 )
+            {
+                npy_uint16 nVal;
+                memcpy(&nVal, pIn + c * image.nPixelStride, sizeof(nVal));
+                p[0] = (unsigned char)(nVal >> 8);
+                p[1] = (unsigned char)(nVal & 0xff);
+            }
+        }
+    }
+}
+
+static inline unsigned char paethPredictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+    if( pa <= pb && pa <= pc )
+        return (unsigned char)a;
+    else if( pb <= pc )
+        return (unsigned char)b;
+    return (unsigned char)c;
+}
+
+// Applies nFilter to pRow (previous row pPrev, all zeros for the first)
+// writing the filter type then the filtered bytes to pOut.
+// nBpp is the bytes per (interleaved) pixel.
+static void filterRow(int nFilter, const unsigned char *pRow,
+        const unsigned char *pPrev, size_t nBytes, size_t nBpp,
+        unsigned char *pOut)
+{
+    *pOut++ = (unsigned char)nFilter;
+    switch(nFilter)
+    {
+        case FILTER_NONE:
+            memcpy(pOut, pRow, nBytes);
+            break;
+        case FILTER_SUB:
+            for( size_t i = 0; i < nBytes; i++ )
+                pOut[i] = pRow[i] - (i >= nBpp ? pRow[i - nBpp] : 0);
+            break;
+        case FILTER_UP:
+            for( size_t i = 0; i < nBytes; i++ )
+                pOut[i] = pRow[i] - pPrev[i];
+            break;
+        case FILTER_AVERAGE:
+            for( size_t i = 0; i < nBytes; i++ )
+            {
+                int nLeft = (i >= nBpp) ? pRow[i - nBpp] : 0;
+                pOut[i] = pRow[i] - (unsigned char)((nLeft + pPrev[i]) / 2);
+            }
+            break;
+        case FILTER_PAETH:
+            for( size_t i = 0; i < nBytes; i++ )
+            {
+                int nLeft = (i >= nBpp) ? pRow[i - nBpp] : 0;
+                int nUpLeft = (i >= nBpp) ? pPrev[i - nBpp] : 0;
+                pOut[i] = pRow[i] - paethPredictor(nLeft, pPrev[i], nUpLeft);
+            }
+            break;
+    }
+}
+
+// sum of the filtered bytes treated as signed - the heuristic
+// libpng uses to choose a filter
+static size_t filterCost(const unsigned char *pFiltered, size_t nBytes)
+{
+    size_t nSum = 0;
+    for( size_t i = 0; i < nBytes; i++ )
+        nSum += (pFiltered[i] < 128) ? pFiltered[i] : 256 - pFiltered[i];
+    return nSum;
+}
+
+static void appendUInt32(std::vector<unsigned char> &out, npy_uint32 nVal)
+{
+    out.push_back((unsigned char)(nVal >> 24));
+    out.push_back((unsigned char)(nVal >> 16));
+    out.push_back((unsigned char)(nVal >> 8));
+    out.push_back((unsigned char)nVal);
+}
+
+// Appends a chunk, with its length and CRC, to out
+static void appendChunk(std::vector<unsigned char> &out, const char *pszType,
+        const unsigned char *pData, size_t nSize)
+{
+    appendUInt32(out, (npy_uint32)nSize);
+    size_t nStart = out.size();
+    out.insert(out.end(), pszType, pszType + 4);
+    out.insert(out.end(), pData, pData + nSize);
+    uLong nCRC = crc32(0L, Z_NULL, 0);
+    nCRC = crc32(nCRC, &out[nStart], (uInt)(nSize + 4));
+    appendUInt32(out, (npy_uint32)nCRC);
+}
+
+// Encodes image as a PNG into out. Returns NULL on success or an
+// error message. Throws std::bad_alloc if out of memory.
+static const char *encodePNG(const EncodeImage &image, int nLevel, int nFilter,
+        std::vector<unsigned char> &out)
+{
+    static const unsigned char signature[] = {137, 80, 78, 71, 13, 10, 26, 10};
+    // grey, grey + alpha, RGB, RGBA
+    static const unsigned char colorTypes[] = {0, 4, 2, 6};
+
+    const size_t nBpp = image.bands.size() * image.nBytesPerSample;
+    const size_t nRowBytes = nBpp * image.nXSize;
+
+    out.insert(out.end(), signature, signature + sizeof(signature));
+
+    std::vector<unsigned char> header;
+    appendUInt32(header, (npy_uint32)image.nXSize);
+    appendUInt32(header, (npy_uint32)image.nYSize);
+    header.push_back((unsigned char)(image.nBytesPerSample * 8));
+    if( image.paletteRGB.empty() )
+        header.push_back(colorTypes[image.bands.size() - 1]);
+    else
+        header.push_back(3);
+    header.push_back(0);    // compression
+    header.push_back(0);    // filter method
+    header.push_back(0);    // no interlace
+    appendChunk(out, "IHDR", header.data(), header.size());
+
+    if( !image.paletteRGB.empty() )
+    {
+        appendChunk(out, "PLTE", image.paletteRGB.data(), 
+            image.paletteRGB.size());
+        // alpha after the last one that isn't opaque can be left out
+        size_t nAlpha = image.paletteAlpha.size();
+        while( nAlpha > 0 && image.paletteAlpha[nAlpha - 1] == 255 )
+            nAlpha--;
+        if( nAlpha > 0 )
+            appendChunk(out, "tRNS", image.paletteAlpha.data(), nAlpha);
+    }
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if( deflateInit(&stream, nLevel) != Z_OK )
+        return "Failed to initialise zlib";
+
+    std::vector<unsigned char> row(nRowBytes), prev(nRowBytes, 0);
+    std::vector<unsigned char> filtered(nRowBytes + 1), best(nRowBytes + 1);
+    std::vector<unsigned char> compressed(deflateBound(&stream,
+        (uLong)((nRowBytes + 1) * image.nYSize)));
+    stream.next_out = compressed.data();
+    stream.avail_out = (uInt)compressed.size();
+
+    for( npy_intp r = 0; r <= image.nYSize; r++ )
+    {
+        int nFlush = Z_FINISH;
+        if( r < image.nYSize )
+        {
+            interleaveRow(image, r, row.data());
+            if( nFilter != FILTER_ADAPTIVE )
+            {
+                filterRow(nFilter, row.data(), prev.data(), nRowBytes, nBpp,
+                    best.data());
+            }
+            else
+            {
+                size_t nBestCost = 0;
+                for( int nType = FILTER_NONE; nType <= FILTER_PAETH; nType++ )
+                {
+                    filterRow(nType, row.data(), prev.data(), nRowBytes, nBpp,
+                        filtered.data());
+                    size_t nCost = filterCost(filtered.data() + 1, nRowBytes);
+                    if( nType == FILTER_NONE || nCost < nBestCost )
+                    {
+                        nBestCost = nCost;
+                        best.swap(filtered);
+                    }
+                }
+            }
+            row.swap(prev);
+            stream.next_in = best.data();
+            stream.avail_in = (uInt)best.size();
+            nFlush = Z_NO_FLUSH;
+        }
+
+        // compressed is big enough for everything so this
+        // never runs out of output space
+        int nRet = deflate(&stream, nFlush);
+        if( nRet == Z_STREAM_ERROR || (nFlush == Z_FINISH && nRet != Z_STREAM_END) )
+        {
+            deflateEnd(&stream);
+            return "Failed to compress image";
+        }
+    }
+
+    appendChunk(out, "IDAT", compressed.data(),
+        compressed.size() - stream.avail_out);
+    deflateEnd(&stream);
+    appendChunk(out, "IEND", NULL, 0);
+    return NULL;
+}
+
+#if defined(ENCODER_HAVE_WEBP)
+// Encodes image (8 bit only) as a lossless WebP into out. Returns NULL
+// on success or an error message. Throws std::bad_alloc if out of memory.
+static const char *encodeWebP(const EncodeImage &image,
+        std::vector<unsigned char> &out)
+{
+    // WebP only does RGB or RGBA so grey is expanded
+    const size_t nBands = image.bands.size();
+    const bool bAlpha = (nBands == 2 || nBands == 4);
+    const size_t nOutBands = bAlpha ? 4 : 3;
+    std::vector<unsigned char> rgba(nOutBands * image.nXSize * image.nYSize);
+    std::vector<unsigned char> row(nBands * image.nXSize);
+    for( npy_intp r = 0; r < image.nYSize; r++ )
+    {
+        interleaveRow(image, r, row.data());
+        unsigned char *pOut = &rgba[r * nOutBands * image.nXSize];
+        if( nBands >= 3 )
+        {
+            memcpy(pOut, row.data(), row.size());
+            continue;
+        }
+        for( npy_intp c = 0; c < image.nXSize; c++ )
+        {
+            unsigned char *p = pOut + c * nOutBands;
+            p[0] = p[1] = p[2] = row[c * nBands];
+            if( bAlpha )
+                p[3] = row[c * nBands + 1];
+        }
+    }
+
+    uint8_t *pData = NULL;
+    size_t nSize;
+    if( bAlpha )
+        nSize = WebPEncodeLosslessRGBA(rgba.data(), (int)image.nXSize,
+            (int)image.nYSize, (int)(4 * image.nXSize), &pData);
+    else
+        nSize = WebPEncodeLosslessRGB(rgba.data(), (int)image.nXSize,
+            (int)image.nYSize, (int)(3 * image.nXSize), &pData);
+    if( nSize == 0 )
+    {
+        WebPFree(pData);
+        return "Failed to encode WebP";
+    }
+    out.assign(pData, pData + nSize);
+    WebPFree(pData);
+    return NULL;
+}
+#endif
+
+// Checks pInput is a (bands, rows, cols) uint8 or uint16 array with 1-4
+// bands and fills in image. Returns false with an exception set if not.
+static bool getEncodeImage(PyObject *self, PyArrayObject *pInput,
+        EncodeImage &image)
+{
+    int arrayType = PyArray_TYPE(pInput);
+    if( PyArray_NDIM(pInput) != 3 || PyArray_DIM(pInput, 0) < 1 ||
+            PyArray_DIM(pInput, 0) > 4 ||
+            (arrayType != NPY_UINT8 && arrayType != NPY_UINT16) )
+    {
+        PyErr_SetString(GETSTATE(self)->error,
+            "Input must be a 3d uint8 or uint16 array with 1 to 4 bands");
+        return false;
+    }
+    if( PyArray_DIM(pInput, 1) < 1 || PyArray_DIM(pInput, 2) < 1 ||
+            PyArray_DIM(pInput, 1) > 0x7fffffff || PyArray_DIM(pInput, 2) > 0x7fffffff )
+    {
+        PyErr_SetString(GETSTATE(self)->error, "Invalid image size");
+        return false;
+    }
+
+    npy_intp nBands = PyArray_DIM(pInput, 0);
+    image.bands.resize(nBands);
+    for( npy_intp n = 0; n < nBands; n++ )
+        image.bands[n] = PyArray_BYTES(pInput) + n * PyArray_STRIDE(pInput, 0);
+    image.nYSize = PyArray_DIM(pInput, 1);
+    image.nXSize = PyArray_DIM(pInput, 2);
+    image.nRowStride = PyArray_STRIDE(pInput, 1);
+    image.nPixelStride = PyArray_STRIDE(pInput, 2);
+    image.nBytesPerSample = (arrayType == NPY_UINT8) ? 1 : 2;
+    return true;
+}
+
+// Checks pPalette is a (4, n) uint8 array with 1-256 colors and image is
+// a single band of uint8 indices and copies the colors into image.
+// Returns false with an exception set if not.
+static bool getPalette(PyObject *self, PyObject *pPalette, EncodeImage &image)
+{
+    if( image.bands.size() != 1 || image.nBytesPerSample != 1 )
+    {
+        PyErr_SetString(GETSTATE(self)->error,
+            "A palette needs input to be a single uint8 band");
+        return false;
+    }
+    PyArrayObject *pPaletteArray = (PyArrayObject*)PyArray_FROM_OTF(pPalette,
+        NPY_UINT8, NPY_ARRAY_IN_ARRAY);
+    if( pPaletteArray == NULL )
+        return false;
+    npy_intp nColors = 0;
+    if( PyArray_NDIM(pPaletteArray) == 2 && PyArray_DIM(pPaletteArray, 0) == 4 )
+        nColors = PyArray_DIM(pPaletteArray, 1);
+    if( nColors < 1 || nColors > 256 )
+    {
+        PyErr_SetString(GETSTATE(self)->error,
+            "palette must be of shape (4, n) with n between 1 and 256");
+        Py_DECREF(pPaletteArray);
+        return false;
+    }
+    const unsigned char *pColors = (const unsigned char*)PyArray_BYTES(pPaletteArray);
+    image.paletteRGB.resize(nColors * 3);
+    image.paletteAlpha.resize(nColors);
+    for( npy_intp n = 0; n < nColors; n++ )
+    {
+        for( int b = 0; b < 3; b++ )
+            image.paletteRGB[n * 3 + b] = pColors[b * nColors + n];
+        image.paletteAlpha[n] = pColors[3 * nColors + n];
+    }
+    Py_DECREF(pPaletteArray);
+    return true;
+}
+
+static PyObject *encoder_encode_png(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyArrayObject *pInput;
+    int nLevel = 6;
+    int nFilter = FILTER_ADAPTIVE;
+    PyObject *pPalette = Py_None;
+    const char *kwlist[] = {"input", "level", "filter", "palette", NULL};
+
+    if( !PyArg_ParseTupleAndKeywords(args, kwds, "O!|iiO:encode_png",
+            (char**)kwlist, &PyArray_Type, &pInput, &nLevel, &nFilter, 
+            &pPalette))
+        return NULL;
+
+    if( nLevel < 0 || nLevel > 9 )
+    {
+        PyErr_SetString(GETSTATE(self)->error, "level must be between 0 and 9");
+        return NULL;
+    }
+    if( nFilter < FILTER_ADAPTIVE || nFilter > FILTER_PAETH )
+    {
+        PyErr_SetString(GETSTATE(self)->error, "Invalid filter");
+        return NULL;
+    }
+
+    EncodeImage image;
+    if( !getEncodeImage(self, pInput, image) )
+        return NULL;
+    if( pPalette != Py_None && !getPalette(self, pPalette, image) )
+        return NULL;
+
+    // the input is only read so this is safe as long as the caller
+    // doesn't change it from another thread while we are encoding
+    std::vector<unsigned char> out;
+    const char *pszError = NULL;
+    bool bNoMemory = false;
+    Py_BEGIN_ALLOW_THREADS
+    try
+    {
+        pszError = encodePNG(image, nLevel, nFilter, out);
+    }
+    catch(std::bad_alloc &)
+    {
+        bNoMemory = true;
+    }
+    Py_END_ALLOW_THREADS
+
+    if( bNoMemory )
+        return PyErr_NoMemory();
+    if( pszError != NULL )
+    {
+        PyErr_SetString(GETSTATE(self)->error, pszError);
+        return NULL;
+    }
+
+    return PyBytes_FromStringAndSize((const char*)out.data(), out.size());
+}
+
+static PyObject *encoder_encode_webp(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyArrayObject *pInput;
+    const char *kwlist[] = {"input", NULL};
+
+    if( !PyArg_ParseTupleAndKeywords(args, kwds, "O!:encode_webp",
+            (char**)kwlist, &PyArray_Type, &pInput))
+        return NULL;
+
+#if defined(ENCODER_HAVE_WEBP)
+    EncodeImage image;
+    if( !getEncodeImage(self, pInput, image) )
+        return NULL;
+    if( image.nBytesPerSample != 1 || image.nXSize > WEBP_MAX_DIMENSION ||
+            image.nYSize > WEBP_MAX_DIMENSION )
+    {
+        PyErr_SetString(GETSTATE(self)->error,
+            "WebP needs uint8 data no bigger than 16383 pixels");
+        return NULL;
+    }
+
+    std::vector<unsigned char> out;
+    const char *pszError = NULL;
+    bool bNoMemory = false;
+    Py_BEGIN_ALLOW_THREADS
+    try
+    {
+        pszError = encodeWebP(image, out);
+    }
+    catch(std::bad_alloc &)
+    {
+        bNoMemory = true;
+    }
+    Py_END_ALLOW_THREADS
+
+    if( bNoMemory )
+        return PyErr_NoMemory();
+    if( pszError != NULL )
+    {
+        PyErr_SetString(GETSTATE(self)->error, pszError);
+        return NULL;
+    }
+
+    return PyBytes_FromStringAndSize((const char*)out.data(), out.size());
+#else
+    PyErr_SetString(GETSTATE(self)->error, "Not built with WebP support");
+    return NULL;
+#endif
+}
+
+static PyObject *encoder_have_webp(PyObject *self, PyObject *args)
+{
+#if defined(ENCODER_HAVE_WEBP)
+    Py_RETURN_TRUE;
+#else
+    Py_RETURN_FALSE;
+#endif
+}
+
+/* Our list of functions in this module*/
+static PyMethodDef EncoderMethods[] = {
+    {"encode_png", (PyCFunction)encoder_encode_png, METH_VARARGS | METH_KEYWORDS,
+        "call signature: encode_png(input, level=6, filter=FILTER_ADAPTIVE,\n"
+        "       palette=None)\n"
+        "where:\n"
+        "  input is a 3d uint8 or uint16 array of (bands, rows, cols) with\n"
+        "    1 (grey), 2 (grey, alpha), 3 (RGB) or 4 (RGBA) bands\n"
+        "  level is the zlib compression level (0-9)\n"
+        "  filter is one of the FILTER_* constants. FILTER_ADAPTIVE chooses\n"
+        "    the best filter for each row\n"
+        "  palette is None or a (4, n) uint8 array of up to 256 RGBA colors\n"
+        "    to write a paletted image. input must then be a single band of\n"
+        "    indices into palette\n"
+        "returns: bytes containing the PNG file\n"},
+    {"encode_webp", (PyCFunction)encoder_encode_webp, METH_VARARGS | METH_KEYWORDS,
+        "call signature: encode_webp(input)\n"
+        "where:\n"
+        "  input is a 3d uint8 array of (bands, rows, cols) as for\n"
+        "    encode_png()\n"
+        "returns: bytes containing the lossless WebP file. Raises an error\n"
+        "  if not built with WebP support (see have_webp())\n"},
+    {"have_webp", encoder_have_webp, METH_NOARGS,
+        "call signature: have_webp()\n"
+        "returns: True if built with WebP support\n"},
+    {NULL}
+};
+
+static int encoder_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    Py_VISIT(GETSTATE(m)->error);
+    return 0;
+}
+
+static int encoder_clear(PyObject *m)
+{
+    Py_CLEAR(GETSTATE(m)->error);
+    return 0;
+}
+
+static struct PyModuleDef moduledef = {
+        PyModuleDef_HEAD_INIT,
+        "encoder",
+        NULL,
+        sizeof(struct EncoderState),
+        EncoderMethods,
+        NULL,
+        encoder_traverse,
+        encoder_clear,
+        NULL
+};
+
+PyMODINIT_FUNC
+PyInit_encoder(void)
+{
+    PyObject *pModule;
+    struct EncoderState *state;
+
+    /* initialize the numpy stuff */
+    import_array();
+
+    pModule = PyModule_Create(&moduledef);
+    if( pModule == NULL )
+        return NULL;
+
+    state = GETSTATE(pModule);
+
+    /* Create and add our exception type */
+    state->error = PyErr_NewException("encoder.error", NULL, NULL);
+    if( state->error == NULL )
+    {
+        Py_DECREF(pModule);
+        return NULL;
+    }
+    PyModule_AddObject(pModule, "error", state->error);
+
+    PyModule_AddIntConstant(pModule, "FILTER_NONE", FILTER_NONE);
+    PyModule_AddIntConstant(pModule, "FILTER_SUB", FILTER_SUB);
+    PyModule_AddIntConstant(pModule, "FILTER_UP", FILTER_UP);
+    PyModule_AddIntConstant(pModule, "FILTER_AVERAGE", FILTER_AVERAGE);
+    PyModule_AddIntConstant(pModule, "FILTER_PAETH", FILTER_PAETH);
+    PyModule_AddIntConstant(pModule, "FILTER_ADAPTIVE", FILTER_ADAPTIVE);
+
+    return pModule;
+}
@@ -19,283 +19,4016 @@
 #include <Python.h>
 #include "numpy/arrayobject.h"
 #include <cmath>
+#include <cstring>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <list>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <unistd.h>
+
+// Vectorised versions of the bilinear kernels for the common types.
+// NEON is always available on AArch64. On x86 AVX2 is checked for
+// at runtime so the module still works on older CPUs.
+#if defined(__aarch64__)
+    #include <arm_neon.h>
+    #define RESAMPLER_HAVE_NEON
+    #if defined(__linux__)
+        #include <sys/auxv.h>
+    #endif
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #include <immintrin.h>
+    #define RESAMPLER_HAVE_AVX2
+    #define AVX2_TARGET __attribute__((target("avx2,fma")))
+    static bool g_bHaveAVX2 = false;
+#endif
+
+// The name of the module. setup.py also builds this file as 
+// resampler_tuned with the flags for the CPU of the Lambda (see 
+// resampler_tuned.cpp).
+#ifndef RESAMPLER_MODULE
+    #define RESAMPLER_MODULE resampler
+#endif
+#define RESAMPLER_STR2(x) #x
+#define RESAMPLER_STR(x) RESAMPLER_STR2(x)
+#define RESAMPLER_INIT2(x) PyInit_##x
+#define RESAMPLER_INIT(x) RESAMPLER_INIT2(x)
+
+// Whether to use the vectorised kernels. Turned off by use_simd(False)
+// to check them against the scalar versions.
+static bool g_bUseSIMD = true;
+
+static inline bool haveSIMD()
+{
+#if defined(RESAMPLER_HAVE_AVX2)
+    return g_bUseSIMD && g_bHaveAVX2;
+#elif defined(RESAMPLER_HAVE_NEON)
+    return g_bUseSIMD;
+#else
+    return false;
+#endif
+}
+
+// Whether bilinear uses the fixed point kernels for uint8 and uint16.
+// See use_fixed_point().
+static bool g_bUseFixedPoint = true;
+
+/* Times for the kernels called from one Python thread. Only collected */
+/* between start_timing() and stop_timing(), otherwise t_pTimes is */
+/* NULL and the clocks aren't read. The CPU time is summed over all */
+/* the threads a call is split between. */
+struct KernelTimes
+{
+    npy_int64 nCalls;
+    npy_int64 nPixels;      // output pixels
+    double dWall;
+    std::atomic<npy_int64> nCPUNanos;
+};
+static thread_local std::unique_ptr<KernelTimes> t_pTimes;
+
+static npy_int64 threadCPUNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (npy_int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Adds the CPU time of the current thread while it exists to pTimes */
+/* (if not NULL) */
+class CPUTimer
+{
+public:
+    CPUTimer(KernelTimes *pTimes) : m_pTimes(pTimes), m_nStart(0)
+    {
+        if( m_pTimes != NULL )
+            m_nStart = threadCPUNanos();
+    }
+
+    ~CPUTimer()
+    {
+        if( m_pTimes != NULL )
+            m_pTimes->nCPUNanos += threadCPUNanos() - m_nStart;
+    }
+
+private:
+    KernelTimes *m_pTimes;
+    npy_int64 m_nStart;
+};
+
+/* Adds a call (and the wall time while it exists) to t_pTimes if */
+/* timing is on for this thread */
+class KernelTimer
+{
+public:
+    KernelTimer(npy_intp nPixels) : m_pTimes(t_pTimes.get())
+    {
+        if( m_pTimes == NULL )
+            return;
+        m_pTimes->nCalls++;
+        m_pTimes->nPixels += nPixels;
+        m_start = std::chrono::steady_clock::now();
+    }
+
+    ~KernelTimer()
+    {
+        if( m_pTimes != NULL )
+            m_pTimes->dWall += std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - m_start).count();
+    }
+
+private:
+    KernelTimes *m_pTimes;
+    std::chrono::steady_clock::time_point m_start;
+};
 
 /* An exception object for this module */
 /* created in the init function */
 struct ResamplerState
 {
-    PyObject *error;
-};
+    PyObject *error;
+};
+
+#define GETSTATE(m) ((struct ResamplerState*)PyModule_GetState(m))
+
+/* Lookup table for one axis (rows or columns) of the bilinear */
+/* interpolation. For each output pixel along the axis it holds the */
+/* lower and upper input pixel and the weights to apply to each. */
+/* These are the same for every row (or column) so only need to be */
+/* calculated once per call rather than once per output pixel. */
+struct BilinearTable
+{
+    std::vector<int> lower;
+    std::vector<int> upper;
+    std::vector<float> lowerWeight;
+    std::vector<float> upperWeight;
+};
+
+/* The part of the notional full size output that is actually */
+/* calculated. Saves working out (and then throwing away) the */
+/* pixels around the edge that aren't needed. */
+struct OutputWindow
+{
+    npy_intp nFullXSize;
+    npy_intp nFullYSize;
+    npy_intp nXOff;
+    npy_intp nYOff;
+};
+
+// table for output pixels nOutOffset to nOutOffset + nOutSize of an
+// output that is nFullOutSize in total
+static void calcBilinearTable(npy_intp nInSize, npy_intp nFullOutSize, 
+        npy_intp nOutOffset, npy_intp nOutSize, BilinearTable &table)
+{
+    table.lower.resize(nOutSize);
+    table.upper.resize(nOutSize);
+    table.lowerWeight.resize(nOutSize);
+    table.upperWeight.resize(nOutSize);
+
+    float scale = (float)nInSize / (float)nFullOutSize;
+
+    // i is the position in the input, o in the output window. i is 
+    // notionally a float coordinate system, where the whole
+    // number values are on the pixel centres.
+    for (npy_intp o = 0; o < nOutSize; o++) {
+        float i = (o + nOutOffset + 0.5) * scale - 0.5;
+
+        // The two surrounding input values i.e. lower/upper,
+        // relative to the i coordinate
+        float i_l = std::floor(i);
+        float i_u = std::ceil(i);
+
+        // Mostly the edge-of-block values will be stripped off with
+        // the margin. Howver, at the edge of the physical file, there is
+        // no margin, so restrict to within the block, just in case.
+        if (i_l < 0) i_l = 0;
+        if (i_u >= nInSize) i_u = nInSize - 1;
+
+        float w = i - i_l;
+        table.lower[o] = (int)i_l;
+        table.upper[o] = (int)i_u;
+        table.lowerWeight[o] = 1.0f - w;
+        table.upperWeight[o] = w;
+    }
+}
+
+/* One band of an input or output image. The kernels assume the */
+/* pixels within a row are contiguous (nPixelStride == itemsize), */
+/* but the rows needn't be. See forOutputRows() for other outputs. */
+struct ImagePlane
+{
+    char *pData;
+    npy_intp nYSize;
+    npy_intp nXSize;
+    npy_intp nRowStride;    // in bytes
+    npy_intp nPixelStride;  // in bytes
+
+    template <class T>
+    T *row(npy_intp n) const
+    {
+        return (T*)(pData + n * nRowStride);
+    }
+};
+
+/* The ignore value (if any) for a band */
+struct BandIgnore
+{
+    bool bHave;
+    double dValue;
+};
+
+/* Tests pixels of type T against an ignore value. A NaN ignore value */
+/* matches NaN pixels, which a comparison can't, and matches nothing */
+/* for integer types. Nor does a value outside the range of T (this */
+/* also avoids converting them to T, which is undefined). */
+template <class T>
+struct IgnoreTest
+{
+    bool bHave;
+    bool bNaN;
+    T value;
+
+    IgnoreTest(const BandIgnore &ignore)
+    {
+        bool bIsNaN = ignore.bHave && std::isnan(ignore.dValue);
+        bNaN = bIsNaN && std::numeric_limits<T>::has_quiet_NaN;
+        bHave = ignore.bHave && (bIsNaN ? bNaN : inRange(ignore.dValue));
+        value = (bHave && !bNaN) ? (T)ignore.dValue : 0;
+        if( bNaN )
+            value = std::numeric_limits<T>::quiet_NaN();
+    }
+
+    static bool inRange(double dValue)
+    {
+        if( std::numeric_limits<T>::is_integer )
+        {
+            // 2^digits is the first value past the maximum and exact
+            // as a double, unlike the maximum of the 64 bit types
+            return dValue >= (double)std::numeric_limits<T>::lowest() &&
+                dValue < std::ldexp(1.0, std::numeric_limits<T>::digits);
+        }
+        return std::isinf(dValue) || 
+            (dValue >= (double)std::numeric_limits<T>::lowest() &&
+                dValue <= (double)std::numeric_limits<T>::max());
+    }
+
+    bool operator()(T v) const
+    {
+        return bHave && (bNaN ? v != v : v == value);
+    }
+};
+
+// The ignore value for the kernels that just compare with it. Integer
+// types can't be NaN, so a NaN ignore value is the same as none, as is
+// one outside the range of T.
+template <class T>
+BandIgnore effectiveIgnore(const BandIgnore &ignore)
+{
+    IgnoreTest<T> test(ignore);
+    BandIgnore result = {test.bHave, ignore.dValue};
+    return result;
+}
+
+/* All the bands to be resampled in one call. As the bands are the */
+/* same size, the lookup tables only need calculating once for all */
+/* of them. */
+struct ResampleBands
+{
+    std::vector<ImagePlane> inputs;
+    std::vector<ImagePlane> outputs;
+    std::vector<BandIgnore> ignores;    // not used by nearest
+};
+
+static void calcBilinearTables(const ResampleBands &bands,
+        const OutputWindow &window, BilinearTable &rows, BilinearTable &cols)
+{
+    const ImagePlane &in = bands.inputs[0];
+    const ImagePlane &out = bands.outputs[0];
+    calcBilinearTable(in.nYSize, window.nFullYSize, window.nYOff,
+        out.nYSize, rows);
+    calcBilinearTable(in.nXSize, window.nFullXSize, window.nXOff,
+        out.nXSize, cols);
+}
+
+/* A small pool of worker threads for splitting the rows of the */
+/* output between. Created on first use and grows as more threads are */
+/* requested. Can be used from multiple Python threads at once as the */
+/* GIL is released while the kernels run. Never destroyed as the */
+/* workers may still be waiting when the interpreter shuts down. */
+class RowThreadPool
+{
+public:
+    // Run all the tasks, using up to nThreads threads (including the
+    // calling thread). Returns once they are all complete.
+    // Returns false if any of the tasks ran out of memory.
+    bool run(std::vector<std::function<void()> > &tasks, int nThreads)
+    {
+        Batch batch;
+        batch.nRemaining = tasks.size();
+        batch.bNoMemory = false;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            checkFork();
+            while( m_nWorkers < nThreads - 1 )
+            {
+                std::thread worker(&RowThreadPool::workerLoop, this);
+                worker.detach();
+                m_nWorkers++;
+            }
+            // the calling thread does the first task itself
+            for( size_t n = 1; n < tasks.size(); n++ )
+                m_queue.push_back(Task(&tasks[n], &batch));
+        }
+        m_taskCond.notify_all();
+
+        runTask(Task(&tasks[0], &batch));
+
+        // help out with the remaining tasks until all done
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while( batch.nRemaining > 0 )
+        {
+            if( !m_queue.empty() )
+            {
+                Task task = m_queue.front();
+                m_queue.pop_front();
+                lock.unlock();
+                runTask(task);
+                lock.lock();
+            }
+            else
+            {
+                m_doneCond.wait(lock);
+            }
+        }
+        return !batch.bNoMemory;
+    }
+
+    static RowThreadPool *get()
+    {
+        static RowThreadPool *pPool = new RowThreadPool();
+        return pPool;
+    }
+
+private:
+    struct Batch
+    {
+        size_t nRemaining;
+        bool bNoMemory;
+    };
+    typedef std::pair<std::function<void()>*, Batch*> Task;
+
+    RowThreadPool() : m_nWorkers(0), m_pid(getpid()) {}
+
+    void runTask(const Task &task)
+    {
+        bool bNoMemory = false;
+        try
+        {
+            (*task.first)();
+        }
+        catch(std::bad_alloc &)
+        {
+            bNoMemory = true;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        task.second->bNoMemory |= bNoMemory;
+        task.second->nRemaining--;
+        if( task.second->nRemaining == 0 )
+            m_doneCond.notify_all();
+    }
+
+    void workerLoop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for( ;; )
+        {
+            if( m_queue.empty() )
+            {
+                m_taskCond.wait(lock);
+                continue;
+            }
+            Task task = m_queue.front();
+            m_queue.pop_front();
+            lock.unlock();
+            runTask(task);
+            lock.lock();
+        }
+    }
+
+    // threads don't survive a fork(), so if we are now in a 
+    // child process forget about the parent's workers
+    void checkFork()
+    {
+        if( getpid() != m_pid )
+        {
+            m_pid = getpid();
+            m_nWorkers = 0;
+            m_queue.clear();
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_taskCond;
+    std::condition_variable m_doneCond;
+    std::deque<Task> m_queue;
+    int m_nWorkers;
+    pid_t m_pid;
+};
+
+// Call fn(nRowStart, nRowEnd) over all of [0, nRows), splitting the
+// rows into chunks across nThreads threads. 
+// Throws std::bad_alloc if any of the chunks do.
+template <class F>
+void runForRows(npy_intp nRows, int nThreads, F fn)
+{
+    // not worth the overhead for tiny outputs
+    const npy_intp nMinRowsPerThread = 16;
+    if( nThreads > nRows / nMinRowsPerThread )
+        nThreads = nRows / nMinRowsPerThread;
+
+    // the threads add their CPU time to the caller's
+    KernelTimes *pTimes = t_pTimes.get();
+    if( nThreads <= 1 )
+    {
+        CPUTimer timer(pTimes);
+        fn(0, nRows);
+        return;
+    }
+
+    std::vector<std::function<void()> > tasks;
+    for( int n = 0; n < nThreads; n++ )
+    {
+        npy_intp nRowStart = nRows * n / nThreads;
+        npy_intp nRowEnd = nRows * (n + 1) / nThreads;
+        tasks.push_back([=]() 
+            { 
+                CPUTimer timer(pTimes);
+                fn(nRowStart, nRowEnd); 
+            });
+    }
+    if( !RowThreadPool::get()->run(tasks, nThreads) )
+        throw std::bad_alloc();
+}
+
+// Calls fn(plane, nRowStart, nRowEnd) to calculate the given rows of out.
+// If the pixels of out aren't contiguous (eg it is a view of one band of 
+// a pixel interleaved image) each row is calculated into a temporary
+// row and then copied across.
+template <class T, class F>
+void forOutputRows(const ImagePlane &out, npy_intp nRowStart, npy_intp nRowEnd,
+        F fn)
+{
+    if( out.nPixelStride == (npy_intp)sizeof(T) )
+    {
+        fn(out, nRowStart, nRowEnd);
+        return;
+    }
+
+    std::vector<T> tmp(out.nXSize);
+    ImagePlane tmpPlane = out;
+    tmpPlane.pData = (char*)tmp.data();
+    tmpPlane.nRowStride = 0;    // every row is tmp
+    tmpPlane.nPixelStride = sizeof(T);
+    for( npy_intp ro = nRowStart; ro < nRowEnd; ro++ )
+    {
+        fn(tmpPlane, ro, ro + 1);
+        char *pOut = out.row<char>(ro);
+        for( npy_intp co = 0; co < out.nXSize; co++ )
+            memcpy(pOut + co * out.nPixelStride, &tmp[co], sizeof(T));
+    }
+}
+
+// As runForRows(), but each of the nBands bands has nRows rows and
+// calls fn(nBand, nRowStart, nRowEnd). The threads are split over the 
+// rows of all the bands together.
+template <class F>
+void runForBandRows(npy_intp nBands, npy_intp nRows, int nThreads, F fn)
+{
+    runForRows(nBands * nRows, nThreads, 
+        [&](npy_intp nStart, npy_intp nEnd)
+        {
+            // may cross a band boundary
+            while( nStart < nEnd )
+            {
+                npy_intp nBand = nStart / nRows;
+                npy_intp nBandEnd = std::min(nEnd, (nBand + 1) * nRows);
+                fn(nBand, nStart - nBand * nRows, nBandEnd - nBand * nRows);
+                nStart = nBandEnd;
+            }
+        });
+}
+
+// Output pixels nColStart to nColEnd of one row, with no ignore value
+template <class T>
+void bilinearSpanNoIgnore(const T *pRowL, const T *pRowU, 
+        const BilinearTable &cols, double r_wl, double r_wu, 
+        npy_intp nColStart, npy_intp nColEnd, T *pOut)
+{
+    const int *pColLower = cols.lower.data();
+    const int *pColUpper = cols.upper.data();
+    const float *pColLowerWeight = cols.lowerWeight.data();
+    const float *pColUpperWeight = cols.upperWeight.data();
+
+    for (npy_intp co = nColStart; co < nColEnd; co++) {
+        // The input pixel values at the 4 surrounding points
+        T a = pRowL[pColLower[co]];
+        T b = pRowL[pColUpper[co]];
+        T c = pRowU[pColLower[co]];
+        T d = pRowU[pColUpper[co]];
+
+        double c_wl = pColLowerWeight[co];
+        double c_wu = pColUpperWeight[co];
+
+        // The weighted average of the four, which is our estimate
+        // for the output pixel
+        pOut[co] = a * c_wl * r_wl +
+                      b * c_wu * r_wl +
+                      c * r_wu * c_wl +
+                      d * c_wu * r_wu;
+    }
+}
+
+template <class T>
+void doBilinearNoIgnore(const ImagePlane &in, const ImagePlane &out,
+        const BilinearTable &rows, const BilinearTable &cols, 
+        npy_intp nRowStart, npy_intp nRowEnd)
+{
+    for (npy_intp ro = nRowStart; ro < nRowEnd; ro++) {
+        // The two input rows either side of this output row.
+        const T *pRowL = in.row<T>(rows.lower[ro]);
+        const T *pRowU = in.row<T>(rows.upper[ro]);
+        bilinearSpanNoIgnore<T>(pRowL, pRowU, cols, rows.lowerWeight[ro],
+            rows.upperWeight[ro], 0, out.nXSize, out.row<T>(ro));
+    }
+}
+
+#define MASK_BLOCK_SIZE 64
+#define MASK_ALL_VALID 0
+#define MASK_NONE_VALID 1
+#define MASK_MIXED 2
+
+/* Which pixels of a region of the input are valid (not the ignore */
+/* value), as 0 or 1 per pixel so they can be used to mask the weights */
+/* without branching. Also, for each block of MASK_BLOCK_SIZE columns */
+/* of each row, whether all, none or only some of the pixels are valid */
+/* so the first two can skip the masking. */
+struct ValidityMask
+{
+    npy_intp nYOff;
+    npy_intp nYSize;
+    npy_intp nXOff;
+    npy_intp nXSize;
+    npy_intp nBlocksPerRow;
+    std::vector<npy_uint8> valid;
+    std::vector<npy_uint8> blocks;
+
+    // pointer to the mask for the given input row, indexed by input column
+    const npy_uint8 *row(npy_intp y) const
+    {
+        return valid.data() + (y - nYOff) * nXSize - nXOff;
+    }
+
+    const npy_uint8 *blockRow(npy_intp y) const
+    {
+        return blocks.data() + (y - nYOff) * nBlocksPerRow;
+    }
+};
+
+// mask of input rows nYOff to nYOff + nYSize and columns nXOff to 
+// nXOff + nXSize
+template <class T>
+void calcValidityMask(const ImagePlane &in, const IgnoreTest<T> &ignore, 
+        npy_intp nYOff, npy_intp nYSize, npy_intp nXOff, npy_intp nXSize,
+        ValidityMask &mask)
+{
+    mask.nYOff = nYOff;
+    mask.nYSize = nYSize;
+    mask.nXOff = nXOff;
+    mask.nXSize = nXSize;
+    mask.nBlocksPerRow = (nXSize + MASK_BLOCK_SIZE - 1) / MASK_BLOCK_SIZE;
+    mask.valid.resize(nYSize * nXSize);
+    mask.blocks.resize(nYSize * mask.nBlocksPerRow);
+
+    for( npy_intp y = 0; y < nYSize; y++ )
+    {
+        const T *pIn = in.row<T>(nYOff + y) + nXOff;
+        npy_uint8 *pValid = mask.valid.data() + y * nXSize;
+        for( npy_intp x = 0; x < nXSize; x++ )
+            pValid[x] = !ignore(pIn[x]);
+
+        for( npy_intp b = 0; b < mask.nBlocksPerRow; b++ )
+        {
+            npy_intp nStart = b * MASK_BLOCK_SIZE;
+            npy_intp nEnd = std::min(nStart + MASK_BLOCK_SIZE, nXSize);
+            npy_intp nValid = 0;
+            for( npy_intp x = nStart; x < nEnd; x++ )
+                nValid += pValid[x];
+
+            npy_uint8 nState = MASK_MIXED;
+            if( nValid == nEnd - nStart )
+                nState = MASK_ALL_VALID;
+            else if( nValid == 0 )
+                nState = MASK_NONE_VALID;
+            mask.blocks[y * mask.nBlocksPerRow + b] = nState;
+        }
+    }
+}
+
+// Output pixels nColStart to nColEnd of one row where only some of the
+// inputs are valid. The weights of the invalid ones are masked out.
+template <class T>
+void bilinearSpanMasked(const T *pRowL, const T *pRowU, 
+        const npy_uint8 *pValidL, const npy_uint8 *pValidU,
+        const BilinearTable &cols, double r_wl, double r_wu, T typeIgnore,
+        npy_intp nColStart, npy_intp nColEnd, T *pOut)
+{
+    const int *pColLower = cols.lower.data();
+    const int *pColUpper = cols.upper.data();
+    const float *pColLowerWeight = cols.lowerWeight.data();
+    const float *pColUpperWeight = cols.upperWeight.data();
+
+    for (npy_intp co = nColStart; co < nColEnd; co++) {
+        int cl = pColLower[co];
+        int cu = pColUpper[co];
+        double c_wl = pColLowerWeight[co];
+        double c_wu = pColUpperWeight[co];
+
+        // 0 or 1
+        double ma = pValidL[cl];
+        double mb = pValidL[cu];
+        double mc = pValidU[cl];
+        double md = pValidU[cu];
+
+        // invalid values are replaced by 0 rather than multiplied by 
+        // their 0 weight, as they may be NaN
+        double a = ma ? (double)pRowL[cl] : 0.0;
+        double b = mb ? (double)pRowL[cu] : 0.0;
+        double c = mc ? (double)pRowU[cl] : 0.0;
+        double d = md ? (double)pRowU[cu] : 0.0;
+
+        float totalWeight = 0.0;
+        float pixelSum = 0.0;
+        pixelSum += a * c_wl * r_wl;
+        totalWeight += c_wl * r_wl * ma;
+        pixelSum += b * c_wu * r_wl;
+        totalWeight += c_wu * r_wl * mb;
+        pixelSum += c * r_wu * c_wl;
+        totalWeight += r_wu * c_wl * mc;
+        pixelSum += d * c_wu * r_wu;
+        totalWeight += c_wu * r_wu * md;
+
+        pOut[co] = (totalWeight > 0) ? (T)(pixelSum / totalWeight) : typeIgnore;
+    }
+}
+
+// Bilinear with an ignore value. Each output row is split into runs
+// of pixels whose inputs all lie in one block of the mask (the last
+// pixel before a block boundary is a run of its own). Runs where all
+// the inputs are valid use the no ignore version and those where none
+// are just get the ignore value.
+template <class T>
+void doBilinearHaveIgnore(const ImagePlane &in, const ImagePlane &out,
+        const BilinearTable &rows, const BilinearTable &cols, 
+        const BandIgnore &ignore, npy_intp nRowStart, npy_intp nRowEnd)
+{
+    IgnoreTest<T> test(ignore);
+    if( !test.bHave )
+    {
+        doBilinearNoIgnore <T> (in, out, rows, cols, nRowStart, nRowEnd);
+        return;
+    }
+
+    npy_intp nOutXSize = out.nXSize;
+    const int *pColLower = cols.lower.data();
+    const int *pColUpper = cols.upper.data();
+
+    // only the inputs used by these rows. The tables are in increasing
+    // order.
+    ValidityMask mask;
+    npy_intp nYMin = rows.lower[nRowStart];
+    npy_intp nXMin = cols.lower.front();
+    calcValidityMask<T>(in, test, nYMin, rows.upper[nRowEnd - 1] - nYMin + 1,
+        nXMin, cols.upper.back() - nXMin + 1, mask);
+
+    for (npy_intp ro = nRowStart; ro < nRowEnd; ro++) {
+        const T *pRowL = in.row<T>(rows.lower[ro]);
+        const T *pRowU = in.row<T>(rows.upper[ro]);
+        const npy_uint8 *pBlocksL = mask.blockRow(rows.lower[ro]);
+        const npy_uint8 *pBlocksU = mask.blockRow(rows.upper[ro]);
+        T *pOut = out.row<T>(ro);
+        double r_wl = rows.lowerWeight[ro];
+        double r_wu = rows.upperWeight[ro];
+
+        npy_intp co = 0;
+        while( co < nOutXSize )
+        {
+            npy_intp b = (pColLower[co] - nXMin) / MASK_BLOCK_SIZE;
+            npy_intp nBlockEnd = nXMin + (b + 1) * MASK_BLOCK_SIZE;
+            npy_intp nEnd = co;
+            while( nEnd < nOutXSize && pColUpper[nEnd] < nBlockEnd )
+                nEnd++;
+
+            int nState = MASK_MIXED;
+            if( nEnd == co )
+                nEnd = co + 1;      // straddles the boundary
+            else if( pBlocksL[b] == pBlocksU[b] )
+                nState = pBlocksL[b];
+
+            if( nState == MASK_ALL_VALID )
+                bilinearSpanNoIgnore<T>(pRowL, pRowU, cols, r_wl, r_wu, 
+                    co, nEnd, pOut);
+            else if( nState == MASK_NONE_VALID )
+                std::fill(pOut + co, pOut + nEnd, test.value);
+            else
+                bilinearSpanMasked<T>(pRowL, pRowU, mask.row(rows.lower[ro]),
+                    mask.row(rows.upper[ro]), cols, r_wl, r_wu, test.value,
+                    co, nEnd, pOut);
+            co = nEnd;
+        }
+    }
+}
+
+template <class T>
+void doBilinear(const ResampleBands &bands, const OutputWindow &window, 
+        int nThreads)
+{
+    BilinearTable rows, cols;
+    calcBilinearTables(bands, window, rows, cols);
+
+    runForBandRows(bands.inputs.size(), bands.outputs[0].nYSize, nThreads, 
+        [&](npy_intp nBand, npy_intp nRowStart, npy_intp nRowEnd)
+        {
+            const ImagePlane &in = bands.inputs[nBand];
+            const BandIgnore &ignore = bands.ignores[nBand];
+            forOutputRows<T>(bands.outputs[nBand], nRowStart, nRowEnd,
+                [&](const ImagePlane &out, npy_intp nStart, npy_intp nEnd)
+                {
+                    if( ignore.bHave )
+                        doBilinearHaveIgnore <T> (in, out, rows, cols, 
+                            ignore, nStart, nEnd);
+                    else
+                        // no ignore - use optimised version
+                        doBilinearNoIgnore <T> (in, out, rows, cols, 
+                            nStart, nEnd);
+                });
+        });
+}
+
+/* The separable filters (cubic and lanczos). Each output pixel along */
+/* an axis is the weighted sum of nTaps consecutive input pixels from */
+/* start[o]. The weights are stored tap by tap (weight(k)[o]) so the */
+/* weights for neighbouring output pixels are contiguous. */
+struct FilterTable
+{
+    int nTaps;
+    std::vector<int> start;
+    std::vector<float> weights;
+
+    const float *weight(int k) const
+    {
+        return weights.data() + k * start.size();
+    }
+};
+
+#define FILTER_CUBIC 0
+#define FILTER_LANCZOS 1
+
+// in input pixels (when not reducing)
+static int filterRadius(int nKernel)
+{
+    return (nKernel == FILTER_CUBIC) ? 2 : 3;
+}
+
+static double filterWeight(int nKernel, double x)
+{
+    x = std::fabs(x);
+    if( nKernel == FILTER_CUBIC )
+    {
+        // Keys with a = -0.5 (Catmull-Rom) as used by GDAL
+        const double a = -0.5;
+        if( x < 1 )
+            return ((a + 2) * x - (a + 3)) * x * x + 1;
+        else if( x < 2 )
+            return ((a * x - 5 * a) * x + 8 * a) * x - 4 * a;
+        return 0;
+    }
+    else
+    {
+        // Lanczos with 3 lobes
+        if( x < 1e-8 )
+            return 1;
+        if( x >= 3 )
+            return 0;
+        double px = M_PI * x;
+        return 3 * std::sin(px) * std::sin(px / 3) / (px * px);
+    }
+}
+
+// table for output pixels nOutOffset to nOutOffset + nOutSize of an
+// output that is nFullOutSize in total. When reducing, the kernel is
+// stretched to cover all the input pixels. Taps off the edge of the
+// input use the edge pixel.
+static void calcFilterTable(int nKernel, npy_intp nInSize, npy_intp nFullOutSize, 
+        npy_intp nOutOffset, npy_intp nOutSize, FilterTable &table)
+{
+    double scale = (double)nInSize / (double)nFullOutSize;
+    double stretch = std::max(scale, 1.0);
+    double support = filterRadius(nKernel) * stretch;
+    int nAllTaps;
+    if( stretch == 1.0 )
+        nAllTaps = 2 * filterRadius(nKernel);
+    else
+        nAllTaps = (int)std::ceil(2 * support) + 1;
+    int nTaps = (int)std::min((npy_intp)nAllTaps, nInSize);
+
+    table.nTaps = nTaps;
+    table.start.resize(nOutSize);
+    table.weights.assign(nOutSize * nTaps, 0.0f);
+
+    std::vector<double> w(nTaps);
+    for (npy_intp o = 0; o < nOutSize; o++) {
+        // same coordinates as bilinear
+        double centre = (o + nOutOffset + 0.5) * scale - 0.5;
+        npy_intp nFirst;
+        if( stretch == 1.0 )
+            nFirst = (npy_intp)std::floor(centre) - filterRadius(nKernel) + 1;
+        else
+            nFirst = (npy_intp)std::floor(centre - support) + 1;
+        npy_intp nStart = std::max((npy_intp)0, 
+            std::min(nFirst, nInSize - nTaps));
+
+        std::fill(w.begin(), w.end(), 0.0);
+        double dTotal = 0;
+        for (int k = 0; k < nAllTaps; k++) {
+            npy_intp i = nFirst + k;
+            double dWeight = filterWeight(nKernel, (i - centre) / stretch);
+            i = std::max((npy_intp)0, std::min(i, nInSize - 1));
+            w[i - nStart] += dWeight;
+            dTotal += dWeight;
+        }
+        if( dTotal == 0 )
+            dTotal = 1;
+
+        table.start[o] = (int)nStart;
+        for (int k = 0; k < nTaps; k++)
+            table.weights[k * nOutSize + o] = (float)(w[k] / dTotal);
+    }
+}
+
+// The tables only depend on the sizes and the window, which are mostly
+// the same for each tile at a zoom level, so the last few are kept.
+#define FILTER_TABLE_CACHE_SIZE 64
+
+static std::shared_ptr<const FilterTable> getFilterTable(int nKernel, 
+        npy_intp nInSize, npy_intp nFullOutSize, npy_intp nOutOffset, 
+        npy_intp nOutSize)
+{
+    typedef std::vector<npy_intp> Key;
+    typedef std::pair<Key, std::shared_ptr<const FilterTable> > Entry;
+    static std::mutex mutex;
+    static std::list<Entry> cache;    // most recently used first
+
+    Key key = {nKernel, nInSize, nFullOutSize, nOutOffset, nOutSize};
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for( auto itr = cache.begin(); itr != cache.end(); ++itr )
+        {
+            if( itr->first == key )
+            {
+                cache.splice(cache.begin(), cache, itr);
+                return itr->second;
+            }
+        }
+    }
+
+    std::shared_ptr<FilterTable> table = std::make_shared<FilterTable>();
+    calcFilterTable(nKernel, nInSize, nFullOutSize, nOutOffset, nOutSize, 
+        *table);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    cache.push_front(Entry(key, table));
+    if( cache.size() > FILTER_TABLE_CACHE_SIZE )
+        cache.pop_back();
+    return table;
+}
+
+// rounded (to nearest, as the vector versions) and clipped to the range
+// of T (the negative lobes of the
+// filters can overshoot)
+template <class T, class Acc>
+inline T clampPixel(Acc val)
+{
+    if( std::is_integral<T>::value )
+    {
+        if( !(val > (Acc)std::numeric_limits<T>::min()) )    // also NaN
+            return std::numeric_limits<T>::min();
+        if( val >= (Acc)std::numeric_limits<T>::max() )
+            return std::numeric_limits<T>::max();
+        return (T)std::nearbyint(val);
+    }
+    return (T)val;
+}
+
+// Per row functions for the filters as for AVX2Ops and NEONOps below,
+// for the other types and when there isn't an instruction set.
+struct ScalarFilterOps
+{
+    template <class T, class Acc>
+    static void filterLoad(const T *pRow, npy_intp n, Acc *pNum)
+    {
+        for( npy_intp x = 0; x < n; x++ )
+            pNum[x] = (Acc)pRow[x];
+    }
+
+    // pDen is 1 for the valid pixels and 0 (as is pNum) for the ignored
+    template <class T, class Acc>
+    static void filterLoadIgnore(const T *pRow, const IgnoreTest<T> &ignore, 
+            npy_intp n, Acc *pNum, Acc *pDen)
+    {
+        for( npy_intp x = 0; x < n; x++ )
+        {
+            bool bValid = !ignore(pRow[x]);
+            pNum[x] = bValid ? (Acc)pRow[x] : 0;
+            pDen[x] = bValid ? 1 : 0;
+        }
+    }
+
+    template <class Acc>
+    static void filterHorizontal(const Acc *pIn, const FilterTable &cols, 
+            Acc *pRes)
+    {
+        npy_intp n = cols.start.size();
+        for( npy_intp co = 0; co < n; co++ )
+        {
+            const Acc *pTaps = pIn + cols.start[co];
+            Acc sum = 0;
+            for( int k = 0; k < cols.nTaps; k++ )
+                sum += cols.weight(k)[co] * pTaps[k];
+            pRes[co] = sum;
+        }
+    }
+
+    // pTmp += w * pRow
+    template <class Acc>
+    static void filterAccumulate(const Acc *pRow, Acc w, npy_intp n, Acc *pTmp)
+    {
+        for( npy_intp x = 0; x < n; x++ )
+            pTmp[x] += w * pRow[x];
+    }
+
+    template <class T, class Acc>
+    static void filterStore(const Acc *pNum, npy_intp n, T *pOut)
+    {
+        for( npy_intp x = 0; x < n; x++ )
+            pOut[x] = clampPixel<T, Acc>(pNum[x]);
+    }
+
+    template <class T, class Acc>
+    static void filterStoreIgnore(const Acc *pNum, const Acc *pDen, 
+            T typeIgnore, npy_intp n, T *pOut)
+    {
+        for( npy_intp x = 0; x < n; x++ )
+        {
+            if( pDen[x] >= (Acc)0.5 )
+                pOut[x] = clampPixel<T, Acc>(pNum[x] / pDen[x]);
+            else
+                pOut[x] = typeIgnore;
+        }
+    }
+};
+
+/* Fixed point bilinear for uint8 and uint16. The weights are integers */
+/* (out of 2^nRowBits and 2^nColBits) and all the arithmetic is in */
+/* integers and rounded to nearest, so the vectorised versions give */
+/* exactly the same result as the scalar ones on any CPU. Like the */
+/* float kernels, the two input rows are first blended into a */
+/* temporary row and the output pixels then blended from that in Acc */
+/* and shifted down by nOutShift. With an ignore value, */
+/* temporary pixels from an ignored input are set to nInvalid and the */
+/* output pixels that use them are calculated separately from the */
+/* valid inputs by fixedBilinearPartial(). */
+template <class T>
+struct FixedPoint
+{
+};
+
+template <>
+struct FixedPoint<npy_uint8>
+{
+    typedef npy_uint16 Tmp;             // 255 * 256 fits in 16 bits
+    typedef npy_uint32 Acc;
+    static const int nRowBits = 8;
+    static const int nColBits = 8;
+    static const int nOutShift = 16;
+    static const Tmp nInvalid = 0xFFFF;
+};
+
+template <>
+struct FixedPoint<npy_uint16>
+{
+    typedef npy_uint32 Tmp;             // 65535 * 32768 fits in 32 bits
+    typedef npy_uint64 Acc;
+    static const int nRowBits = 15;
+    static const int nColBits = 16;
+    static const int nOutShift = 31;
+    static const Tmp nInvalid = 0xFFFFFFFF;
+};
+
+/* As BilinearTable, with the weights as integers out of 2^nBits */
+struct FixedBilinearTable
+{
+    std::vector<int> lower;
+    std::vector<int> upper;
+    std::vector<npy_uint32> lowerWeight;
+    std::vector<npy_uint32> upperWeight;
+};
+
+// The same positions as calcBilinearTable(), but worked out exactly in
+// integers so the weights don't depend on how the compiler does floats
+static void calcFixedBilinearTable(npy_intp nInSize, npy_intp nFullOutSize, 
+        npy_intp nOutOffset, npy_intp nOutSize, int nBits, 
+        FixedBilinearTable &table)
+{
+    table.lower.resize(nOutSize);
+    table.upper.resize(nOutSize);
+    table.lowerWeight.resize(nOutSize);
+    table.upperWeight.resize(nOutSize);
+
+    const npy_int64 nOne = (npy_int64)1 << nBits;
+    const npy_int64 nDen = 2 * (npy_int64)nFullOutSize;
+    for (npy_intp o = 0; o < nOutSize; o++) {
+        // i = (o + 0.5) * scale - 0.5 = nNum / nDen
+        npy_int64 nNum = (2 * (npy_int64)(o + nOutOffset) + 1) * nInSize - 
+            nFullOutSize;
+        npy_int64 nLower, nWeight;
+        if( nNum < 0 )
+        {
+            // before the first pixel centre
+            nLower = 0;
+            nWeight = 0;
+        }
+        else
+        {
+            nLower = nNum / nDen;
+            nWeight = ((nNum % nDen) * nOne + nDen / 2) / nDen;
+        }
+        npy_int64 nUpper = nLower + 1;
+        if( nUpper >= nInSize )
+            nUpper = nInSize - 1;
+        if( nLower >= nInSize )
+            nLower = nInSize - 1;
+
+        table.lower[o] = (int)nLower;
+        table.upper[o] = (int)nUpper;
+        table.upperWeight[o] = (npy_uint32)nWeight;
+        table.lowerWeight[o] = (npy_uint32)(nOne - nWeight);
+    }
+}
+
+template <class T>
+inline typename FixedPoint<T>::Tmp fixedVerticalPixel(T l, T u, 
+        npy_uint32 wl, npy_uint32 wu, bool bHaveIgnore, T typeIgnore)
+{
+    if( bHaveIgnore && (l == typeIgnore || u == typeIgnore) )
+        return FixedPoint<T>::nInvalid;
+    return (typename FixedPoint<T>::Tmp)(l * wl + u * wu);
+}
+
+// unsigned so nInvalid just gives a wrong answer (which is replaced)
+template <class T>
+inline T fixedHorizontalPixel(npy_uint32 a, npy_uint32 b, npy_uint32 wl, 
+        npy_uint32 wu)
+{
+    typedef FixedPoint<T> FP;
+    const typename FP::Acc nRound = (typename FP::Acc)1 << (FP::nOutShift - 1);
+    return (T)(((typename FP::Acc)a * wl + (typename FP::Acc)b * wu + nRound) 
+        >> FP::nOutShift);
+}
+
+// The weighted average (rounded to nearest) of the valid ones of the 
+// four input pixels, or the ignore value if there aren't any
+template <class T>
+T fixedBilinearPartial(const T *pRowL, const T *pRowU, int cl, int cu,
+        npy_uint32 rwl, npy_uint32 rwu, npy_uint32 cwl, npy_uint32 cwu, 
+        T typeIgnore)
+{
+    const T values[4] = {pRowL[cl], pRowL[cu], pRowU[cl], pRowU[cu]};
+    const npy_uint64 weights[4] = {(npy_uint64)rwl * cwl, (npy_uint64)rwl * cwu,
+        (npy_uint64)rwu * cwl, (npy_uint64)rwu * cwu};
+    npy_uint64 nNum = 0, nDen = 0;
+    for( int i = 0; i < 4; i++ )
+    {
+        if( values[i] != typeIgnore )
+        {
+            nNum += values[i] * weights[i];
+            nDen += weights[i];
+        }
+    }
+    if( nDen == 0 )
+        return typeIgnore;
+    return (T)((nNum + nDen / 2) / nDen);
+}
+
+// Per row functions for the fixed point kernel as for AVX2Ops and 
+// NEONOps below. These are the reference the others must match.
+struct FixedScalarOps
+{
+    template <class T>
+    static void fixedVertical(const T *pRowL, const T *pRowU, npy_uint32 wl,
+            npy_uint32 wu, bool bHaveIgnore, T typeIgnore, npy_intp n, 
+            typename FixedPoint<T>::Tmp *pTmp)
+    {
+        for( npy_intp x = 0; x < n; x++ )
+            pTmp[x] = fixedVerticalPixel<T>(pRowL[x], pRowU[x], wl, wu, 
+                bHaveIgnore, typeIgnore);
+    }
+
+    template <class T>
+    static void fixedHorizontal(const typename FixedPoint<T>::Tmp *pTmp, 
+            const FixedBilinearTable &cols, T *pOut)
+    {
+        npy_intp n = cols.lower.size();
+        for( npy_intp co = 0; co < n; co++ )
+            pOut[co] = fixedHorizontalPixel<T>(pTmp[cols.lower[co]], 
+                pTmp[cols.upper[co]], cols.lowerWeight[co], cols.upperWeight[co]);
+    }
+};
+
+// The vectorised kernels below do the interpolation in two passes 
+// using single precision floats. First the two input rows either side 
+// of an output row are blended together into a temporary row (contiguous,
+// so vectorises well), then the output pixels are gathered from the
+// temporary row using the column table. 
+// With an ignore value, the numerator and denominator of the weighted 
+// average are interpolated separately, with the ignored input pixels 
+// masked out of both. This gives the same result as the scalar
+// doBilinearHaveIgnore without needing a branch per pixel.
+// The Ops classes contain the per row functions for each instruction set.
+// Each processes 8 pixels at a time with a scalar loop for the remainder.
+// The remainder loops use fma() so every pixel is calculated the same way
+// regardless of where it falls, otherwise a window of the output wouldn't
+// exactly match the same part of the full output.
+
+#if defined(RESAMPLER_HAVE_AVX2)
+AVX2_TARGET static inline __m256 avx2Load(const npy_uint8 *p)
+{
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p)));
+}
+
+AVX2_TARGET static inline __m256 avx2Load(const npy_uint16 *p)
+{
+    return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p)));
+}
+
+AVX2_TARGET static inline __m256 avx2Load(const npy_int16 *p)
+{
+    return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)p)));
+}
+
+AVX2_TARGET static inline __m256 avx2Load(const npy_float32 *p)
+{
+    return _mm256_loadu_ps(p);
+}
+
+// conversions to integer truncate, as per the scalar casts
+AVX2_TARGET static inline void avx2Store(npy_uint8 *p, __m256 v)
+{
+    __m256i i = _mm256_cvttps_epi32(v);
+    __m128i w = _mm_packus_epi32(_mm256_castsi256_si128(i), _mm256_extracti128_si256(i, 1));
+    _mm_storel_epi64((__m128i*)p, _mm_packus_epi16(w, w));
+}
+
+AVX2_TARGET static inline void avx2Store(npy_uint16 *p, __m256 v)
+{
+    __m256i i = _mm256_cvttps_epi32(v);
+    _mm_storeu_si128((__m128i*)p, 
+        _mm_packus_epi32(_mm256_castsi256_si128(i), _mm256_extracti128_si256(i, 1)));
+}
+
+AVX2_TARGET static inline void avx2Store(npy_int16 *p, __m256 v)
+{
+    __m256i i = _mm256_cvttps_epi32(v);
+    _mm_storeu_si128((__m128i*)p, 
+        _mm_packs_epi32(_mm256_castsi256_si128(i), _mm256_extracti128_si256(i, 1)));
+}
+
+AVX2_TARGET static inline void avx2Store(npy_float32 *p, __m256 v)
+{
+    _mm256_storeu_ps(p, v);
+}
+
+struct AVX2Ops
+{
+    template <class T>
+    AVX2_TARGET static void vertical(const T *pRowL, const T *pRowU, 
+            float wl, float wu, npy_intp n, float *pTmp)
+    {
+        __m256 vwl = _mm256_set1_ps(wl);
+        __m256 vwu = _mm256_set1_ps(wu);
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+        {
+            __m256 l = avx2Load(pRowL + x);
+            __m256 u = avx2Load(pRowU + x);
+            _mm256_storeu_ps(pTmp + x, _mm256_fmadd_ps(u, vwu, _mm256_mul_ps(l, vwl)));
+        }
+        for( ; x < n; x++ )
+            pTmp[x] = std::fma((float)pRowU[x], wu, pRowL[x] * wl);
+    }
+
+    template <class T>
+    AVX2_TARGET static void verticalIgnore(const T *pRowL, const T *pRowU, 
+            float wl, float wu, T typeIgnore, npy_intp n, float *pNum, float *pDen)
+    {
+        __m256 vwl = _mm256_set1_ps(wl);
+        __m256 vwu = _mm256_set1_ps(wu);
+        __m256 vign = _mm256_set1_ps((float)typeIgnore);
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+        {
+            __m256 l = avx2Load(pRowL + x);
+            __m256 u = avx2Load(pRowU + x);
+            __m256 ml = _mm256_cmp_ps(l, vign, _CMP_NEQ_UQ);
+            __m256 mu = _mm256_cmp_ps(u, vign, _CMP_NEQ_UQ);
+            _mm256_storeu_ps(pNum + x, _mm256_fmadd_ps(_mm256_and_ps(mu, u), vwu, 
+                _mm256_mul_ps(_mm256_and_ps(ml, l), vwl)));
+            _mm256_storeu_ps(pDen + x, _mm256_add_ps(_mm256_and_ps(ml, vwl), 
+                _mm256_and_ps(mu, vwu)));
+        }
+        for( ; x < n; x++ )
+        {
+            bool bValidL = pRowL[x] != typeIgnore;
+            bool bValidU = pRowU[x] != typeIgnore;
+            pNum[x] = std::fma(bValidU ? (float)pRowU[x] : 0.0f, wu, 
+                (bValidL ? (float)pRowL[x] : 0.0f) * wl);
+            pDen[x] = (bValidL ? wl : 0.0f) + (bValidU ? wu : 0.0f);
+        }
+    }
+
+    template <class T>
+    AVX2_TARGET static void horizontal(const float *pTmp, const BilinearTable &cols, 
+            T *pOut)
+    {
+        npy_intp n = cols.lower.size();
+        const int *pLower = cols.lower.data();
+        const int *pUpper = cols.upper.data();
+        const float *pWL = cols.lowerWeight.data();
+        const float *pWU = cols.upperWeight.data();
+        npy_intp co = 0;
+        for( ; co + 8 <= n; co += 8 )
+        {
+            __m256 a = _mm256_i32gather_ps(pTmp, _mm256_loadu_si256((const __m256i*)(pLower + co)), 4);
+            __m256 b = _mm256_i32gather_ps(pTmp, _mm256_loadu_si256((const __m256i*)(pUpper + co)), 4);
+            avx2Store(pOut + co, _mm256_fmadd_ps(b, _mm256_loadu_ps(pWU + co), 
+                _mm256_mul_ps(a, _mm256_loadu_ps(pWL + co))));
+        }
+        for( ; co < n; co++ )
+            pOut[co] = std::fma(pTmp[pUpper[co]], pWU[co], pTmp[pLower[co]] * pWL[co]);
+    }
+
+    template <class T>
+    AVX2_TARGET static void horizontalIgnore(const float *pNum, const float *pDen,
+            const BilinearTable &cols, T typeIgnore, T *pOut)
+    {
+        npy_intp n = cols.lower.size();
+        const int *pLower = cols.lower.data();
+        const int *pUpper = cols.upper.data();
+        const float *pWL = cols.lowerWeight.data();
+        const float *pWU = cols.upperWeight.data();
+        __m256 vign = _mm256_set1_ps((float)typeIgnore);
+        __m256 vzero = _mm256_setzero_ps();
+        npy_intp co = 0;
+        for( ; co + 8 <= n; co += 8 )
+        {
+            __m256i il = _mm256_loadu_si256((const __m256i*)(pLower + co));
+            __m256i iu = _mm256_loadu_si256((const __m256i*)(pUpper + co));
+            __m256 wl = _mm256_loadu_ps(pWL + co);
+            __m256 wu = _mm256_loadu_ps(pWU + co);
+            __m256 num = _mm256_fmadd_ps(_mm256_i32gather_ps(pNum, iu, 4), wu,
+                _mm256_mul_ps(_mm256_i32gather_ps(pNum, il, 4), wl));
+            __m256 den = _mm256_fmadd_ps(_mm256_i32gather_ps(pDen, iu, 4), wu,
+                _mm256_mul_ps(_mm256_i32gather_ps(pDen, il, 4), wl));
+            __m256 valid = _mm256_cmp_ps(den, vzero, _CMP_GT_OQ);
+            avx2Store(pOut + co, _mm256_blendv_ps(vign, _mm256_div_ps(num, den), valid));
+        }
+        for( ; co < n; co++ )
+        {
+            float den = std::fma(pDen[pUpper[co]], pWU[co], pDen[pLower[co]] * pWL[co]);
+            if( den > 0 )
+                pOut[co] = std::fma(pNum[pUpper[co]], pWU[co], 
+                    pNum[pLower[co]] * pWL[co]) / den;
+            else
+                pOut[co] = typeIgnore;
+        }
+    }
+    template <class T>
+    AVX2_TARGET static void filterLoad(const T *pRow, npy_intp n, float *pNum)
+    {
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+            _mm256_storeu_ps(pNum + x, avx2Load(pRow + x));
+        for( ; x < n; x++ )
+            pNum[x] = (float)pRow[x];
+    }
+
+    template <class T>
+    AVX2_TARGET static void filterLoadIgnore(const T *pRow, 
+            const IgnoreTest<T> &ignore, npy_intp n, float *pNum, float *pDen)
+    {
+        __m256 vign = _mm256_set1_ps((float)ignore.value);
+        __m256 vone = _mm256_set1_ps(1.0f);
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+        {
+            __m256 v = avx2Load(pRow + x);
+            // a NaN ignore value leaves out the NaN pixels
+            __m256 m = ignore.bNaN ? _mm256_cmp_ps(v, v, _CMP_ORD_Q) :
+                _mm256_cmp_ps(v, vign, _CMP_NEQ_UQ);
+            _mm256_storeu_ps(pNum + x, _mm256_and_ps(m, v));
+            _mm256_storeu_ps(pDen + x, _mm256_and_ps(m, vone));
+        }
+        for( ; x < n; x++ )
+        {
+            bool bValid = !ignore(pRow[x]);
+            pNum[x] = bValid ? (float)pRow[x] : 0.0f;
+            pDen[x] = bValid ? 1.0f : 0.0f;
+        }
+    }
+
+    // tap k of 8 output pixels is gathered from pIn + k
+    AVX2_TARGET static void filterHorizontal(const float *pIn, 
+            const FilterTable &cols, float *pRes)
+    {
+        npy_intp n = cols.start.size();
+        const int *pStart = cols.start.data();
+        npy_intp co = 0;
+        for( ; co + 8 <= n; co += 8 )
+        {
+            __m256i idx = _mm256_loadu_si256((const __m256i*)(pStart + co));
+            __m256 sum = _mm256_setzero_ps();
+            for( int k = 0; k < cols.nTaps; k++ )
+                sum = _mm256_fmadd_ps(_mm256_i32gather_ps(pIn + k, idx, 4), 
+                    _mm256_loadu_ps(cols.weight(k) + co), sum);
+            _mm256_storeu_ps(pRes + co, sum);
+        }
+        for( ; co < n; co++ )
+        {
+            float sum = 0;
+            for( int k = 0; k < cols.nTaps; k++ )
+                sum = std::fma(pIn[pStart[co] + k], cols.weight(k)[co], sum);
+            pRes[co] = sum;
+        }
+    }
+
+    // pTmp += w * pRow
+    AVX2_TARGET static void filterAccumulate(const float *pRow, float w, 
+            npy_intp n, float *pTmp)
+    {
+        __m256 vw = _mm256_set1_ps(w);
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+            _mm256_storeu_ps(pTmp + x, _mm256_fmadd_ps(_mm256_loadu_ps(pRow + x), 
+                vw, _mm256_loadu_ps(pTmp + x)));
+        for( ; x < n; x++ )
+            pTmp[x] = std::fma(pRow[x], w, pTmp[x]);
+    }
+
+    // integers are rounded to nearest (as clampPixel()) and saturated
+    // by avx2Store()
+    template <class T>
+    AVX2_TARGET static void filterStore(const float *pNum, npy_intp n, T *pOut)
+    {
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+        {
+            __m256 v = _mm256_loadu_ps(pNum + x);
+            if( std::is_integral<T>::value )
+                v = _mm256_round_ps(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            avx2Store(pOut + x, v);
+        }
+        for( ; x < n; x++ )
+            pOut[x] = clampPixel<T, float>(pNum[x]);
+    }
+
+    template <class T>
+    AVX2_TARGET static void filterStoreIgnore(const float *pNum, const float *pDen,
+            T typeIgnore, npy_intp n, T *pOut)
+    {
+        __m256 vign = _mm256_set1_ps((float)typeIgnore);
+        __m256 vhalf = _mm256_set1_ps(0.5f);
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+        {
+            __m256 den = _mm256_loadu_ps(pDen + x);
+            __m256 v = _mm256_div_ps(_mm256_loadu_ps(pNum + x), den);
+            if( std::is_integral<T>::value )
+                v = _mm256_round_ps(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            __m256 valid = _mm256_cmp_ps(den, vhalf, _CMP_GE_OQ);
+            avx2Store(pOut + x, _mm256_blendv_ps(vign, v, valid));
+        }
+        for( ; x < n; x++ )
+        {
+            if( pDen[x] >= 0.5f )
+                pOut[x] = clampPixel<T, float>(pNum[x] / pDen[x]);
+            else
+                pOut[x] = typeIgnore;
+        }
+    }
+    // fixed point, see FixedScalarOps. 16 pixels at a time in 16 bits.
+    AVX2_TARGET static void fixedVertical(const npy_uint8 *pRowL, 
+            const npy_uint8 *pRowU, npy_uint32 wl, npy_uint32 wu, 
+            bool bHaveIgnore, npy_uint8 typeIgnore, npy_intp n, npy_uint16 *pTmp)
+    {
+        __m256i vwl = _mm256_set1_epi16((short)wl);
+        __m256i vwu = _mm256_set1_epi16((short)wu);
+        __m128i vign = _mm_set1_epi8((char)typeIgnore);
+        npy_intp x = 0;
+        for( ; x + 16 <= n; x += 16 )
+        {
+            __m128i l = _mm_loadu_si128((const __m128i*)(pRowL + x));
+            __m128i u = _mm_loadu_si128((const __m128i*)(pRowU + x));
+            __m256i v = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(l), vwl),
+                _mm256_mullo_epi16(_mm256_cvtepu8_epi16(u), vwu));
+            if( bHaveIgnore )
+            {
+                // all ones where either is ignored
+                __m128i m = _mm_or_si128(_mm_cmpeq_epi8(l, vign), _mm_cmpeq_epi8(u, vign));
+                v = _mm256_or_si256(v, _mm256_cvtepi8_epi16(m));
+            }
+            _mm256_storeu_si256((__m256i*)(pTmp + x), v);
+        }
+        for( ; x < n; x++ )
+            pTmp[x] = fixedVerticalPixel<npy_uint8>(pRowL[x], pRowU[x], wl, wu, 
+                bHaveIgnore, typeIgnore);
+    }
+
+    AVX2_TARGET static void fixedVertical(const npy_uint16 *pRowL, 
+            const npy_uint16 *pRowU, npy_uint32 wl, npy_uint32 wu, 
+            bool bHaveIgnore, npy_uint16 typeIgnore, npy_intp n, npy_uint32 *pTmp)
+    {
+        __m256i vwl = _mm256_set1_epi32(wl);
+        __m256i vwu = _mm256_set1_epi32(wu);
+        __m128i vign = _mm_set1_epi16((short)typeIgnore);
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+        {
+            __m128i l = _mm_loadu_si128((const __m128i*)(pRowL + x));
+            __m128i u = _mm_loadu_si128((const __m128i*)(pRowU + x));
+            __m256i v = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_cvtepu16_epi32(l), vwl),
+                _mm256_mullo_epi32(_mm256_cvtepu16_epi32(u), vwu));
+            if( bHaveIgnore )
+            {
+                __m128i m = _mm_or_si128(_mm_cmpeq_epi16(l, vign), _mm_cmpeq_epi16(u, vign));
+                v = _mm256_or_si256(v, _mm256_cvtepi16_epi32(m));
+            }
+            _mm256_storeu_si256((__m256i*)(pTmp + x), v);
+        }
+        for( ; x < n; x++ )
+            pTmp[x] = fixedVerticalPixel<npy_uint16>(pRowL[x], pRowU[x], wl, wu, 
+                bHaveIgnore, typeIgnore);
+    }
+
+    // 8 output pixels at a time in 32 bits. The 16 bit temporary values
+    // are gathered 32 bits at a time (so pTmp needs one extra value on 
+    // the end) and masked
+
+    AVX2_TARGET static void fixedHorizontal(const npy_uint16 *pTmp, 
+            const FixedBilinearTable &cols, npy_uint8 *pOut)
+    {
+        npy_intp n = cols.lower.size();
+        const int *pLower = cols.lower.data();
+        const int *pUpper = cols.upper.data();
+        const npy_uint32 *pWL = cols.lowerWeight.data();
+        const npy_uint32 *pWU = cols.upperWeight.data();
+        __m256i vmask = _mm256_set1_epi32(0xFFFF);
+        __m256i vround = _mm256_set1_epi32(1 << (FixedPoint<npy_uint8>::nOutShift - 1));
+        npy_intp co = 0;
+        for( ; co + 8 <= n; co += 8 )
+        {
+            __m256i a = _mm256_and_si256(vmask, _mm256_i32gather_epi32((const int*)pTmp, 
+                _mm256_loadu_si256((const __m256i*)(pLower + co)), 2));
+            __m256i b = _mm256_and_si256(vmask, _mm256_i32gather_epi32((const int*)pTmp, 
+                _mm256_loadu_si256((const __m256i*)(pUpper + co)), 2));
+            __m256i v = _mm256_add_epi32(
+                _mm256_mullo_epi32(a, _mm256_loadu_si256((const __m256i*)(pWL + co))),
+                _mm256_mullo_epi32(b, _mm256_loadu_si256((const __m256i*)(pWU + co))));
+            v = _mm256_srli_epi32(_mm256_add_epi32(v, vround), 
+                FixedPoint<npy_uint8>::nOutShift);
+            __m128i w = _mm_packus_epi32(_mm256_castsi256_si128(v), 
+                _mm256_extracti128_si256(v, 1));
+            _mm_storel_epi64((__m128i*)(pOut + co), _mm_packus_epi16(w, w));
+        }
+        for( ; co < n; co++ )
+            pOut[co] = fixedHorizontalPixel<npy_uint8>(pTmp[pLower[co]], 
+                pTmp[pUpper[co]], cols.lowerWeight[co], cols.upperWeight[co]);
+    }
+
+    AVX2_TARGET static void fixedHorizontal(const npy_uint32 *pTmp, 
+            const FixedBilinearTable &cols, npy_uint16 *pOut)
+    {
+        npy_intp n = cols.lower.size();
+        const int *pLower = cols.lower.data();
+        const int *pUpper = cols.upper.data();
+        const npy_uint32 *pWL = cols.lowerWeight.data();
+        const npy_uint32 *pWU = cols.upperWeight.data();
+        const int nShift = FixedPoint<npy_uint16>::nOutShift;
+        __m256i vround = _mm256_set1_epi64x(1LL << (nShift - 1));
+        npy_intp co = 0;
+        for( ; co + 8 <= n; co += 8 )
+        {
+            __m256i a = _mm256_i32gather_epi32((const int*)pTmp, 
+                _mm256_loadu_si256((const __m256i*)(pLower + co)), 4);
+            __m256i b = _mm256_i32gather_epi32((const int*)pTmp, 
+                _mm256_loadu_si256((const __m256i*)(pUpper + co)), 4);
+            __m256i wl = _mm256_loadu_si256((const __m256i*)(pWL + co));
+            __m256i wu = _mm256_loadu_si256((const __m256i*)(pWU + co));
+            // 64 bit products of the even lanes then the odd ones
+            __m256i even = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(a, wl), 
+                _mm256_mul_epu32(b, wu)), vround);
+            __m256i odd = _mm256_add_epi64(_mm256_add_epi64(
+                _mm256_mul_epu32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(wl, 32)), 
+                _mm256_mul_epu32(_mm256_srli_epi64(b, 32), _mm256_srli_epi64(wu, 32))), 
+                vround);
+            __m256i v = _mm256_blend_epi32(_mm256_srli_epi64(even, nShift), 
+                _mm256_slli_epi64(_mm256_srli_epi64(odd, nShift), 32), 0xAA);
+            // values fit in 16 bits except where invalid
+            _mm_storeu_si128((__m128i*)(pOut + co), _mm_packus_epi32(
+                _mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+        }
+        for( ; co < n; co++ )
+            pOut[co] = fixedHorizontalPixel<npy_uint16>(pTmp[pLower[co]], 
+                pTmp[pUpper[co]], cols.lowerWeight[co], cols.upperWeight[co]);
+    }
+};
+#endif
+
+#if defined(RESAMPLER_HAVE_NEON)
+static inline float32x4x2_t neonLoad(const npy_uint8 *p)
+{
+    uint16x8_t w = vmovl_u8(vld1_u8(p));
+    float32x4x2_t v;
+    v.val[0] = vcvtq_f32_u32(vmovl_u16(vget_low_u16(w)));
+    v.val[1] = vcvtq_f32_u32(vmovl_u16(vget_high_u16(w)));
+    return v;
+}
+
+static inline float32x4x2_t neonLoad(const npy_uint16 *p)
+{
+    uint16x8_t w = vld1q_u16(p);
+    float32x4x2_t v;
+    v.val[0] = vcvtq_f32_u32(vmovl_u16(vget_low_u16(w)));
+    v.val[1] = vcvtq_f32_u32(vmovl_u16(vget_high_u16(w)));
+    return v;
+}
+
+static inline float32x4x2_t neonLoad(const npy_int16 *p)
+{
+    int16x8_t w = vld1q_s16(p);
+    float32x4x2_t v;
+    v.val[0] = vcvtq_f32_s32(vmovl_s16(vget_low_s16(w)));
+    v.val[1] = vcvtq_f32_s32(vmovl_s16(vget_high_s16(w)));
+    return v;
+}
+
+static inline float32x4x2_t neonLoad(const npy_float32 *p)
+{
+    float32x4x2_t v;
+    v.val[0] = vld1q_f32(p);
+    v.val[1] = vld1q_f32(p + 4);
+    return v;
+}
+
+// conversions to integer truncate, as per the scalar casts
+static inline void neonStore(npy_uint8 *p, float32x4x2_t v)
+{
+    uint16x8_t w = vcombine_u16(vqmovn_u32(vcvtq_u32_f32(v.val[0])), 
+        vqmovn_u32(vcvtq_u32_f32(v.val[1])));
+    vst1_u8(p, vqmovn_u16(w));
+}
+
+static inline void neonStore(npy_uint16 *p, float32x4x2_t v)
+{
+    vst1q_u16(p, vcombine_u16(vqmovn_u32(vcvtq_u32_f32(v.val[0])), 
+        vqmovn_u32(vcvtq_u32_f32(v.val[1]))));
+}
+
+static inline void neonStore(npy_int16 *p, float32x4x2_t v)
+{
+    vst1q_s16(p, vcombine_s16(vqmovn_s32(vcvtq_s32_f32(v.val[0])), 
+        vqmovn_s32(vcvtq_s32_f32(v.val[1]))));
+}
+
+static inline void neonStore(npy_float32 *p, float32x4x2_t v)
+{
+    vst1q_f32(p, v.val[0]);
+    vst1q_f32(p + 4, v.val[1]);
+}
+
+// no gather instruction in NEON so load the lanes individually
+static inline float32x4_t neonGather(const float *p, const int *pIdx)
+{
+    float32x4_t v = vld1q_dup_f32(p + pIdx[0]);
+    v = vld1q_lane_f32(p + pIdx[1], v, 1);
+    v = vld1q_lane_f32(p + pIdx[2], v, 2);
+    v = vld1q_lane_f32(p + pIdx[3], v, 3);
+    return v;
+}
+
+static inline float32x4_t neonMask(uint32x4_t m, float32x4_t v)
+{
+    return vreinterpretq_f32_u32(vandq_u32(m, vreinterpretq_u32_f32(v)));
+}
+
+struct NEONOps
+{
+    template <class T>
+    static void vertical(const T *pRowL, const T *pRowU, 
+            float wl, float wu, npy_intp n, float *pTmp)
+    {
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+        {
+            float32x4x2_t l = neonLoad(pRowL + x);
+            float32x4x2_t u = neonLoad(pRowU + x);
+            vst1q_f32(pTmp + x, vfmaq_n_f32(vmulq_n_f32(l.val[0], wl), u.val[0], wu));
+            vst1q_f32(pTmp + x + 4, vfmaq_n_f32(vmulq_n_f32(l.val[1], wl), u.val[1], wu));
+        }
+        for( ; x < n; x++ )
+            pTmp[x] = std::fma((float)pRowU[x], wu, pRowL[x] * wl);
+    }
+
+    template <class T>
+    static void verticalIgnore(const T *pRowL, const T *pRowU, 
+            float wl, float wu, T typeIgnore, npy_intp n, float *pNum, float *pDen)
+    {
+        float32x4_t vwl = vdupq_n_f32(wl);
+        float32x4_t vwu = vdupq_n_f32(wu);
+        float32x4_t vign = vdupq_n_f32((float)typeIgnore);
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+        {
+            float32x4x2_t l = neonLoad(pRowL + x);
+            float32x4x2_t u = neonLoad(pRowU + x);
+            for( int h = 0; h < 2; h++ )
+            {
+                uint32x4_t ml = vmvnq_u32(vceqq_f32(l.val[h], vign));
+                uint32x4_t mu = vmvnq_u32(vceqq_f32(u.val[h], vign));
+                vst1q_f32(pNum + x + h * 4, vfmaq_f32(vmulq_f32(neonMask(ml, l.val[h]), vwl),
+                    neonMask(mu, u.val[h]), vwu));
+                vst1q_f32(pDen + x + h * 4, vaddq_f32(neonMask(ml, vwl), neonMask(mu, vwu)));
+            }
+        }
+        for( ; x < n; x++ )
+        {
+            bool bValidL = pRowL[x] != typeIgnore;
+            bool bValidU = pRowU[x] != typeIgnore;
+            pNum[x] = std::fma(bValidU ? (float)pRowU[x] : 0.0f, wu, 
+                (bValidL ? (float)pRowL[x] : 0.0f) * wl);
+            pDen[x] = (bValidL ? wl : 0.0f) + (bValidU ? wu : 0.0f);
+        }
+    }
+
+    template <class T>
+    static void horizontal(const float *pTmp, const BilinearTable &cols, T *pOut)
+    {
+        npy_intp n = cols.lower.size();
+        const int *pLower = cols.lower.data();
+        const int *pUpper = cols.upper.data();
+        const float *pWL = cols.lowerWeight.data();
+        const float *pWU = cols.upperWeight.data();
+        npy_intp co = 0;
+        for( ; co + 8 <= n; co += 8 )
+        {
+            float32x4x2_t v;
+            for( int h = 0; h < 2; h++ )
+            {
+                npy_intp i = co + h * 4;
+                v.val[h] = vfmaq_f32(
+                    vmulq_f32(neonGather(pTmp, pLower + i), vld1q_f32(pWL + i)),
+                    neonGather(pTmp, pUpper + i), vld1q_f32(pWU + i));
+            }
+            neonStore(pOut + co, v);
+        }
+        for( ; co < n; co++ )
+            pOut[co] = std::fma(pTmp[pUpper[co]], pWU[co], pTmp[pLower[co]] * pWL[co]);
+    }
+
+    template <class T>
+    static void horizontalIgnore(const float *pNum, const float *pDen,
+            const BilinearTable &cols, T typeIgnore, T *pOut)
+    {
+        npy_intp n = cols.lower.size();
+        const int *pLower = cols.lower.data();
+        const int *pUpper = cols.upper.data();
+        const float *pWL = cols.lowerWeight.data();
+        const float *pWU = cols.upperWeight.data();
+        float32x4_t vign = vdupq_n_f32((float)typeIgnore);
+        float32x4_t vzero = vdupq_n_f32(0);
+        npy_intp co = 0;
+        for( ; co + 8 <= n; co += 8 )
+        {
+            float32x4x2_t v;
+            for( int h = 0; h < 2; h++ )
+            {
+                npy_intp i = co + h * 4;
+                float32x4_t wl = vld1q_f32(pWL + i);
+                float32x4_t wu = vld1q_f32(pWU + i);
+                float32x4_t num = vfmaq_f32(vmulq_f32(neonGather(pNum, pLower + i), wl),
+                    neonGather(pNum, pUpper + i), wu);
+                float32x4_t den = vfmaq_f32(vmulq_f32(neonGather(pDen, pLower + i), wl),
+                    neonGather(pDen, pUpper + i), wu);
+                v.val[h] = vbslq_f32(vcgtq_f32(den, vzero), vdivq_f32(num, den), vign);
+            }
+            neonStore(pOut + co, v);
+        }
+        for( ; co < n; co++ )
+        {
+            float den = std::fma(pDen[pUpper[co]], pWU[co], pDen[pLower[co]] * pWL[co]);
+            if( den > 0 )
+                pOut[co] = std::fma(pNum[pUpper[co]], pWU[co], 
+                    pNum[pLower[co]] * pWL[co]) / den;
+            else
+                pOut[co] = typeIgnore;
+        }
+    }
+    template <class T>
+    static void filterLoad(const T *pRow, npy_intp n, float *pNum)
+    {
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+        {
+            float32x4x2_t v = neonLoad(pRow + x);
+            vst1q_f32(pNum + x, v.val[0]);
+            vst1q_f32(pNum + x + 4, v.val[1]);
+        }
+        for( ; x < n; x++ )
+            pNum[x] = (float)pRow[x];
+    }
+
+    template <class T>
+    static void filterLoadIgnore(const T *pRow, const IgnoreTest<T> &ignore, 
+            npy_intp n, float *pNum, float *pDen)
+    {
+        float32x4_t vign = vdupq_n_f32((float)ignore.value);
+        float32x4_t vone = vdupq_n_f32(1.0f);
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+        {
+            float32x4x2_t v = neonLoad(pRow + x);
+            for( int h = 0; h < 2; h++ )
+            {
+                // a NaN ignore value leaves out the NaN pixels
+                uint32x4_t m = ignore.bNaN ? vceqq_f32(v.val[h], v.val[h]) :
+                    vmvnq_u32(vceqq_f32(v.val[h], vign));
+                vst1q_f32(pNum + x + h * 4, neonMask(m, v.val[h]));
+                vst1q_f32(pDen + x + h * 4, neonMask(m, vone));
+            }
+        }
+        for( ; x < n; x++ )
+        {
+            bool bValid = !ignore(pRow[x]);
+            pNum[x] = bValid ? (float)pRow[x] : 0.0f;
+            pDen[x] = bValid ? 1.0f : 0.0f;
+        }
+    }
+
+    // tap k of 4 output pixels is gathered from pIn + k
+    static void filterHorizontal(const float *pIn, const FilterTable &cols, 
+            float *pRes)
+    {
+        npy_intp n = cols.start.size();
+        const int *pStart = cols.start.data();
+        npy_intp co = 0;
+        for( ; co + 4 <= n; co += 4 )
+        {
+            float32x4_t sum = vdupq_n_f32(0.0f);
+            for( int k = 0; k < cols.nTaps; k++ )
+                sum = vfmaq_f32(sum, neonGather(pIn + k, pStart + co), 
+                    vld1q_f32(cols.weight(k) + co));
+            vst1q_f32(pRes + co, sum);
+        }
+        for( ; co < n; co++ )
+        {
+            float sum = 0;
+            for( int k = 0; k < cols.nTaps; k++ )
+                sum = std::fma(pIn[pStart[co] + k], cols.weight(k)[co], sum);
+            pRes[co] = sum;
+        }
+    }
+
+    // pTmp += w * pRow
+    static void filterAccumulate(const float *pRow, float w, npy_intp n, 
+            float *pTmp)
+    {
+        npy_intp x = 0;
+        for( ; x + 4 <= n; x += 4 )
+            vst1q_f32(pTmp + x, vfmaq_n_f32(vld1q_f32(pTmp + x), 
+                vld1q_f32(pRow + x), w));
+        for( ; x < n; x++ )
+            pTmp[x] = std::fma(pRow[x], w, pTmp[x]);
+    }
+
+    // integers are rounded to nearest (as clampPixel()) and saturated
+    // by neonStore()
+    template <class T>
+    static void filterStore(const float *pNum, npy_intp n, T *pOut)
+    {
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+        {
+            float32x4x2_t v;
+            v.val[0] = vld1q_f32(pNum + x);
+            v.val[1] = vld1q_f32(pNum + x + 4);
+            if( std::is_integral<T>::value )
+            {
+                v.val[0] = vrndnq_f32(v.val[0]);
+                v.val[1] = vrndnq_f32(v.val[1]);
+            }
+            neonStore(pOut + x, v);
+        }
+        for( ; x < n; x++ )
+            pOut[x] = clampPixel<T, float>(pNum[x]);
+    }
+
+    template <class T>
+    static void filterStoreIgnore(const float *pNum, const float *pDen,
+            T typeIgnore, npy_intp n, T *pOut)
+    {
+        float32x4_t vign = vdupq_n_f32((float)typeIgnore);
+        float32x4_t vhalf = vdupq_n_f32(0.5f);
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+        {
+            float32x4x2_t v;
+            for( int h = 0; h < 2; h++ )
+            {
+                float32x4_t den = vld1q_f32(pDen + x + h * 4);
+                float32x4_t val = vdivq_f32(vld1q_f32(pNum + x + h * 4), den);
+                if( std::is_integral<T>::value )
+                    val = vrndnq_f32(val);
+                v.val[h] = vbslq_f32(vcgeq_f32(den, vhalf), val, vign);
+            }
+            neonStore(pOut + x, v);
+        }
+        for( ; x < n; x++ )
+        {
+            if( pDen[x] >= 0.5f )
+                pOut[x] = clampPixel<T, float>(pNum[x] / pDen[x]);
+            else
+                pOut[x] = typeIgnore;
+        }
+    }
+    // fixed point, see FixedScalarOps. 8 pixels at a time.
+    static void fixedVertical(const npy_uint8 *pRowL, const npy_uint8 *pRowU, 
+            npy_uint32 wl, npy_uint32 wu, bool bHaveIgnore, npy_uint8 typeIgnore,
+            npy_intp n, npy_uint16 *pTmp)
+    {
+        uint8x8_t vign = vdup_n_u8(typeIgnore);
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+        {
+            uint8x8_t l = vld1_u8(pRowL + x);
+            uint8x8_t u = vld1_u8(pRowU + x);
+            uint16x8_t v = vmlaq_n_u16(vmulq_n_u16(vmovl_u8(l), (npy_uint16)wl), 
+                vmovl_u8(u), (npy_uint16)wu);
+            if( bHaveIgnore )
+            {
+                // all ones where either is ignored
+                uint8x8_t m = vorr_u8(vceq_u8(l, vign), vceq_u8(u, vign));
+                v = vorrq_u16(v, vreinterpretq_u16_s16(vmovl_s8(vreinterpret_s8_u8(m))));
+            }
+            vst1q_u16(pTmp + x, v);
+        }
+        for( ; x < n; x++ )
+            pTmp[x] = fixedVerticalPixel<npy_uint8>(pRowL[x], pRowU[x], wl, wu, 
+                bHaveIgnore, typeIgnore);
+    }
+
+    static void fixedVertical(const npy_uint16 *pRowL, const npy_uint16 *pRowU, 
+            npy_uint32 wl, npy_uint32 wu, bool bHaveIgnore, npy_uint16 typeIgnore,
+            npy_intp n, npy_uint32 *pTmp)
+    {
+        uint16x8_t vign = vdupq_n_u16(typeIgnore);
+        npy_intp x = 0;
+        for( ; x + 8 <= n; x += 8 )
+        {
+            uint16x8_t l = vld1q_u16(pRowL + x);
+            uint16x8_t u = vld1q_u16(pRowU + x);
+            uint32x4_t lo = vmlal_n_u16(vmull_n_u16(vget_low_u16(l), wl), 
+                vget_low_u16(u), wu);
+            uint32x4_t hi = vmlal_n_u16(vmull_n_u16(vget_high_u16(l), wl), 
+                vget_high_u16(u), wu);
+            if( bHaveIgnore )
+            {
+                int16x8_t m = vreinterpretq_s16_u16(vorrq_u16(vceqq_u16(l, vign), 
+                    vceqq_u16(u, vign)));
+                lo = vorrq_u32(lo, vreinterpretq_u32_s32(vmovl_s16(vget_low_s16(m))));
+                hi = vorrq_u32(hi, vreinterpretq_u32_s32(vmovl_s16(vget_high_s16(m))));
+            }
+            vst1q_u32(pTmp + x, lo);
+            vst1q_u32(pTmp + x + 4, hi);
+        }
+        for( ; x < n; x++ )
+            pTmp[x] = fixedVerticalPixel<npy_uint16>(pRowL[x], pRowU[x], wl, wu, 
+                bHaveIgnore, typeIgnore);
+    }
+
+    // no gather instruction so load the lanes individually
+    template <class Tmp>
+    static uint32x4_t fixedGather(const Tmp *p, const int *pIdx)
+    {
+        uint32x4_t v = vdupq_n_u32(p[pIdx[0]]);
+        v = vsetq_lane_u32(p[pIdx[1]], v, 1);
+        v = vsetq_lane_u32(p[pIdx[2]], v, 2);
+        v = vsetq_lane_u32(p[pIdx[3]], v, 3);
+        return v;
+    }
+
+    // 8 output pixels narrowed to 16 bits. 32 bit sums for uint8
+    static uint16x8_t fixedBlend(const npy_uint16 *pTmp, 
+            const FixedBilinearTable &cols, npy_intp co)
+    {
+        const int nShift = FixedPoint<npy_uint8>::nOutShift;
+        uint32x4_t r[2];
+        for( int h = 0; h < 2; h++ )
+        {
+            npy_intp c = co + h * 4;
+            uint32x4_t a = fixedGather(pTmp, cols.lower.data() + c);
+            uint32x4_t b = fixedGather(pTmp, cols.upper.data() + c);
+            uint32x4_t v = vmlaq_u32(vmulq_u32(a, vld1q_u32(cols.lowerWeight.data() + c)),
+                b, vld1q_u32(cols.upperWeight.data() + c));
+            r[h] = vrshrq_n_u32(v, nShift);
+        }
+        return vcombine_u16(vmovn_u32(r[0]), vmovn_u32(r[1]));
+    }
+
+    // and 64 bit for uint16
+    static uint16x8_t fixedBlend(const npy_uint32 *pTmp, 
+            const FixedBilinearTable &cols, npy_intp co)
+    {
+        const int nShift = FixedPoint<npy_uint16>::nOutShift;
+        uint32x2_t r[4];
+        for( int h = 0; h < 4; h++ )
+        {
+            npy_intp c = co + h * 2;
+            uint32x2_t a = vdup_n_u32(pTmp[cols.lower[c]]);
+            a = vset_lane_u32(pTmp[cols.lower[c + 1]], a, 1);
+            uint32x2_t b = vdup_n_u32(pTmp[cols.upper[c]]);
+            b = vset_lane_u32(pTmp[cols.upper[c + 1]], b, 1);
+            uint64x2_t v = vmlal_u32(vmull_u32(a, vld1_u32(cols.lowerWeight.data() + c)),
+                b, vld1_u32(cols.upperWeight.data() + c));
+            r[h] = vmovn_u64(vrshrq_n_u64(v, nShift));
+        }
+        return vcombine_u16(vmovn_u32(vcombine_u32(r[0], r[1])), 
+            vmovn_u32(vcombine_u32(r[2], r[3])));
+    }
+
+    static void fixedHorizontal(const npy_uint16 *pTmp, 
+            const FixedBilinearTable &cols, npy_uint8 *pOut)
+    {
+        npy_intp n = cols.lower.size();
+        npy_intp co = 0;
+        for( ; co + 8 <= n; co += 8 )
+            vst1_u8(pOut + co, vmovn_u16(fixedBlend(pTmp, cols, co)));
+        for( ; co < n; co++ )
+            pOut[co] = fixedHorizontalPixel<npy_uint8>(pTmp[cols.lower[co]], 
+                pTmp[cols.upper[co]], cols.lowerWeight[co], cols.upperWeight[co]);
+    }
+
+    static void fixedHorizontal(const npy_uint32 *pTmp, 
+            const FixedBilinearTable &cols, npy_uint16 *pOut)
+    {
+        npy_intp n = cols.lower.size();
+        npy_intp co = 0;
+        for( ; co + 8 <= n; co += 8 )
+            vst1q_u16(pOut + co, fixedBlend(pTmp, cols, co));
+        for( ; co < n; co++ )
+            pOut[co] = fixedHorizontalPixel<npy_uint16>(pTmp[cols.lower[co]], 
+                pTmp[cols.upper[co]], cols.lowerWeight[co], cols.upperWeight[co]);
+    }
+};
+#endif
+
+template <class T, class Ops>
+void doBilinearVector(const ImagePlane &in, const ImagePlane &out, 
+        const BilinearTable &rows, const BilinearTable &cols, 
+        bool bHaveIgnore, double dIgnore, npy_intp nRowStart, npy_intp nRowEnd)
+{
+    npy_intp nInXSize = in.nXSize;
+    T typeIgnore = dIgnore;
+
+    // temporary row(s) of vertically interpolated values
+    std::vector<float> num(nInXSize);
+    std::vector<float> den(bHaveIgnore ? nInXSize : 0);
+
+    // only the input columns used by the output window need to be
+    // interpolated. The table is in increasing order.
+    npy_intp nXMin = cols.lower.front();
+    npy_intp nXCount = cols.upper.back() - nXMin + 1;
+
+    for (npy_intp ro = nRowStart; ro < nRowEnd; ro++) {
+        const T *pRowL = in.row<T>(rows.lower[ro]);
+        const T *pRowU = in.row<T>(rows.upper[ro]);
+        T *pOut = out.row<T>(ro);
+
+        if( bHaveIgnore )
+        {
+            Ops::verticalIgnore(pRowL + nXMin, pRowU + nXMin, rows.lowerWeight[ro], 
+                rows.upperWeight[ro], typeIgnore, nXCount, num.data() + nXMin, 
+                den.data() + nXMin);
+            Ops::horizontalIgnore(num.data(), den.data(), cols, typeIgnore, pOut);
+        }
+        else
+        {
+            Ops::vertical(pRowL + nXMin, pRowU + nXMin, rows.lowerWeight[ro], 
+                rows.upperWeight[ro], nXCount, num.data() + nXMin);
+            Ops::horizontal(num.data(), cols, pOut);
+        }
+    }
+}
+
+// For the types that have a vectorised kernel
+// (npy_uint8, npy_uint16, npy_int16 and npy_float32). Falls back to
+// doBilinear if the instruction set isn't available.
+template <class T>
+void doBilinearDispatch(const ResampleBands &bands, const OutputWindow &window, 
+        int nThreads)
+{
+#if defined(RESAMPLER_HAVE_NEON) || defined(RESAMPLER_HAVE_AVX2)
+    if( !haveSIMD() )
+    {
+        doBilinear <T> (bands, window, nThreads);
+        return;
+    }
+    BilinearTable rows, cols;
+    calcBilinearTables(bands, window, rows, cols);
+
+    runForBandRows(bands.inputs.size(), bands.outputs[0].nYSize, nThreads, 
+        [&](npy_intp nBand, npy_intp nRowStart, npy_intp nRowEnd)
+        {
+            const ImagePlane &in = bands.inputs[nBand];
+            const BandIgnore ignore = effectiveIgnore<T>(bands.ignores[nBand]);
+            forOutputRows<T>(bands.outputs[nBand], nRowStart, nRowEnd,
+                [&](const ImagePlane &out, npy_intp nStart, npy_intp nEnd)
+                {
+                    // the vectorised kernels compare with the ignore value
+                    if( ignore.bHave && std::isnan(ignore.dValue) )
+                    {
+                        doBilinearHaveIgnore <T> (in, out, rows, cols, 
+                            ignore, nStart, nEnd);
+                        return;
+                    }
+  #if defined(RESAMPLER_HAVE_NEON)
+                    doBilinearVector <T, NEONOps> (in, out, rows, cols, 
+                        ignore.bHave, ignore.dValue, nStart, nEnd);
+  #else
+                    doBilinearVector <T, AVX2Ops> (in, out, rows, cols, 
+                        ignore.bHave, ignore.dValue, nStart, nEnd);
+  #endif
+                });
+        });
+#else
+    doBilinear <T> (bands, window, nThreads);
+#endif
+}
+
+/* Cubic and lanczos. First the input rows needed are filtered */
+/* horizontally into temporary rows of the output width, then each */
+/* output row is the weighted sum of those under it (contiguous, so */
+/* vectorises well). When zoomed in this filters each input row once */
+/* rather than once per output row. Ops is for the instruction set */
+/* and Acc (float or double) the type of the sums. With an ignore */
+/* value the weights of the valid pixels are summed as well, and the */
+/* output is their weighted average if at least half the weight is */
+/* valid (otherwise the ignore value). */
+template <class T, class Acc, class Ops>
+void doFilterRows(const ImagePlane &in, const ImagePlane &out, 
+        const FilterTable &rows, const FilterTable &cols, 
+        bool bHaveIgnore, double dIgnore, npy_intp nRowStart, npy_intp nRowEnd)
+{
+    const BandIgnore bandIgnore = {bHaveIgnore, dIgnore};
+    const IgnoreTest<T> ignore(bandIgnore);
+    npy_intp nOutXSize = out.nXSize;
+
+    // only the input columns and rows used by these output rows are 
+    // read. The starts are in increasing order.
+    npy_intp nXMin = cols.start.front();
+    npy_intp nXCount = cols.start.back() + cols.nTaps - nXMin;
+    npy_intp nYMin = rows.start[nRowStart];
+    npy_intp nYCount = rows.start[nRowEnd - 1] + rows.nTaps - nYMin;
+
+    std::vector<Acc> load(in.nXSize), loadDen(bHaveIgnore ? in.nXSize : 0);
+    std::vector<Acc> hNum(nYCount * nOutXSize);
+    std::vector<Acc> hDen(bHaveIgnore ? nYCount * nOutXSize : 0);
+    for (npy_intp y = 0; y < nYCount; y++) {
+        const T *pRow = in.row<T>(nYMin + y) + nXMin;
+        if( bHaveIgnore )
+        {
+            Ops::filterLoadIgnore(pRow, ignore, nXCount, load.data() + nXMin,
+                loadDen.data() + nXMin);
+            Ops::filterHorizontal(load.data(), cols, &hNum[y * nOutXSize]);
+            Ops::filterHorizontal(loadDen.data(), cols, &hDen[y * nOutXSize]);
+        }
+        else
+        {
+            Ops::filterLoad(pRow, nXCount, load.data() + nXMin);
+            Ops::filterHorizontal(load.data(), cols, &hNum[y * nOutXSize]);
+        }
+    }
+
+    std::vector<Acc> num(nOutXSize), den(bHaveIgnore ? nOutXSize : 0);
+    for (npy_intp ro = nRowStart; ro < nRowEnd; ro++) {
+        std::fill(num.begin(), num.end(), (Acc)0);
+        std::fill(den.begin(), den.end(), (Acc)0);
+        for (int k = 0; k < rows.nTaps; k++) {
+            Acc w = rows.weight(k)[ro];
+            if( w == 0 )
+                continue;
+            npy_intp y = rows.start[ro] + k - nYMin;
+            Ops::filterAccumulate(&hNum[y * nOutXSize], w, nOutXSize, num.data());
+            if( bHaveIgnore )
+                Ops::filterAccumulate(&hDen[y * nOutXSize], w, nOutXSize, 
+                    den.data());
+        }
+
+        T *pOut = out.row<T>(ro);
+        if( bHaveIgnore )
+            Ops::filterStoreIgnore(num.data(), den.data(), ignore.value, 
+                nOutXSize, pOut);
+        else
+            Ops::filterStore(num.data(), nOutXSize, pOut);
+    }
+}
+
+template <class T, class Acc, class Ops>
+void doFilterWith(const ResampleBands &bands, const OutputWindow &window, 
+        int nThreads, int nKernel)
+{
+    std::shared_ptr<const FilterTable> rows = getFilterTable(nKernel, 
+        bands.inputs[0].nYSize, window.nFullYSize, window.nYOff, 
+        bands.outputs[0].nYSize);
+    std::shared_ptr<const FilterTable> cols = getFilterTable(nKernel, 
+        bands.inputs[0].nXSize, window.nFullXSize, window.nXOff, 
+        bands.outputs[0].nXSize);
+
+    runForBandRows(bands.inputs.size(), bands.outputs[0].nYSize, nThreads, 
+        [&](npy_intp nBand, npy_intp nRowStart, npy_intp nRowEnd)
+        {
+            const ImagePlane &in = bands.inputs[nBand];
+            const BandIgnore ignore = effectiveIgnore<T>(bands.ignores[nBand]);
+            forOutputRows<T>(bands.outputs[nBand], nRowStart, nRowEnd,
+                [&](const ImagePlane &out, npy_intp nStart, npy_intp nEnd)
+                {
+                    doFilterRows <T, Acc, Ops> (in, out, *rows, *cols, 
+                        ignore.bHave, ignore.dValue, nStart, nEnd);
+                });
+        });
+}
+
+// For the types without a vectorised kernel. Acc is float for 8 bit
+// types and double for the 32 and 64 bit ones.
+template <class T, class Acc, int nKernel>
+void doFilter(const ResampleBands &bands, const OutputWindow &window, 
+        int nThreads)
+{
+    doFilterWith <T, Acc, ScalarFilterOps> (bands, window, nThreads, nKernel);
+}
+
+// As doBilinearDispatch(), for npy_uint8, npy_uint16, npy_int16 and
+// npy_float32
+template <class T, int nKernel>
+void doFilterDispatch(const ResampleBands &bands, const OutputWindow &window, 
+        int nThreads)
+{
+    if( haveSIMD() )
+    {
+#if defined(RESAMPLER_HAVE_NEON)
+        doFilterWith <T, float, NEONOps> (bands, window, nThreads, nKernel);
+        return;
+#elif defined(RESAMPLER_HAVE_AVX2)
+        doFilterWith <T, float, AVX2Ops> (bands, window, nThreads, nKernel);
+        return;
+#endif
+    }
+    doFilterWith <T, float, ScalarFilterOps> (bands, window, nThreads, nKernel);
+}
+
+template <class T, class Ops>
+void doFixedBilinearRows(const ImagePlane &in, const ImagePlane &out, 
+        const FixedBilinearTable &rows, const FixedBilinearTable &cols, 
+        bool bHaveIgnore, double dIgnore, npy_intp nRowStart, npy_intp nRowEnd)
+{
+    typedef typename FixedPoint<T>::Tmp Tmp;
+    T typeIgnore = bHaveIgnore ? (T)dIgnore : 0;
+    npy_intp nOutXSize = out.nXSize;
+
+    // only the input columns used by the output window need to be
+    // blended. One extra on the end for fixedHorizontal().
+    std::vector<Tmp> tmp(in.nXSize + 1);
+    npy_intp nXMin = cols.lower.front();
+    npy_intp nXCount = cols.upper.back() - nXMin + 1;
+
+    for (npy_intp ro = nRowStart; ro < nRowEnd; ro++) {
+        const T *pRowL = in.row<T>(rows.lower[ro]);
+        const T *pRowU = in.row<T>(rows.upper[ro]);
+        T *pOut = out.row<T>(ro);
+
+        Ops::fixedVertical(pRowL + nXMin, pRowU + nXMin, rows.lowerWeight[ro],
+            rows.upperWeight[ro], bHaveIgnore, typeIgnore, nXCount, 
+            tmp.data() + nXMin);
+        Ops::fixedHorizontal(tmp.data(), cols, pOut);
+
+        if( bHaveIgnore )
+        {
+            for (npy_intp co = 0; co < nOutXSize; co++) {
+                int cl = cols.lower[co];
+                int cu = cols.upper[co];
+                if( tmp[cl] == FixedPoint<T>::nInvalid || 
+                        tmp[cu] == FixedPoint<T>::nInvalid )
+                    pOut[co] = fixedBilinearPartial<T>(pRowL, pRowU, cl, cu, 
+                        rows.lowerWeight[ro], rows.upperWeight[ro],
+                        cols.lowerWeight[co], cols.upperWeight[co], typeIgnore);
+            }
+        }
+    }
+}
+
+// Bilinear for npy_uint8 and npy_uint16 using fixed point. Unlike the
+// float kernels the result is rounded rather than truncated. Uses the
+// vectorised versions when the instruction set is available.
+template <class T>
+void doFixedBilinear(const ResampleBands &bands, const OutputWindow &window, 
+        int nThreads)
+{
+    FixedBilinearTable rows, cols;
+    calcFixedBilinearTable(bands.inputs[0].nYSize, window.nFullYSize, 
+        window.nYOff, bands.outputs[0].nYSize, FixedPoint<T>::nRowBits, rows);
+    calcFixedBilinearTable(bands.inputs[0].nXSize, window.nFullXSize, 
+        window.nXOff, bands.outputs[0].nXSize, FixedPoint<T>::nColBits, cols);
+    bool bSIMD = haveSIMD();
+
+    runForBandRows(bands.inputs.size(), bands.outputs[0].nYSize, nThreads, 
+        [&](npy_intp nBand, npy_intp nRowStart, npy_intp nRowEnd)
+        {
+            const ImagePlane &in = bands.inputs[nBand];
+            const BandIgnore ignore = effectiveIgnore<T>(bands.ignores[nBand]);
+            forOutputRows<T>(bands.outputs[nBand], nRowStart, nRowEnd,
+                [&](const ImagePlane &out, npy_intp nStart, npy_intp nEnd)
+                {
+#if defined(RESAMPLER_HAVE_NEON)
+                    if( bSIMD )
+                    {
+                        doFixedBilinearRows <T, NEONOps> (in, out, rows, cols, 
+                            ignore.bHave, ignore.dValue, nStart, nEnd);
+                        return;
+                    }
+#elif defined(RESAMPLER_HAVE_AVX2)
+                    if( bSIMD )
+                    {
+                        doFixedBilinearRows <T, AVX2Ops> (in, out, rows, cols, 
+                            ignore.bHave, ignore.dValue, nStart, nEnd);
+                        return;
+                    }
+#endif
+                    doFixedBilinearRows <T, FixedScalarOps> (in, out, rows, 
+                        cols, ignore.bHave, ignore.dValue, nStart, nEnd);
+                });
+        });
+}
+
+// fixed point for uint8 and uint16 unless turned off
+template <class T>
+void doBilinearInteger(const ResampleBands &bands, const OutputWindow &window, 
+        int nThreads)
+{
+    if( g_bUseFixedPoint )
+        doFixedBilinear <T> (bands, window, nThreads);
+    else
+        doBilinearDispatch <T> (bands, window, nThreads);
+}
+
+static PyObject *resampler_simd(PyObject *self, PyObject *args)
+{
+    if( !haveSIMD() )
+        return PyUnicode_FromString("none");
+#if defined(RESAMPLER_HAVE_NEON)
+    return PyUnicode_FromString("neon");
+#else
+    return PyUnicode_FromString("avx2");
+#endif
+}
+
+// Whether this CPU has the instructions resampler_tuned is built to 
+// use. Must match the flags in setup.py.
+static bool cpuSupportsTuned()
+{
+#if defined(__aarch64__) && defined(__linux__)
+    // -mcpu=neoverse-n1 (Graviton2) is Armv8.2 with dot product
+    const unsigned long nNeed = HWCAP_ATOMICS | HWCAP_FPHP | HWCAP_ASIMDHP |
+        HWCAP_ASIMDRDM | HWCAP_LRCPC | HWCAP_DCPOP | HWCAP_ASIMDDP;
+    return (getauxval(AT_HWCAP) & nNeed) == nNeed;
+#elif defined(__aarch64__)
+    return true;
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+        __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2");
+#else
+    return false;
+#endif
+}
+
+static PyObject *resampler_tuned_supported(PyObject *self, PyObject *args)
+{
+    if( cpuSupportsTuned() )
+        Py_RETURN_TRUE;
+    Py_RETURN_FALSE;
+}
+
+// Sets a flag from a bool and returns the previous value
+static PyObject *setFlag(PyObject *pEnable, bool &bFlag)
+{
+    int nEnable = PyObject_IsTrue(pEnable);
+    if( nEnable < 0 )
+        return NULL;
+    bool bOld = bFlag;
+    bFlag = nEnable != 0;
+    return PyBool_FromLong(bOld);
+}
+
+static PyObject *resampler_use_simd(PyObject *self, PyObject *args)
+{
+    PyObject *pEnable;
+    if( !PyArg_ParseTuple(args, "O:use_simd", &pEnable) )
+        return NULL;
+    return setFlag(pEnable, g_bUseSIMD);
+}
+
+static PyObject *resampler_use_fixed_point(PyObject *self, PyObject *args)
+{
+    PyObject *pEnable;
+    if( !PyArg_ParseTuple(args, "O:use_fixed_point", &pEnable) )
+        return NULL;
+    return setFlag(pEnable, g_bUseFixedPoint);
+}
+
+static PyObject *resampler_start_timing(PyObject *self, PyObject *args)
+{
+    try
+    {
+        t_pTimes.reset(new KernelTimes());
+    }
+    catch(std::bad_alloc &)
+    {
+        return PyErr_NoMemory();
+    }
+    t_pTimes->nCalls = 0;
+    t_pTimes->nPixels = 0;
+    t_pTimes->dWall = 0.0;
+    t_pTimes->nCPUNanos = 0;
+    Py_RETURN_NONE;
+}
+
+static PyObject *resampler_stop_timing(PyObject *self, PyObject *args)
+{
+    npy_int64 nCalls = 0, nPixels = 0, nCPUNanos = 0;
+    double dWall = 0.0;
+    if( t_pTimes )
+    {
+        nCalls = t_pTimes->nCalls;
+        nPixels = t_pTimes->nPixels;
+        dWall = t_pTimes->dWall;
+        nCPUNanos = t_pTimes->nCPUNanos;
+        t_pTimes.reset();
+    }
+    return Py_BuildValue("{s:L,s:L,s:d,s:d}", "calls", (long long)nCalls, 
+        "pixels", (long long)nPixels, "wall", dWall, "cpu", nCPUNanos * 1e-9);
+}
+
+/* Nearest neighbour. Output pixel o (in the full output) takes input */
+/* pixel trunc(o * nInSize / nFullOutSize), which is the same as */
+/* replicateArray() used to in resamplerhelper.py (from TuiView) */
+static void calcNearestTable(npy_intp nInSize, npy_intp nFullOutSize, 
+        npy_intp nOutOffset, npy_intp nOutSize, std::vector<npy_intp> &table)
+{
+    table.resize(nOutSize);
+    double scale = (double)nInSize / (double)nFullOutSize;
+    for (npy_intp o = 0; o < nOutSize; o++) {
+        npy_intp i = (npy_intp)((o + nOutOffset) * scale);
+        if (i >= nInSize) i = nInSize - 1;
+        table[o] = i;
+    }
+}
+
+// T is just used for its size - the values are only copied
+template <class T>
+void doNearest(const ResampleBands &bands, const OutputWindow &window, 
+        int nThreads)
+{
+    std::vector<npy_intp> rows, cols;
+    calcNearestTable(bands.inputs[0].nYSize, window.nFullYSize, window.nYOff,
+        bands.outputs[0].nYSize, rows);
+    calcNearestTable(bands.inputs[0].nXSize, window.nFullXSize, window.nXOff,
+        bands.outputs[0].nXSize, cols);
+    npy_intp nOutXSize = bands.outputs[0].nXSize;
+    const npy_intp *pCols = cols.data();
+
+    runForBandRows(bands.inputs.size(), bands.outputs[0].nYSize, nThreads, 
+        [&](npy_intp nBand, npy_intp nRowStart, npy_intp nRowEnd)
+        {
+            const ImagePlane &in = bands.inputs[nBand];
+            forOutputRows<T>(bands.outputs[nBand], nRowStart, nRowEnd,
+                [&](const ImagePlane &out, npy_intp nStart, npy_intp nEnd)
+                {
+                    for (npy_intp ro = nStart; ro < nEnd; ro++) {
+                        T *pOut = out.row<T>(ro);
+                        if( ro > nStart && rows[ro] == rows[ro - 1] )
+                        {
+                            // when zoomed in, most rows are the same as the previous
+                            memcpy(pOut, out.row<T>(ro - 1), nOutXSize * sizeof(T));
+                        }
+                        else
+                        {
+                            const T *pIn = in.row<T>(rows[ro]);
+                            for (npy_intp co = 0; co < nOutXSize; co++)
+                                pOut[co] = pIn[pCols[co]];
+                        }
+                    }
+                });
+        });
+}
+
+typedef void (*ResampleFunc)(const ResampleBands&, const OutputWindow&, int);
+
+// 16 bytes to copy for complex128 (and long double) with doNearest
+struct NearestPixel16
+{
+    npy_uint64 data[2];
+};
+
+// returns the kernel to use for the dtype of pArray or NULL if not 
+// supported. Only numbers, as other types (eg object) can't just be 
+// copied without the GIL.
+static ResampleFunc getNearestFunc(PyArrayObject *pArray)
+{
+    int arrayType = PyArray_TYPE(pArray);
+    if( PyDataType_REFCHK(PyArray_DESCR(pArray)) || 
+            !(PyTypeNum_ISNUMBER(arrayType) || PyTypeNum_ISBOOL(arrayType)) )
+        return NULL;
+
+    switch(PyArray_ITEMSIZE(pArray))
+    {
+        case 1:
+            return doNearest <npy_uint8>;
+        case 2:
+            return doNearest <npy_uint16>;
+        case 4:
+            return doNearest <npy_uint32>;
+        case 8:
+            return doNearest <npy_uint64>;
+        case 16:
+            return doNearest <NearestPixel16>;
+        default:
+            return NULL;
+    }
+}
+
+// returns the kernel to use for the given type or NULL if not supported
+static ResampleFunc getBilinearFunc(int arrayType)
+{
+    switch(arrayType)
+    {
+        case NPY_INT8:
+            return doBilinear <npy_int8>;
+        case NPY_UINT8:
+            return doBilinearInteger <npy_uint8>;
+        case NPY_INT16:
+            return doBilinearDispatch <npy_int16>;
+        case NPY_UINT16:
+            return doBilinearInteger <npy_uint16>;
+        case NPY_INT32:
+            return doBilinear <npy_int32>;
+        case NPY_UINT32:
+            return doBilinear <npy_uint32>;
+        case NPY_INT64:
+            return doBilinear <npy_int64>;
+        case NPY_UINT64:
+            return doBilinear <npy_uint64>;
+        case NPY_FLOAT16:
+            return doBilinear <npy_float16>;
+        case NPY_FLOAT32:
+            return doBilinearDispatch <npy_float32>;
+        case NPY_FLOAT64:
+            return doBilinear <npy_float64>;
+        default:
+            return NULL;
+    }
+}
+
+/* Lookup table for one axis of the area based kernels (average */
+/* and mode). Output pixel o covers count[o] input pixels from */
+/* start[o], each of which contributes the fraction of it that is */
+/* covered, stored from weights[first[o]]. */
+struct AreaTable
+{
+    std::vector<npy_intp> start;
+    std::vector<npy_intp> count;
+    std::vector<npy_intp> first;
+    std::vector<double> weights;
+};
+
+// table for output pixels nOutOffset to nOutOffset + nOutSize of an
+// output that is nFullOutSize in total
+static void calcAreaTable(npy_intp nInSize, npy_intp nFullOutSize, 
+        npy_intp nOutOffset, npy_intp nOutSize, AreaTable &table)
+{
+    table.start.resize(nOutSize);
+    table.count.resize(nOutSize);
+    table.first.resize(nOutSize);
+    table.weights.clear();
+
+    double scale = (double)nInSize / (double)nFullOutSize;
+    for (npy_intp o = 0; o < nOutSize; o++) {
+        // the edges of the output pixel in input pixels
+        double dStart = (o + nOutOffset) * scale;
+        double dEnd = (o + nOutOffset + 1) * scale;
+        npy_intp nStart = std::min((npy_intp)dStart, nInSize - 1);
+        npy_intp nEnd = std::min((npy_intp)std::ceil(dEnd), nInSize);
+        if (nEnd <= nStart) nEnd = nStart + 1;
+
+        table.start[o] = nStart;
+        table.count[o] = nEnd - nStart;
+        table.first[o] = table.weights.size();
+        for (npy_intp i = nStart; i < nEnd; i++) {
+            double w = std::min(dEnd, (double)(i + 1)) - 
+                std::max(dStart, (double)i);
+            // only from rounding at the edge
+            if (!(w > 0)) w = 1e-6;
+            table.weights.push_back(w);
+        }
+    }
+}
+
+template <class T>
+inline T roundPixel(double dVal)
+{
+    if( std::is_integral<T>::value )
+        return (T)std::floor(dVal + 0.5);
+    else
+        return (T)dVal;
+}
+
+// The output of average and mode where none of the input pixels 
+// counted: the ignore value, or NaN if it was all NaN and there isn't one
+// (integers always have a value unless there's an ignore value)
+template <class T>
+inline T noValuePixel(const IgnoreTest<T> &ignore)
+{
+    if( ignore.bHave || !std::numeric_limits<T>::has_quiet_NaN )
+        return ignore.value;
+    return std::numeric_limits<T>::quiet_NaN();
+}
+
+/* Area weighted average. Each output pixel is the average of the */
+/* input pixels it covers, weighted by how much of each is covered */
+/* and leaving out those that are the ignore value. Stops the */
+/* aliasing of nearest neighbour when zoomed out.  */
+template <class T>
+void doAverage(const ResampleBands &bands, const OutputWindow &window, 
+        int nThreads)
+{
+    AreaTable rows, cols;
+    calcAreaTable(bands.inputs[0].nYSize, window.nFullYSize, window.nYOff,
+        bands.outputs[0].nYSize, rows);
+    calcAreaTable(bands.inputs[0].nXSize, window.nFullXSize, window.nXOff,
+        bands.outputs[0].nXSize, cols);
+    npy_intp nOutXSize = bands.outputs[0].nXSize;
+
+    runForBandRows(bands.inputs.size(), bands.outputs[0].nYSize, nThreads, 
+        [&](npy_intp nBand, npy_intp nRowStart, npy_intp nRowEnd)
+        {
+            const ImagePlane &in = bands.inputs[nBand];
+            IgnoreTest<T> ignore(bands.ignores[nBand]);
+            std::vector<double> sums(nOutXSize), totals(nOutXSize);
+
+            forOutputRows<T>(bands.outputs[nBand], nRowStart, nRowEnd,
+                [&](const ImagePlane &out, npy_intp nStart, npy_intp nEnd)
+                {
+                    for (npy_intp ro = nStart; ro < nEnd; ro++) {
+                        std::fill(sums.begin(), sums.end(), 0.0);
+                        std::fill(totals.begin(), totals.end(), 0.0);
+
+                        // go down the input rows so they are read in order
+                        for (npy_intp k = 0; k < rows.count[ro]; k++) {
+                            const T *pIn = in.row<T>(rows.start[ro] + k);
+                            double rw = rows.weights[rows.first[ro] + k];
+                            for (npy_intp co = 0; co < nOutXSize; co++) {
+                                const T *pCol = pIn + cols.start[co];
+                                const double *pWeight = 
+                                    &cols.weights[cols.first[co]];
+                                double dSum = 0, dTotal = 0;
+                                for (npy_intp j = 0; j < cols.count[co]; j++) {
+                                    // NaN is never averaged in
+                                    if (ignore(pCol[j]) || pCol[j] != pCol[j])
+                                        continue;
+                                    dSum += pWeight[j] * pCol[j];
+                                    dTotal += pWeight[j];
+                                }
+                                sums[co] += rw * dSum;
+                                totals[co] += rw * dTotal;
+                            }
+                        }
+
+                        T *pOut = out.row<T>(ro);
+                        for (npy_intp co = 0; co < nOutXSize; co++) {
+                            if (totals[co] > 0)
+                                pOut[co] = roundPixel<T>(sums[co] / totals[co]);
+                            else
+                                pOut[co] = noValuePixel(ignore);
+                        }
+                    }
+                });
+        });
+}
+
+/* Area weighted mode (majority) for thematic data. Each output pixel */
+/* is the value covering most of it, leaving out the ignore value. */
+/* Ties go to the smallest value. */
+template <class T>
+void doMode(const ResampleBands &bands, const OutputWindow &window, 
+        int nThreads)
+{
+    AreaTable rows, cols;
+    calcAreaTable(bands.inputs[0].nYSize, window.nFullYSize, window.nYOff,
+        bands.outputs[0].nYSize, rows);
+    calcAreaTable(bands.inputs[0].nXSize, window.nFullXSize, window.nXOff,
+        bands.outputs[0].nXSize, cols);
+    npy_intp nOutXSize = bands.outputs[0].nXSize;
+
+    runForBandRows(bands.inputs.size(), bands.outputs[0].nYSize, nThreads, 
+        [&](npy_intp nBand, npy_intp nRowStart, npy_intp nRowEnd)
+        {
+            const ImagePlane &in = bands.inputs[nBand];
+            IgnoreTest<T> ignore(bands.ignores[nBand]);
+            std::vector<std::pair<T, double> > votes;
+
+            forOutputRows<T>(bands.outputs[nBand], nRowStart, nRowEnd,
+                [&](const ImagePlane &out, npy_intp nStart, npy_intp nEnd)
+                {
+                    for (npy_intp ro = nStart; ro < nEnd; ro++) {
+                        T *pOut = out.row<T>(ro);
+                        for (npy_intp co = 0; co < nOutXSize; co++) {
+                            votes.clear();
+                            const double *pColWeight = 
+                                &cols.weights[cols.first[co]];
+                            for (npy_intp k = 0; k < rows.count[ro]; k++) {
+                                const T *pIn = in.row<T>(rows.start[ro] + k) +
+                                    cols.start[co];
+                                double rw = rows.weights[rows.first[ro] + k];
+                                for (npy_intp j = 0; j < cols.count[co]; j++) {
+                                    // NaN doesn't compare equal to itself
+                                    // so can't be sorted or counted
+                                    if (ignore(pIn[j]) || pIn[j] != pIn[j])
+                                        continue;
+                                    votes.push_back(std::make_pair(pIn[j], 
+                                        rw * pColWeight[j]));
+                                }
+                            }
+
+                            if (votes.empty()) {
+                                pOut[co] = noValuePixel(ignore);
+                                continue;
+                            }
+
+                            // sum the weights for each value and take 
+                            // the biggest
+                            std::sort(votes.begin(), votes.end(),
+                                [](const std::pair<T, double> &a, 
+                                    const std::pair<T, double> &b)
+                                {
+                                    return a.first < b.first;
+                                });
+                            T best = votes[0].first;
+                            double dBestWeight = -1;
+                            size_t i = 0;
+                            while (i < votes.size()) {
+                                T val = votes[i].first;
+                                double dWeight = 0;
+                                for (; i < votes.size() && 
+                                        votes[i].first == val; i++)
+                                    dWeight += votes[i].second;
+                                // allow for rounding in the weights
+                                if (dWeight > dBestWeight * (1 + 1e-9)) {
+                                    best = val;
+                                    dBestWeight = dWeight;
+                                }
+                            }
+                            pOut[co] = best;
+                        }
+                    }
+                });
+        });
+}
+
+// returns the kernel to use for the given type or NULL if not supported.
+// float16 isn't as the arithmetic (and ignore) needs a real type
+static ResampleFunc getAverageFunc(int arrayType)
+{
+    switch(arrayType)
+    {
+        case NPY_INT8:
+            return doAverage <npy_int8>;
+        case NPY_UINT8:
+            return doAverage <npy_uint8>;
+        case NPY_INT16:
+            return doAverage <npy_int16>;
+        case NPY_UINT16:
+            return doAverage <npy_uint16>;
+        case NPY_INT32:
+            return doAverage <npy_int32>;
+        case NPY_UINT32:
+            return doAverage <npy_uint32>;
+        case NPY_INT64:
+            return doAverage <npy_int64>;
+        case NPY_UINT64:
+            return doAverage <npy_uint64>;
+        case NPY_FLOAT32:
+            return doAverage <npy_float32>;
+        case NPY_FLOAT64:
+            return doAverage <npy_float64>;
+        default:
+            return NULL;
+    }
+}
+
+// as getAverageFunc()
+static ResampleFunc getModeFunc(int arrayType)
+{
+    switch(arrayType)
+    {
+        case NPY_INT8:
+            return doMode <npy_int8>;
+        case NPY_UINT8:
+            return doMode <npy_uint8>;
+        case NPY_INT16:
+            return doMode <npy_int16>;
+        case NPY_UINT16:
+            return doMode <npy_uint16>;
+        case NPY_INT32:
+            return doMode <npy_int32>;
+        case NPY_UINT32:
+            return doMode <npy_uint32>;
+        case NPY_INT64:
+            return doMode <npy_int64>;
+        case NPY_UINT64:
+            return doMode <npy_uint64>;
+        case NPY_FLOAT32:
+            return doMode <npy_float32>;
+        case NPY_FLOAT64:
+            return doMode <npy_float64>;
+        default:
+            return NULL;
+    }
+}
+
+// returns the cubic (nKernel of FILTER_CUBIC) or lanczos kernel
+// to use for the given type or NULL if not supported (float16)
+template <int nKernel>
+static ResampleFunc getFilterFunc(int arrayType)
+{
+    switch(arrayType)
+    {
+        case NPY_INT8:
+            return doFilter <npy_int8, float, nKernel>;
+        case NPY_UINT8:
+            return doFilterDispatch <npy_uint8, nKernel>;
+        case NPY_INT16:
+            return doFilterDispatch <npy_int16, nKernel>;
+        case NPY_UINT16:
+            return doFilterDispatch <npy_uint16, nKernel>;
+        case NPY_INT32:
+            return doFilter <npy_int32, double, nKernel>;
+        case NPY_UINT32:
+            return doFilter <npy_uint32, double, nKernel>;
+        case NPY_INT64:
+            return doFilter <npy_int64, double, nKernel>;
+        case NPY_UINT64:
+            return doFilter <npy_uint64, double, nKernel>;
+        case NPY_FLOAT32:
+            return doFilterDispatch <npy_float32, nKernel>;
+        case NPY_FLOAT64:
+            return doFilter <npy_float64, double, nKernel>;
+        default:
+            return NULL;
+    }
+}
+
+/* Everything needed to turn the raw data for a tile into the */
+/* final (uint8 or uint16) bands in one pass. See compose() */
+struct ComposeBands
+{
+    std::vector<ImagePlane> inputs;     // size of the data in the tile
+    std::vector<ImagePlane> outputs;    // whole tile
+    npy_intp nXOff;     // where the inputs go in the outputs
+    npy_intp nYOff;
+    std::vector<BandIgnore> nodata;     // per input band
+    // per input band. Empty if not rescaling.
+    std::vector<double> rescaleMin;
+    std::vector<double> rescaleScale;
+    // colormap - pColormap is NULL if not being used. 
+    // Has 4 rows of nColors each, same type as output
+    const char *pColormap;
+    npy_intp nColors;
+    // a colormap with a single output band writes the index into the
+    // colormap rather than the colors (for a paletted image), and
+    // nOutsideIndex outside of the data
+    bool bIndexed;
+    npy_intp nOutsideIndex;
+    bool bAlpha;    // calculate the last output band from nodata
+};
+
+// numpy compares float arrays to a nodata value in the type of the
+// array, but integers as doubles (so 255 != 255.5)
+template <class T>
+inline bool isNodata(T val, double dNodata)
+{
+    if( std::is_floating_point<T>::value )
+        return val == (T)dNodata;
+    else
+        return (double)val == dNodata;
+}
+
+// same order of operations as the numpy version:
+// (data - min).clip(min=0) * scale).clip(0, maxOut)
+template <class U>
+inline U rescalePixel(double dVal, double dMin, double dScale)
+{
+    dVal -= dMin;
+    if( !(dVal > 0) )    // also catches NaN
+        dVal = 0;
+    dVal *= dScale;
+    if( dVal > std::numeric_limits<U>::max() )
+        dVal = std::numeric_limits<U>::max();
+    return (U)dVal;
+}
+
+// index into the colormap, clipped to the colors available
+inline npy_intp colorIndex(double dVal, npy_intp nColors)
+{
+    if( !(dVal > 0) )    // also catches NaN
+        return 0;
+    else if( dVal > (double)(nColors - 1) )
+        return nColors - 1;
+    else
+        return (npy_intp)dVal;
+}
+
+template <class T, class U>
+void doCompose(const ComposeBands &bands)
+{
+    const U nMaxOut = std::numeric_limits<U>::max();
+    const npy_intp nInBands = bands.inputs.size();
+    const npy_intp nOutBands = bands.outputs.size();
+    const npy_intp nDataBands = bands.bAlpha ? nOutBands - 1 : nOutBands;
+    const npy_intp nXSize = bands.inputs[0].nXSize;
+    const npy_intp nYSize = bands.inputs[0].nYSize;
+    const npy_intp nTileXSize = bands.outputs[0].nXSize;
+    const npy_intp nTileYSize = bands.outputs[0].nYSize;
+
+    // outside the data is transparent if there is any nodata, which
+    // matches what happens around ignore values at the edge of the data
+    bool bAnyNodata = false;
+    for( npy_intp b = 0; b < nInBands; b++ )
+        bAnyNodata = bAnyNodata || bands.nodata[b].bHave;
+    const U nOutsideAlpha = bAnyNodata ? 0 : nMaxOut;
+    const U nOutside = bands.bIndexed ? (U)bands.nOutsideIndex : 0;
+
+    std::vector<unsigned char> mask(nXSize);
+    std::vector<npy_intp> colors;
+    if( bands.pColormap != NULL )
+        colors.resize(nXSize);
+
+    for( npy_intp r = 0; r < nTileYSize; r++ )
+    {
+        npy_intp ri = r - bands.nYOff;
+        if( ri < 0 || ri >= nYSize )
+        {
+            // no data on this row
+            for( npy_intp b = 0; b < nDataBands; b++ )
+            {
+                U *pOutRow = bands.outputs[b].row<U>(r);
+                std::fill(pOutRow, pOutRow + nTileXSize, nOutside);
+            }
+            if( bands.bAlpha )
+            {
+                U *pAlpha = bands.outputs[nOutBands - 1].row<U>(r);
+                std::fill(pAlpha, pAlpha + nTileXSize, nOutsideAlpha);
+            }
+            continue;
+        }
+
+        // everything is read from the inputs before any of the outputs
+        // are written so input can be a view of the output
+        if( bands.bAlpha )
+        {
+            std::fill(mask.begin(), mask.end(), 0);
+            for( npy_intp b = 0; b < nInBands; b++ )
+            {
+                if( !bands.nodata[b].bHave )
+                    continue;
+                const T *pIn = bands.inputs[b].row<T>(ri);
+                double dNodata = bands.nodata[b].dValue;
+                for( npy_intp c = 0; c < nXSize; c++ )
+                    mask[c] |= isNodata(pIn[c], dNodata);
+            }
+        }
+        if( bands.pColormap != NULL )
+        {
+            const T *pIn = bands.inputs[0].row<T>(ri);
+            for( npy_intp c = 0; c < nXSize; c++ )
+                colors[c] = colorIndex((double)pIn[c], bands.nColors);
+        }
+
+        for( npy_intp b = 0; b < nDataBands; b++ )
+        {
+            U *pOutRow = bands.outputs[b].row<U>(r);
+            U *pOut = pOutRow + bands.nXOff;
+            std::fill(pOutRow, pOut, nOutside);
+            std::fill(pOut + nXSize, pOutRow + nTileXSize, nOutside);
+
+            if( bands.bIndexed )
+            {
+                for( npy_intp c = 0; c < nXSize; c++ )
+                    pOut[c] = (U)colors[c];
+            }
+            else if( bands.pColormap != NULL )
+            {
+                const U *pColors = (const U*)bands.pColormap + b * bands.nColors;
+                for( npy_intp c = 0; c < nXSize; c++ )
+                    pOut[c] = pColors[colors[c]];
+            }
+            else if( !bands.rescaleMin.empty() )
+            {
+                const T *pIn = bands.inputs[b].row<T>(ri);
+                const double dMin = bands.rescaleMin[b];
+                const double dScale = bands.rescaleScale[b];
+                for( npy_intp c = 0; c < nXSize; c++ )
+                    pOut[c] = rescalePixel<U>((double)pIn[c], dMin, dScale);
+            }
+            else
+            {
+                const T *pIn = bands.inputs[b].row<T>(ri);
+                if( (const void*)pIn != (const void*)pOut )
+                {
+                    for( npy_intp c = 0; c < nXSize; c++ )
+                        pOut[c] = (U)pIn[c];
+                }
+                // else already read in place
+            }
+        }
+
+        if( bands.bAlpha )
+        {
+            U *pOutRow = bands.outputs[nOutBands - 1].row<U>(r);
+            U *pOut = pOutRow + bands.nXOff;
+            std::fill(pOutRow, pOut, nOutsideAlpha);
+            std::fill(pOut + nXSize, pOutRow + nTileXSize, nOutsideAlpha);
+            for( npy_intp c = 0; c < nXSize; c++ )
+                pOut[c] = mask[c] ? 0 : nMaxOut;
+        }
+    }
+}
+
+/* State kept between the inputs of a mosaic. For each pixel of the */
+/* tile, filled has a bit set for each (data) band that has been */
+/* written. Pixels are complete when all the bits are set, after */
+/* which later inputs are skipped. */
+struct MosaicState
+{
+    unsigned char *pFilled;     // tile sized, row major
+    unsigned char nAllFilled;
+    npy_intp nRemaining;        // pixels not yet complete
+};
+
+// Paints one input under those that have gone before it (ie the first 
+// valid value for each pixel and band wins). Bands are treated separately
+// as is done for the nodata in getTile().
+template <class T, class U>
+void doMosaic(const ComposeBands &bands, MosaicState &state)
+{
+    const U nMaxOut = std::numeric_limits<U>::max();
+    const npy_intp nInBands = bands.inputs.size();
+    const npy_intp nOutBands = bands.outputs.size();
+    const npy_intp nXSize = bands.inputs[0].nXSize;
+    const npy_intp nYSize = bands.inputs[0].nYSize;
+    const npy_intp nTileXSize = bands.outputs[0].nXSize;
+
+    for( npy_intp ri = 0; ri < nYSize && state.nRemaining > 0; ri++ )
+    {
+        npy_intp r = ri + bands.nYOff;
+        unsigned char *pFilled = state.pFilled + r * nTileXSize + bands.nXOff;
+        U *pAlpha = NULL;
+        if( bands.bAlpha )
+            pAlpha = bands.outputs[nOutBands - 1].row<U>(r) + bands.nXOff;
+
+        if( bands.pColormap != NULL )
+        {
+            // one input band gives all 4 output bands (or the index)
+            const T *pIn = bands.inputs[0].row<T>(ri);
+            const BandIgnore &nodata = bands.nodata[0];
+            for( npy_intp c = 0; c < nXSize; c++ )
+            {
+                if( pFilled[c] || (nodata.bHave && isNodata(pIn[c], nodata.dValue)) )
+                    continue;
+                npy_intp nIndex = colorIndex((double)pIn[c], bands.nColors);
+                if( bands.bIndexed )
+                    bands.outputs[0].row<U>(r)[bands.nXOff + c] = (U)nIndex;
+                for( npy_intp b = 0; b < 4 && !bands.bIndexed; b++ )
+                {
+                    const U *pColors = (const U*)bands.pColormap + b * bands.nColors;
+                    bands.outputs[b].row<U>(r)[bands.nXOff + c] = pColors[nIndex];
+                }
+                pFilled[c] = state.nAllFilled;
+                state.nRemaining--;
+            }
+            continue;
+        }
+
+        for( npy_intp b = 0; b < nInBands; b++ )
+        {
+            const T *pIn = bands.inputs[b].row<T>(ri);
+            U *pOut = bands.outputs[b].row<U>(r) + bands.nXOff;
+            const BandIgnore &nodata = bands.nodata[b];
+            const unsigned char nBit = 1 << b;
+            const bool bRescale = !bands.rescaleMin.empty();
+            for( npy_intp c = 0; c < nXSize; c++ )
+            {
+                if( (pFilled[c] & nBit) || 
+                        (nodata.bHave && isNodata(pIn[c], nodata.dValue)) )
+                    continue;
+                if( bRescale )
+                    pOut[c] = rescalePixel<U>((double)pIn[c], 
+                        bands.rescaleMin[b], bands.rescaleScale[b]);
+                else
+                    pOut[c] = (U)pIn[c];
+                if( pFilled[c] == 0 && pAlpha != NULL )
+                    pAlpha[c] = nMaxOut;    // something valid here
+                pFilled[c] |= nBit;
+                if( pFilled[c] == state.nAllFilled )
+                    state.nRemaining--;
+            }
+        }
+    }
+}
+
+typedef void (*ComposeFunc)(const ComposeBands&);
+typedef void (*MosaicFunc)(const ComposeBands&, MosaicState&);
+
+template <class U>
+static ComposeFunc getComposeFuncForOutput(int inputType, MosaicFunc *ppMosaic)
+{
+    switch(inputType)
+    {
+        case NPY_INT8:
+            *ppMosaic = doMosaic <npy_int8, U>;
+            return doCompose <npy_int8, U>;
+        case NPY_UINT8:
+            *ppMosaic = doMosaic <npy_uint8, U>;
+            return doCompose <npy_uint8, U>;
+        case NPY_INT16:
+            *ppMosaic = doMosaic <npy_int16, U>;
+            return doCompose <npy_int16, U>;
+        case NPY_UINT16:
+            *ppMosaic = doMosaic <npy_uint16, U>;
+            return doCompose <npy_uint16, U>;
+        case NPY_INT32:
+            *ppMosaic = doMosaic <npy_int32, U>;
+            return doCompose <npy_int32, U>;
+        case NPY_UINT32:
+            *ppMosaic = doMosaic <npy_uint32, U>;
+            return doCompose <npy_uint32, U>;
+        case NPY_INT64:
+            *ppMosaic = doMosaic <npy_int64, U>;
+            return doCompose <npy_int64, U>;
+        case NPY_UINT64:
+            *ppMosaic = doMosaic <npy_uint64, U>;
+            return doCompose <npy_uint64, U>;
+        case NPY_FLOAT32:
+            *ppMosaic = doMosaic <npy_float32, U>;
+            return doCompose <npy_float32, U>;
+        case NPY_FLOAT64:
+            *ppMosaic = doMosaic <npy_float64, U>;
+            return doCompose <npy_float64, U>;
+        default:
+            *ppMosaic = NULL;
+            return NULL;
+    }
+}
+
+// Returns the compose() kernel (and sets *ppMosaic to the mosaic() one)
+// for the given types. NULL if not supported.
+static ComposeFunc getComposeFunc(int inputType, int outputType, 
+        MosaicFunc *ppMosaic)
+{
+    switch(outputType)
+    {
+        case NPY_UINT8:
+            return getComposeFuncForOutput <npy_uint8> (inputType, ppMosaic);
+        case NPY_UINT16:
+            return getComposeFuncForOutput <npy_uint16> (inputType, ppMosaic);
+        default:
+            *ppMosaic = NULL;
+            return NULL;
+    }
+}
 
-#define GETSTATE(m) ((struct ResamplerState*)PyModule_GetState(m))
+// upper limit on the nthreads parameter
+#define MAX_THREADS 64
 
-template <class T>
-void doBilinearNoIgnore(PyArrayObject *pInput, PyArrayObject *pOutput)
+// Fills in the ignore value for each band from pIgnore which is either
+// None, a float (used for all bands) or a sequence of floats (or None)
+// with one per band. Returns false with an exception set on failure.
+static bool parseIgnores(PyObject *self, PyObject *pIgnore, npy_intp nBands,
+        std::vector<BandIgnore> &ignores)
 {
-    npy_intp nInYSize = PyArray_DIM(pInput, 0);
-    npy_intp nInXSize = PyArray_DIM(pInput, 1);
-    npy_intp nOutYSize = PyArray_DIM(pOutput, 0);
-    npy_intp nOutXSize = PyArray_DIM(pOutput, 1);
+    ignores.resize(nBands);
+    if( pIgnore == Py_None )
+    {
+        for( npy_intp n = 0; n < nBands; n++ )
+            ignores[n].bHave = false;
+        return true;
+    }
+
+    if( !PySequence_Check(pIgnore) )
+    {
+        double dIgnore = PyFloat_AsDouble(pIgnore);
+        if( PyErr_Occurred() )
+            return false;
+        for( npy_intp n = 0; n < nBands; n++ )
+        {
+            ignores[n].bHave = true;
+            ignores[n].dValue = dIgnore;
+        }
+        return true;
+    }
 
-    float rowscale = (float)nInYSize / (float)nOutYSize;
-    float colscale = (float)nInXSize / (float)nOutXSize;
+    if( PySequence_Size(pIgnore) != nBands )
+    {
+        PyErr_SetString(GETSTATE(self)->error, 
+            "Must be one ignore value per band");
+        return false;
+    }
 
-    // (ri, ci) are row/col in input, (ro, co) are row/col in output.
-    // These are notionally float coordinate systems, where the whole
-    // number values are on the pixel centres.
-    for (int ro = 0; ro < nOutYSize; ro++) {
-        float ri = (ro + 0.5) * rowscale - 0.5;
-        for (int co = 0; co < nOutXSize; co++) {
-            float ci = (co + 0.5) * colscale - 0.5;
+    for( npy_intp n = 0; n < nBands; n++ )
+    {
+        PyObject *pItem = PySequence_GetItem(pIgnore, n);
+        if( pItem == NULL )
+            return false;
+        ignores[n].bHave = pItem != Py_None;
+        if( ignores[n].bHave )
+            ignores[n].dValue = PyFloat_AsDouble(pItem);
+        Py_DECREF(pItem);
+        if( PyErr_Occurred() )
+            return false;
+    }
+    return true;
+}
 
-            // The four surrounding input row/col values i.e. lower/upper,
-            // relative to the (ri, ci) coordinate
-            float ri_l = std::floor(ri);
-            float ri_u = std::ceil(ri);
-            float ci_l = std::floor(ci);
-            float ci_u = std::ceil(ci);
+// Fills in one ImagePlane per band of a 2 or 3 dimensional array
+static void getPlanes(PyArrayObject *pArray, std::vector<ImagePlane> &planes)
+{
+    int nDims = PyArray_NDIM(pArray);
+    npy_intp nBands = (nDims == 3) ? PyArray_DIM(pArray, 0) : 1;
+    planes.resize(nBands);
+    for( npy_intp n = 0; n < nBands; n++ )
+    {
+        ImagePlane &plane = planes[n];
+        plane.pData = PyArray_BYTES(pArray);
+        if( nDims == 3 )
+            plane.pData += n * PyArray_STRIDE(pArray, 0);
+        plane.nYSize = PyArray_DIM(pArray, nDims - 2);
+        plane.nXSize = PyArray_DIM(pArray, nDims - 1);
+        plane.nRowStride = PyArray_STRIDE(pArray, nDims - 2);
+        plane.nPixelStride = PyArray_STRIDE(pArray, nDims - 1);
+    }
+}
 
-            // Mostly the edge-of-block values will be stripped off with
-            // the margin. Howver, at the edge of the physical file, there is
-            // no margin, so restrict to within the block, just in case.
-            if (ri_l < 0) ri_l = 0;
-            if (ri_u >= nInYSize) ri_u = nInYSize - 1;
-            if (ci_l < 0) ci_l = 0;
-            if (ci_u >= nInXSize) ci_u = nInXSize - 1;
+// Does the work for bilinear(), bilinear_window(), nearest(), average(),
+// mode(), cubic() and lanczos().
+// The output is nWidth x nHeight and is the window starting at
+// (nXOff, nYOff) of an output of size nFullWidth x nFullHeight.
+// pInput may be 2d or 3d (bands, rows, cols) and the output has the
+// same number of dimensions. pIgnore is NULL for nearest().
+// pOut is either None (a new output array is created) or an array of
+// the right type and shape to write the output into, which is returned.
+static PyObject *doResampleWindow(PyObject *self, ResampleFunc pFunc, 
+        PyArrayObject *pInput, PyObject *pIgnore, int nFullWidth, int nFullHeight, 
+        int nXOff, int nYOff, int nWidth, int nHeight, int nThreads, PyObject *pOut)
+{
+    int nDims = PyArray_NDIM(pInput);
+    if( nDims != 2 && nDims != 3 )
+    {
+        PyErr_SetString(GETSTATE(self)->error, "Input must be 2 or 3 dimensional");
+        return NULL;
+    }
 
-            // The input pixel values at these 4 points
-            T a = *(T*)PyArray_GETPTR2(pInput, (npy_intp)ri_l, (npy_intp)ci_l);
-            T b = *(T*)PyArray_GETPTR2(pInput, (npy_intp)ri_l, (npy_intp)ci_u);
-            T c = *(T*)PyArray_GETPTR2(pInput, (npy_intp)ri_u, (npy_intp)ci_l);
-            T d = *(T*)PyArray_GETPTR2(pInput, (npy_intp)ri_u, (npy_intp)ci_u);
+    if( nWidth < 0 || nHeight < 0 || nXOff < 0 || nYOff < 0 || 
+            (nXOff + nWidth) > nFullWidth || (nYOff + nHeight) > nFullHeight )
+    {
+        PyErr_SetString(GETSTATE(self)->error, "Invalid output size or window");
+        return NULL;
+    }
 
-            // Weights, one each for row and col
-            float c_w = ci - ci_l;
-            float r_w = ri - ri_l;
+    if( nThreads <= 0 )
+        nThreads = std::thread::hardware_concurrency();
+    if( nThreads > MAX_THREADS )
+        nThreads = MAX_THREADS;
 
-            // The weighted average of the four, which is our estimate
-            // for the output pixel at (ri, ci)
-            T pixel = a * (1.0 - c_w) * (1.0 - r_w) +
-                          b * c_w * (1.0 - r_w) +
-                          c * r_w * (1.0 - c_w) +
-                          d * c_w * r_w;
+    npy_intp nBands = (nDims == 3) ? PyArray_DIM(pInput, 0) : 1;
+    ResampleBands bands;
+    if( pIgnore != NULL && !parseIgnores(self, pIgnore, nBands, bands.ignores) )
+        return NULL;
+    
+    if( pFunc == NULL )
+    {
+        PyErr_SetString(GETSTATE(self)->error, "Unsupported data type");
+        return NULL;
+    }
 
-            *(T*)PyArray_GETPTR2(pOutput, (npy_intp)ro, (npy_intp)co) = pixel;
+    npy_intp out_dims[] = {nBands, nHeight, nWidth};
+    PyArrayObject *pOutput;
+    if( pOut == Py_None )
+    {
+        pOutput = (PyArrayObject*)PyArray_EMPTY(nDims, &out_dims[3 - nDims], 
+            PyArray_TYPE(pInput), 0);
+        if( pOutput == NULL )
+            return NULL;
+    }
+    else
+    {
+        // caller supplied. Can have any strides.
+        if( !PyArray_Check(pOut) )
+        {
+            PyErr_SetString(GETSTATE(self)->error, "out must be a numpy array");
+            return NULL;
+        }
+        pOutput = (PyArrayObject*)pOut;
+        // byte order too, as the kernels write native values
+        if( !PyArray_EquivTypes(PyArray_DESCR(pOutput), PyArray_DESCR(pInput)) )
+        {
+            PyErr_SetString(GETSTATE(self)->error, 
+                "out must have the same dtype (and byte order) as input");
+            return NULL;
+        }
+        if( PyArray_NDIM(pOutput) != nDims || !PyArray_CompareLists(
+                PyArray_DIMS(pOutput), &out_dims[3 - nDims], nDims) )
+        {
+            PyErr_SetString(GETSTATE(self)->error, 
+                "out must be the same shape as the output");
+            return NULL;
+        }
+        if( !PyArray_ISWRITEABLE(pOutput) )
+        {
+            PyErr_SetString(GETSTATE(self)->error, "out must be writeable");
+            return NULL;
         }
+        Py_INCREF(pOutput);
+    }
+
+    if( nBands == 0 || nWidth == 0 || nHeight == 0 || 
+            PyArray_DIM(pInput, nDims - 2) == 0 || 
+            PyArray_DIM(pInput, nDims - 1) == 0 )
+    {
+        // nothing to do
+        return (PyObject*)pOutput;
+    }
+
+    // kernels assume C contiguous rows. Normally already the case
+    // so this is just a new reference.
+    pInput = (PyArrayObject*)PyArray_GETCONTIGUOUS(pInput);
+    if( pInput == NULL )
+    {
+        Py_DECREF(pOutput);
+        return NULL;
+    }
+
+    OutputWindow window;
+    window.nFullXSize = nFullWidth;
+    window.nFullYSize = nFullHeight;
+    window.nXOff = nXOff;
+    window.nYOff = nYOff;
+
+    // the kernels don't touch any Python objects so let 
+    // other Python threads run while they do their thing
+    bool bNoMemory = false;
+    Py_BEGIN_ALLOW_THREADS
+    try
+    {
+        KernelTimer timer(nBands * nWidth * nHeight);
+        getPlanes(pInput, bands.inputs);
+        getPlanes(pOutput, bands.outputs);
+        pFunc(bands, window, nThreads);
+    }
+    catch(std::bad_alloc &)
+    {
+        bNoMemory = true;
     }
+    Py_END_ALLOW_THREADS
+
+    Py_DECREF(pInput);
+    if( bNoMemory )
+    {
+        Py_DECREF(pOutput);
+        return PyErr_NoMemory();
+    }
+
+    return (PyObject*)pOutput;     
 }
 
-template <class T>
-void doBilinearHaveIgnore(PyArrayObject *pInput, PyArrayObject *pOutput, double dIgnore)
+static PyObject *resampler_bilinear(PyObject *self, PyObject *args, PyObject *kwds)
 {
-    npy_intp nInYSize = PyArray_DIM(pInput, 0);
-    npy_intp nInXSize = PyArray_DIM(pInput, 1);
-    npy_intp nOutYSize = PyArray_DIM(pOutput, 0);
-    npy_intp nOutXSize = PyArray_DIM(pOutput, 1);
-    T typeIgnore = dIgnore;
+    PyArrayObject *pInput;
+    PyObject *pIgnore;
+    int nWidth, nHeight;
+    int nThreads = 1;
+    PyObject *pOut = Py_None;
+    const char *kwlist[] = {"input", "ignore", "width", "height", "nthreads", "out", NULL};
     
-    float rowscale = (float)nInYSize / (float)nOutYSize;
-    float colscale = (float)nInXSize / (float)nOutXSize;
+    if( !PyArg_ParseTupleAndKeywords(args, kwds, "O!Oii|iO:bilinear", 
+            (char**)kwlist, &PyArray_Type, &pInput, &pIgnore, &nWidth, &nHeight,
+            &nThreads, &pOut))
+        return NULL;
 
-    // (ri, ci) are row/col in input, (ro, co) are row/col in output.
-    // These are notionally float coordinate systems, where the whole
-    // number values are on the pixel centres.
-    for (int ro = 0; ro < nOutYSize; ro++) {
-        float ri = (ro + 0.5) * rowscale - 0.5;
-        for (int co = 0; co < nOutXSize; co++) {
-            float ci = (co + 0.5) * colscale - 0.5;
-
-            // The four surrounding input row/col values i.e. lower/upper,
-            // relative to the (ri, ci) coordinate
-            float ri_l = std::floor(ri);
-            float ri_u = std::ceil(ri);
-            float ci_l = std::floor(ci);
-            float ci_u = std::ceil(ci);
-
-            // Mostly the edge-of-block values will be stripped off with
-            // the margin. Howver, at the edge of the physical file, there is
-            // no margin, so restrict to within the block, just in case.
-            if (ri_l < 0) ri_l = 0;
-            if (ri_u >= nInYSize) ri_u = nInYSize - 1;
-            if (ci_l < 0) ci_l = 0;
-            if (ci_u >= nInXSize) ci_u = nInXSize - 1;
-
-            // The input pixel values at these 4 points
-            T a = *(T*)PyArray_GETPTR2(pInput, (npy_intp)ri_l, (npy_intp)ci_l);
-            T b = *(T*)PyArray_GETPTR2(pInput, (npy_intp)ri_l, (npy_intp)ci_u);
-            T c = *(T*)PyArray_GETPTR2(pInput, (npy_intp)ri_u, (npy_intp)ci_l);
-            T d = *(T*)PyArray_GETPTR2(pInput, (npy_intp)ri_u, (npy_intp)ci_u);
-
-            // Weights, one each for row and col
-            float c_w = ci - ci_l;
-            float r_w = ri - ri_l;
-
-            float totalWeight = 0.0;
-            float pixelSum = 0.0;
-            T pixel;
-
-            if (a != typeIgnore)
-            {
-                pixelSum += a * (1.0 - c_w) * (1.0 - r_w);
-                totalWeight += (1.0 - c_w) * (1.0 - r_w);
-            }
-            if (b != typeIgnore)
-            {
-                pixelSum += b * c_w * (1.0 - r_w);
-                totalWeight += c_w * (1.0 - r_w);
-            }
-            if (c != typeIgnore)
-            {
-                pixelSum += c * r_w * (1.0 - c_w);
-                totalWeight += r_w * (1.0 - c_w);
-            }
-            if (d != typeIgnore)
-            {
-                pixelSum += d * c_w * r_w;
-                totalWeight += c_w * r_w;
-            }
+    return doResampleWindow(self, getBilinearFunc(PyArray_TYPE(pInput)), 
+        pInput, pIgnore, nWidth, nHeight, 0, 0, nWidth, nHeight, nThreads, pOut);
+}
 
-            if (totalWeight > 0)
-            {
-                pixel = pixelSum / totalWeight;
-            }
-            else
-            {
-                pixel = typeIgnore;
-            }
+static PyObject *resampler_bilinear_window(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyArrayObject *pInput;
+    PyObject *pIgnore;
+    int nFullWidth, nFullHeight, nXOff, nYOff, nWidth, nHeight;
+    int nThreads = 1;
+    PyObject *pOut = Py_None;
+    const char *kwlist[] = {"input", "ignore", "fullwidth", "fullheight", 
+        "xoff", "yoff", "width", "height", "nthreads", "out", NULL};
+    
+    if( !PyArg_ParseTupleAndKeywords(args, kwds, "O!Oiiiiii|iO:bilinear_window", 
+            (char**)kwlist, &PyArray_Type, &pInput, &pIgnore, &nFullWidth, 
+            &nFullHeight, &nXOff, &nYOff, &nWidth, &nHeight, &nThreads, &pOut))
+        return NULL;
 
-            *(T*)PyArray_GETPTR2(pOutput, (npy_intp)ro, (npy_intp)co) = pixel;
-        }
-    }
+    return doResampleWindow(self, getBilinearFunc(PyArray_TYPE(pInput)), 
+        pInput, pIgnore, nFullWidth, nFullHeight, nXOff, nYOff, nWidth, nHeight, 
+        nThreads, pOut);
 }
 
+static PyObject *resampler_nearest(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyArrayObject *pInput;
+    int nFullWidth, nFullHeight, nXOff, nYOff, nWidth, nHeight;
+    int nThreads = 1;
+    PyObject *pOut = Py_None;
+    const char *kwlist[] = {"input", "fullwidth", "fullheight", 
+        "xoff", "yoff", "width", "height", "nthreads", "out", NULL};
+    
+    if( !PyArg_ParseTupleAndKeywords(args, kwds, "O!iiiiii|iO:nearest", 
+            (char**)kwlist, &PyArray_Type, &pInput, &nFullWidth, 
+            &nFullHeight, &nXOff, &nYOff, &nWidth, &nHeight, &nThreads, &pOut))
+        return NULL;
+
+    return doResampleWindow(self, getNearestFunc(pInput), 
+        pInput, NULL, nFullWidth, nFullHeight, nXOff, nYOff, nWidth, nHeight, 
+        nThreads, pOut);
+}
 
-static PyObject *resampler_bilinear(PyObject *self, PyObject *args)
+// Does the argument parsing for average(), mode(), cubic() and 
+// lanczos() which take the same arguments as bilinear_window(). 
+// pszFormat is for PyArg_ParseTupleAndKeywords() and pGetFunc returns
+// the kernel for the type of the input.
+static PyObject *doKernelWindow(PyObject *self, PyObject *args, PyObject *kwds,
+        const char *pszFormat, ResampleFunc (*pGetFunc)(int))
 {
     PyArrayObject *pInput;
     PyObject *pIgnore;
-    double dIgnore;
-    int nWidth, nHeight;
+    int nFullWidth, nFullHeight, nXOff, nYOff, nWidth, nHeight;
+    int nThreads = 1;
+    PyObject *pOut = Py_None;
+    const char *kwlist[] = {"input", "ignore", "fullwidth", "fullheight", 
+        "xoff", "yoff", "width", "height", "nthreads", "out", NULL};
     
-    if( !PyArg_ParseTuple(args, "O!Oii:bilinear", &PyArray_Type, &pInput, 
-            &pIgnore, &nWidth, &nHeight))
+    if( !PyArg_ParseTupleAndKeywords(args, kwds, pszFormat, (char**)kwlist, &PyArray_Type, &pInput, &pIgnore, &nFullWidth, 
+            &nFullHeight, &nXOff, &nYOff, &nWidth, &nHeight, &nThreads, &pOut))
+        return NULL;
+
+    return doResampleWindow(self, pGetFunc(PyArray_TYPE(pInput)), pInput, pIgnore, nFullWidth, nFullHeight, nXOff, nYOff, nWidth, nHeight, 
+        nThreads, pOut);
+}
+
+static PyObject *resampler_average(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    return doKernelWindow(self, args, kwds, "O!Oiiiiii|iO:average", 
+        getAverageFunc);
+}
+
+static PyObject *resampler_mode(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    return doKernelWindow(self, args, kwds, "O!Oiiiiii|iO:mode", getModeFunc);
+}
+
+static PyObject *resampler_cubic(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    return doKernelWindow(self, args, kwds, "O!Oiiiiii|iO:cubic", 
+        getFilterFunc<FILTER_CUBIC>);
+}
+
+static PyObject *resampler_lanczos(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    return doKernelWindow(self, args, kwds, "O!Oiiiiii|iO:lanczos", 
+        getFilterFunc<FILTER_LANCZOS>);
+}
+
+// Fills in bands.rescaleMin and bands.rescaleScale from pRescaling which
+// is a sequence of (min, max) either with one for all bands or one per band.
+static bool parseRescaling(PyObject *self, PyObject *pRescaling, npy_intp nBands,
+        double dMaxOut, ComposeBands &bands)
+{
+    if( !PySequence_Check(pRescaling) )
+    {
+        PyErr_SetString(GETSTATE(self)->error, 
+            "rescaling must be a sequence of (min, max)");
+        return false;
+    }
+    npy_intp nSize = PySequence_Size(pRescaling);
+    if( nSize != 1 && nSize != nBands )
+    {
+        PyErr_SetString(GETSTATE(self)->error, 
+            "length of rescaling doesn't match number of bands");
+        return false;
+    }
+
+    bands.rescaleMin.resize(nBands);
+    bands.rescaleScale.resize(nBands);
+    for( npy_intp n = 0; n < nBands; n++ )
+    {
+        PyObject *pItem = PySequence_GetItem(pRescaling, (nSize == 1) ? 0 : n);
+        if( pItem == NULL )
+            return false;
+        double dMin, dMax;
+        bool bOK = PyArg_ParseTuple(pItem, "dd", &dMin, &dMax);
+        Py_DECREF(pItem);
+        if( !bOK )
+            return false;
+        if( dMax == dMin )
+        {
+            PyErr_SetString(GETSTATE(self)->error, 
+                "rescaling min and max must be different");
+            return false;
+        }
+        bands.rescaleMin[n] = dMin;
+        bands.rescaleScale[n] = dMaxOut / (dMax - dMin);
+    }
+    return true;
+}
+
+// Checks pOutput is an array compose() and mosaic() can write to. Must
+// be done before anything else uses its dimensions. Returns false on 
+// error.
+static bool checkComposeOutput(PyObject *self, PyArrayObject *pOutput)
+{
+    if( PyArray_NDIM(pOutput) != 3 || !PyArray_ISWRITEABLE(pOutput) || 
+            PyArray_STRIDE(pOutput, 2) != PyArray_ITEMSIZE(pOutput) )
+    {
+        PyErr_SetString(GETSTATE(self)->error, 
+            "out must be a writeable 3d array with contiguous rows");
+        return false;
+    }
+    return true;
+}
+
+// Checks pInput is 2d or 3d and fits in pOutput at (nXOff, nYOff). Sets
+// the inputs, offsets and nodata of bands. Returns a new reference to
+// pInput (or a copy if its pixels aren't contiguous) or NULL on error.
+// Inputs are used as is otherwise, so they can be a view of the 
+// output (eg read straight into the tile).
+static PyArrayObject *prepareComposeInput(PyObject *self, PyArrayObject *pInput, 
+        PyArrayObject *pOutput, int nXOff, int nYOff, PyObject *pNodata,
+        ComposeBands &bands)
+{
+    int nDims = PyArray_NDIM(pInput);
+    if( nDims != 2 && nDims != 3 )
+    {
+        PyErr_SetString(GETSTATE(self)->error, "Input must be 2 or 3 dimensional");
+        return NULL;
+    }
+    npy_intp nInBands = (nDims == 3) ? PyArray_DIM(pInput, 0) : 1;
+    if( nInBands == 0 || nInBands > 8 )
+    {
+        PyErr_SetString(GETSTATE(self)->error, "Input must have 1 to 8 bands");
+        return NULL;
+    }
+    npy_intp nYSize = PyArray_DIM(pInput, nDims - 2);
+    npy_intp nXSize = PyArray_DIM(pInput, nDims - 1);
+
+    if( nXOff < 0 || nYOff < 0 || (nXOff + nXSize) > PyArray_DIM(pOutput, 2) ||
+            (nYOff + nYSize) > PyArray_DIM(pOutput, 1) )
+    {
+        PyErr_SetString(GETSTATE(self)->error, 
+            "input doesn't fit in out at xoff, yoff");
+        return NULL;
+    }
+    bands.nXOff = nXOff;
+    bands.nYOff = nYOff;
+
+    if( !parseIgnores(self, pNodata, nInBands, bands.nodata) )
         return NULL;
 
-    bool bHaveIgnore = pIgnore != Py_None;       
-    if( bHaveIgnore )
+    if( PyArray_STRIDE(pInput, nDims - 1) == PyArray_ITEMSIZE(pInput) )
+    {
+        Py_INCREF(pInput);
+        return pInput;
+    }
+    return (PyArrayObject*)PyArray_GETCONTIGUOUS(pInput);
+}
+
+// Checks the number of bands of pOutput (already checked by 
+// checkComposeOutput()) and sets the rescaling, colormap and alpha of 
+// bands for the given number of input bands. *ppColormapArray is set to
+// a new reference to the colormap array (NULL if no colormap). 
+// Returns false on error.
+static bool prepareComposeOutput(PyObject *self, PyArrayObject *pOutput,
+        npy_intp nInBands, PyObject *pRescaling, PyObject *pColormap, 
+        ComposeBands &bands, PyArrayObject **ppColormapArray)
+{
+    *ppColormapArray = NULL;
+    int outputType = PyArray_TYPE(pOutput);
+    npy_intp nOutBands = PyArray_DIM(pOutput, 0);
+
+    bands.pColormap = NULL;
+    bands.nColors = 0;
+    bands.bIndexed = false;
+    bands.nOutsideIndex = 0;
+    if( pColormap != Py_None )
+    {
+        if( nInBands != 1 || (nOutBands != 1 && nOutBands != 4) || 
+                pRescaling != Py_None )
+        {
+            PyErr_SetString(GETSTATE(self)->error, 
+                "colormap needs 1 input band, 1 or 4 output bands and no rescaling");
+            return false;
+        }
+        bands.bAlpha = false;   // comes from colormap
+        bands.bIndexed = nOutBands == 1;
+    }
+    else if( nOutBands == nInBands || nOutBands == nInBands + 1 )
+    {
+        bands.bAlpha = nOutBands == nInBands + 1;
+    }
+    else
+    {
+        PyErr_SetString(GETSTATE(self)->error, 
+            "out must have the same number of bands as input, or one more for alpha");
+        return false;
+    }
+
+    double dMaxOut = (outputType == NPY_UINT8) ? 255 : 65535;
+    if( pRescaling != Py_None && 
+            !parseRescaling(self, pRescaling, nInBands, dMaxOut, bands) )
+        return false;
+
+    if( pColormap != Py_None )
     {
-        dIgnore = PyFloat_AsDouble(pIgnore);
-        // TODO: PyErr_Occurred
+        PyArrayObject *pColormapArray = (PyArrayObject*)PyArray_FROM_OTF(
+            pColormap, outputType, NPY_ARRAY_IN_ARRAY);
+        if( pColormapArray == NULL )
+            return false;
+        if( PyArray_NDIM(pColormapArray) != 2 || PyArray_DIM(pColormapArray, 0) != 4 ||
+                PyArray_DIM(pColormapArray, 1) == 0 )
+        {
+            PyErr_SetString(GETSTATE(self)->error, "colormap must be of shape (4, n)");
+            Py_DECREF(pColormapArray);
+            return false;
+        }
+        if( bands.bIndexed && PyArray_DIM(pColormapArray, 1) - 1 > dMaxOut )
+        {
+            PyErr_SetString(GETSTATE(self)->error, 
+                "colormap has too many colors to write the index to out");
+            Py_DECREF(pColormapArray);
+            return false;
+        }
+        bands.pColormap = PyArray_BYTES(pColormapArray);
+        bands.nColors = PyArray_DIM(pColormapArray, 1);
+        *ppColormapArray = pColormapArray;
     }
+    return true;
+}
+
+static PyObject *resampler_compose(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyArrayObject *pInput, *pOutput;
+    int nXOff, nYOff;
+    PyObject *pRescaling = Py_None, *pColormap = Py_None, *pNodata = Py_None;
+    int nOutsideIndex = 0;
+    const char *kwlist[] = {"input", "out", "xoff", "yoff", "rescaling", 
+        "colormap", "nodata", "outside", NULL};
     
-    int arrayType = PyArray_TYPE(pInput);
-    npy_intp out_dims[] = {nHeight, nWidth};
-    PyArrayObject *pOutput = (PyArrayObject*)PyArray_EMPTY(2, out_dims, arrayType, 0);
+    if( !PyArg_ParseTupleAndKeywords(args, kwds, "O!O!ii|OOOi:compose", 
+            (char**)kwlist, &PyArray_Type, &pInput, &PyArray_Type, &pOutput,
+            &nXOff, &nYOff, &pRescaling, &pColormap, &pNodata, &nOutsideIndex))
+        return NULL;
+
+    if( !checkComposeOutput(self, pOutput) )
+        return NULL;
+
+    MosaicFunc pMosaicFunc;
+    ComposeFunc pFunc = getComposeFunc(PyArray_TYPE(pInput), 
+        PyArray_TYPE(pOutput), &pMosaicFunc);
+    if( pFunc == NULL )
+    {
+        PyErr_SetString(GETSTATE(self)->error, "Unsupported data type");
+        return NULL;
+    }
+
+    ComposeBands bands;
+    pInput = prepareComposeInput(self, pInput, pOutput, nXOff, nYOff, pNodata, 
+        bands);
+    if( pInput == NULL )
+        return NULL;
+
+    PyArrayObject *pColormapArray;
+    if( !prepareComposeOutput(self, pOutput, bands.nodata.size(), pRescaling, 
+            pColormap, bands, &pColormapArray) )
+    {
+        Py_DECREF(pInput);
+        return NULL;
+    }
+
+    double dMaxOut = (PyArray_TYPE(pOutput) == NPY_UINT8) ? 255 : 65535;
+    if( bands.bIndexed && (nOutsideIndex < 0 || nOutsideIndex > dMaxOut) )
+    {
+        PyErr_SetString(GETSTATE(self)->error, "outside out of range for out");
+        Py_DECREF(pInput);
+        Py_DECREF(pColormapArray);
+        return NULL;
+    }
+    bands.nOutsideIndex = nOutsideIndex;
+
+    bool bNoMemory = false;
+    Py_BEGIN_ALLOW_THREADS
+    try
+    {
+        KernelTimer timer(PyArray_SIZE(pInput));
+        CPUTimer cpuTimer(t_pTimes.get());
+        getPlanes(pInput, bands.inputs);
+        getPlanes(pOutput, bands.outputs);
+        pFunc(bands);
+    }
+    catch(std::bad_alloc &)
+    {
+        bNoMemory = true;
+    }
+    Py_END_ALLOW_THREADS
+
+    Py_DECREF(pInput);
+    Py_XDECREF(pColormapArray);
+    if( bNoMemory )
+        return PyErr_NoMemory();
+
+    Py_INCREF(pOutput);
+    return (PyObject*)pOutput;
+}
+
+static PyObject *resampler_mosaic(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *pInputs;
+    PyArrayObject *pOutput, *pFilled;
+    PyObject *pRescaling = Py_None, *pColormap = Py_None;
+    const char *kwlist[] = {"inputs", "out", "filled", "rescaling", 
+        "colormap", NULL};
     
-    if( pIgnore == Py_None )
+    if( !PyArg_ParseTupleAndKeywords(args, kwds, "OO!O!|OO:mosaic", 
+            (char**)kwlist, &pInputs, &PyArray_Type, &pOutput, 
+            &PyArray_Type, &pFilled, &pRescaling, &pColormap))
+        return NULL;
+
+    if( !checkComposeOutput(self, pOutput) )
+        return NULL;
+
+    if( PyArray_TYPE(pFilled) != NPY_UINT8 || 
+            PyArray_NDIM(pFilled) != 2 || !PyArray_IS_C_CONTIGUOUS(pFilled) ||
+            !PyArray_ISWRITEABLE(pFilled) || 
+            PyArray_DIM(pFilled, 0) != PyArray_DIM(pOutput, 1) ||
+            PyArray_DIM(pFilled, 1) != PyArray_DIM(pOutput, 2) )
+    {
+        PyErr_SetString(GETSTATE(self)->error, 
+            "filled must be a writeable, contiguous uint8 array the size of the tile");
+        return NULL;
+    }
+
+    PyObject *pSeq = PySequence_Fast(pInputs, "inputs must be a sequence");
+    if( pSeq == NULL )
+        return NULL;
+    Py_ssize_t nInputs = PySequence_Fast_GET_SIZE(pSeq);
+
+    // check everything and get the kernels first so the GIL can be
+    // released for all the inputs together
+    std::vector<ComposeBands> inputBands(nInputs);
+    std::vector<MosaicFunc> funcs(nInputs);
+    std::vector<PyArrayObject*> arrays;
+    PyArrayObject *pColormapArray = NULL;
+    bool bOK = true;
+    npy_intp nInBands = 0;
+    for( Py_ssize_t n = 0; n < nInputs && bOK; n++ )
     {
-        // no ignore - use optimised version
-        switch(arrayType)
-        {
-            case NPY_INT8:
-                doBilinearNoIgnore <npy_int8> (pInput, pOutput);
-                break;
-            case NPY_UINT8:
-                doBilinearNoIgnore <npy_uint8> (pInput, pOutput);
-                break;
-            case NPY_INT16:
-                doBilinearNoIgnore <npy_int16> (pInput, pOutput);
-                break;
-            case NPY_UINT16:
-                doBilinearNoIgnore <npy_uint16> (pInput, pOutput);
-                break;
-            case NPY_INT32:
-                doBilinearNoIgnore <npy_int32> (pInput, pOutput);
-                break;
-            case NPY_UINT32:
-                doBilinearNoIgnore <npy_uint32> (pInput, pOutput);
-                break;
-            case NPY_INT64:
-                doBilinearNoIgnore <npy_int64> (pInput, pOutput);
-                break;
-            case NPY_UINT64:
-                doBilinearNoIgnore <npy_uint64> (pInput, pOutput);
-                break;
-            case NPY_FLOAT16:
-                doBilinearNoIgnore <npy_float16> (pInput, pOutput);
-                break;
-            case NPY_FLOAT32:
-                doBilinearNoIgnore <npy_float32> (pInput, pOutput);
-                break;
-            case NPY_FLOAT64:
-                doBilinearNoIgnore <npy_float64> (pInput, pOutput);
-                break;
-            default:
-                PyErr_SetString(GETSTATE(self)->error, "Unsupported data type");
-                Py_DECREF(pOutput);
-                return NULL;
+        PyArrayObject *pInput;
+        int nXOff, nYOff;
+        PyObject *pNodata;
+        if( !PyArg_ParseTuple(PySequence_Fast_GET_ITEM(pSeq, n), "O!iiO:mosaic", 
+                &PyArray_Type, &pInput, &nXOff, &nYOff, &pNodata) )
+        {
+            bOK = false;
+            break;
+        }
+
+        ComposeFunc pComposeFunc = getComposeFunc(PyArray_TYPE(pInput), 
+            PyArray_TYPE(pOutput), &funcs[n]);
+        if( pComposeFunc == NULL )
+        {
+            PyErr_SetString(GETSTATE(self)->error, "Unsupported data type");
+            bOK = false;
+            break;
+        }
+
+        ComposeBands &bands = inputBands[n];
+        pInput = prepareComposeInput(self, pInput, pOutput, nXOff, nYOff, 
+            pNodata, bands);
+        if( pInput == NULL )
+        {
+            bOK = false;
+            break;
+        }
+        arrays.push_back(pInput);
+
+        if( n == 0 )
+        {
+            nInBands = bands.nodata.size();
+            bOK = prepareComposeOutput(self, pOutput, nInBands, pRescaling, 
+                pColormap, bands, &pColormapArray);
+        }
+        else if( (npy_intp)bands.nodata.size() != nInBands )
+        {
+            PyErr_SetString(GETSTATE(self)->error, 
+                "All inputs must have the same number of bands");
+            bOK = false;
+        }
+        else
+        {
+            // shared between all inputs
+            ComposeBands &first = inputBands[0];
+            bands.rescaleMin = first.rescaleMin;
+            bands.rescaleScale = first.rescaleScale;
+            bands.pColormap = first.pColormap;
+            bands.nColors = first.nColors;
+            bands.bIndexed = first.bIndexed;
+            bands.nOutsideIndex = first.nOutsideIndex;
+            bands.bAlpha = first.bAlpha;
         }
     }
-    else
+    Py_DECREF(pSeq);
+    if( bOK && nInputs == 0 )
+    {
+        // don't know how many bands so can't tell what is complete
+        return PyLong_FromLong(-1);
+    }
+
+    MosaicState state;
+    state.pFilled = (unsigned char*)PyArray_BYTES(pFilled);
+    state.nAllFilled = (pColormap != Py_None) ? 1 : (1 << nInBands) - 1;
+    state.nRemaining = 0;
+    bool bNoMemory = false;
+    if( bOK )
     {
-        // we have an ignore - use slower version
-        dIgnore = PyFloat_AsDouble(pIgnore);
-        // TODO: PyErr_Occurred
-        switch(arrayType)
-        {
-            case NPY_INT8:
-                doBilinearHaveIgnore <npy_int8> (pInput, pOutput, dIgnore);
-                break;
-            case NPY_UINT8:
-                doBilinearHaveIgnore <npy_uint8> (pInput, pOutput, dIgnore);
-                break;
-            case NPY_INT16:
-                doBilinearHaveIgnore <npy_int16> (pInput, pOutput, dIgnore);
-                break;
-            case NPY_UINT16:
-                doBilinearHaveIgnore <npy_uint16> (pInput, pOutput, dIgnore);
-                break;
-            case NPY_INT32:
-                doBilinearHaveIgnore <npy_int32> (pInput, pOutput, dIgnore);
-                break;
-            case NPY_UINT32:
-                doBilinearHaveIgnore <npy_uint32> (pInput, pOutput, dIgnore);
-                break;
-            case NPY_INT64:
-                doBilinearHaveIgnore <npy_int64> (pInput, pOutput, dIgnore);
-                break;
-            case NPY_UINT64:
-                doBilinearHaveIgnore <npy_uint64> (pInput, pOutput, dIgnore);
-                break;
-            case NPY_FLOAT16:
-                doBilinearHaveIgnore <npy_float16> (pInput, pOutput, dIgnore);
-                break;
-            case NPY_FLOAT32:
-                doBilinearHaveIgnore <npy_float32> (pInput, pOutput, dIgnore);
-                break;
-            case NPY_FLOAT64:
-                doBilinearHaveIgnore <npy_float64> (pInput, pOutput, dIgnore);
-                break;
-            default:
-                PyErr_SetString(GETSTATE(self)->error, "Unsupported data type");
-                Py_DECREF(pOutput);
-                return NULL;
+        Py_BEGIN_ALLOW_THREADS
+        npy_intp nPixels = PyArray_DIM(pFilled, 0) * PyArray_DIM(pFilled, 1);
+        for( npy_intp n = 0; n < nPixels; n++ )
+        {
+            if( state.pFilled[n] != state.nAllFilled )
+                state.nRemaining++;
+        }
+
+        try
+        {
+            KernelTimer timer(nPixels);
+            CPUTimer cpuTimer(t_pTimes.get());
+            for( Py_ssize_t n = 0; n < nInputs && state.nRemaining > 0; n++ )
+            {
+                getPlanes(arrays[n], inputBands[n].inputs);
+                getPlanes(pOutput, inputBands[n].outputs);
+                funcs[n](inputBands[n], state);
+            }
+        }
+        catch(std::bad_alloc &)
+        {
+            bNoMemory = true;
         }
+        Py_END_ALLOW_THREADS
     }
 
-    return (PyObject*)pOutput;     
+    for( PyArrayObject *pArray : arrays )
+        Py_DECREF(pArray);
+    Py_XDECREF(pColormapArray);
+    if( !bOK )
+        return NULL;
+    if( bNoMemory )
+        return PyErr_NoMemory();
+
+    return PyLong_FromSsize_t(state.nRemaining);
 }
 
 /* Our list of functions in this module*/
 static PyMethodDef ResamplerMethods[] = {
-    {"bilinear", resampler_bilinear, METH_VARARGS,
-        "call signature: bilinear(input, ignore, width, height)\n"
+    {"bilinear", (PyCFunction)resampler_bilinear, METH_VARARGS | METH_KEYWORDS,
+        "call signature: bilinear(input, ignore, width, height, nthreads=1,\n"
+        "       out=None)\n"
         "where:\n"
-        "  input is a 2d array\n"
+        "  input is a 2d array, or a 3d array of (bands, rows, cols)\n"
         "  ignore is a float (or None) containing the ignore value (if set)\n"  
+        "    or a sequence of these, one per band. NaN ignores NaN pixels\n"
         "  width is the width of the output image\n"
         "  height is the height of the output image\n"
-        "returns: a 2d array of size (height, width). dtype same as input\n"},
+        "  nthreads is the number of threads to split the rows of the output\n"
+        "    between. 0 means use all the CPUs\n"
+        "  out is an optional array (which may be a strided view) to write\n"
+        "    the output into instead of creating a new one. Must have the\n"
+        "    same dtype as input and the shape of the output\n"
+        "returns: an array of size (height, width) (or (bands, height, width))\n"
+        "  dtype same as input. uint8 and uint16 are interpolated in fixed\n"
+        "  point and rounded to nearest (see use_fixed_point())\n"},
+    {"bilinear_window", (PyCFunction)resampler_bilinear_window, 
+        METH_VARARGS | METH_KEYWORDS,
+        "call signature: bilinear_window(input, ignore, fullwidth, fullheight,\n"
+        "       xoff, yoff, width, height, nthreads=1, out=None)\n"
+        "where:\n"
+        "  input is a 2d array, or a 3d array of (bands, rows, cols)\n"
+        "  ignore is a float (or None) containing the ignore value (if set)\n"  
+        "    or a sequence of these, one per band. NaN ignores NaN pixels\n"
+        "  fullwidth is the width of the whole resampled image\n"
+        "  fullheight is the height of the whole resampled image\n"
+        "  xoff is the column in the whole image to start the output at\n"
+        "  yoff is the row in the whole image to start the output at\n"
+        "  width is the width of the output image\n"
+        "  height is the height of the output image\n"
+        "  nthreads is the number of threads to split the rows of the output\n"
+        "    between. 0 means use all the CPUs\n"
+        "  out is an optional array (which may be a strided view) to write\n"
+        "    the output into instead of creating a new one. Must have the\n"
+        "    same dtype as input and the shape of the output\n"
+        "returns: an array of size (height, width) (or (bands, height, width))\n"
+        "  which is the same as bilinear(input, ignore, fullwidth, fullheight)\n"
+        "  [..., yoff:yoff+height, xoff:xoff+width] but without calculating\n"
+        "  the rest of the image.\n"
+        "  dtype same as input\n"},
+    {"nearest", (PyCFunction)resampler_nearest, METH_VARARGS | METH_KEYWORDS,
+        "call signature: nearest(input, fullwidth, fullheight, xoff, yoff,\n"
+        "       width, height, nthreads=1, out=None)\n"
+        "where:\n"
+        "  input is a 2d array, or a 3d array of (bands, rows, cols)\n"
+        "  fullwidth is the width of the whole resampled image\n"
+        "  fullheight is the height of the whole resampled image\n"
+        "  xoff is the column in the whole image to start the output at\n"
+        "  yoff is the row in the whole image to start the output at\n"
+        "  width is the width of the output image\n"
+        "  height is the height of the output image\n"
+        "  nthreads is the number of threads to split the rows of the output\n"
+        "    between. 0 means use all the CPUs\n"
+        "  out is an optional array (which may be a strided view) to write\n"
+        "    the output into instead of creating a new one. Must have the\n"
+        "    same dtype as input and the shape of the output\n"
+        "returns: an array of size (height, width) (or (bands, height, width))\n"
+        "  with each pixel replicated from the nearest input pixel.\n"
+        "  dtype same as input (which must be bool or a number of up to\n"
+        "  16 bytes, eg complex128)\n"},
+    {"average", (PyCFunction)resampler_average, METH_VARARGS | METH_KEYWORDS,
+        "call signature: average(input, ignore, fullwidth, fullheight,\n"
+        "       xoff, yoff, width, height, nthreads=1, out=None)\n"
+        "where:\n"
+        "  arguments are as for bilinear_window()\n"
+        "returns: an array of size (height, width) (or (bands, height, width))\n"
+        "  where each pixel is the average of the input pixels it covers,\n"
+        "  weighted by how much of each is covered and leaving out the\n"
+        "  ignore values and NaN (the ignore value, or NaN if there isn't\n"
+        "  one, if they all are). Integers are rounded to the nearest. For\n"
+        "  zooming out without aliasing.\n"
+        "  dtype same as input (which can't be float16)\n"},
+    {"mode", (PyCFunction)resampler_mode, METH_VARARGS | METH_KEYWORDS,
+        "call signature: mode(input, ignore, fullwidth, fullheight,\n"
+        "       xoff, yoff, width, height, nthreads=1, out=None)\n"
+        "where:\n"
+        "  arguments are as for bilinear_window()\n"
+        "returns: an array of size (height, width) (or (bands, height, width))\n"
+        "  where each pixel is the value that covers most of it, leaving\n"
+        "  out the ignore value and NaN (ties go to the smallest value). For\n"
+        "  zooming out of thematic data.\n"
+        "  dtype same as input (which can't be float16)\n"},
+    {"cubic", (PyCFunction)resampler_cubic, METH_VARARGS | METH_KEYWORDS,
+        "call signature: cubic(input, ignore, fullwidth, fullheight,\n"
+        "       xoff, yoff, width, height, nthreads=1, out=None)\n"
+        "where:\n"
+        "  arguments are as for bilinear_window()\n"
+        "returns: an array of size (height, width) (or (bands, height, width))\n"
+        "  interpolated with a cubic (Catmull-Rom) filter. Needs a margin\n"
+        "  of 2 input pixels. Pixels within it that are the ignore value\n"
+        "  are left out, and pixels with less than half of the filter\n"
+        "  valid are the ignore value. Integers are rounded and clipped.\n"
+        "  dtype same as input (which can't be float16)\n"},
+    {"lanczos", (PyCFunction)resampler_lanczos, METH_VARARGS | METH_KEYWORDS,
+        "call signature: lanczos(input, ignore, fullwidth, fullheight,\n"
+        "       xoff, yoff, width, height, nthreads=1, out=None)\n"
+        "where:\n"
+        "  arguments are as for bilinear_window()\n"
+        "returns: as for cubic() but with a 3 lobe Lanczos filter, which\n"
+        "  needs a margin of 3 input pixels\n"},
+    {"compose", (PyCFunction)resampler_compose, METH_VARARGS | METH_KEYWORDS,
+        "call signature: compose(input, out, xoff, yoff, rescaling=None,\n"
+        "       colormap=None, nodata=None, outside=0)\n"
+        "where:\n"
+        "  input is the data for the tile. Either a 2d array or a 3d array\n"
+        "    of (bands, rows, cols). May be a view of out at (yoff, xoff)\n"
+        "  out is a 3d uint8 or uint16 array of (bands, rows, cols) for the\n"
+        "    whole tile. Must have the same number of bands as input, or one\n"
+        "    more for an alpha band calculated from the nodata values.\n"
+        "    With a colormap must have 4 bands, or 1 band to write the index\n"
+        "    into the colormap (for a paletted image) instead of the colors\n"
+        "  xoff, yoff is where the top left of input goes in the tile\n"
+        "  rescaling is None or a sequence of (min, max) to linearly stretch\n"
+        "    input between. Either one for all bands or one per band\n"
+        "  colormap is None or a (4, n) array to look up the single input\n"
+        "    band in\n"
+        "  nodata is the nodata value for the input (or None) or a\n"
+        "    sequence of these, one per band\n"
+        "  outside is the index written outside the input when out has the\n"
+        "    colormap index\n"
+        "The tile outside the input is otherwise set to zero.\n"
+        "returns: out\n"},
+    {"mosaic", (PyCFunction)resampler_mosaic, METH_VARARGS | METH_KEYWORDS,
+        "call signature: mosaic(inputs, out, filled, rescaling=None,\n"
+        "       colormap=None)\n"
+        "where:\n"
+        "  inputs is a sequence of (input, xoff, yoff, nodata) tuples in\n"
+        "    priority order. input, xoff, yoff and nodata are as for\n"
+        "    compose(). All inputs must have the same number of bands\n"
+        "  out is as for compose() and should be zeroed (or set to the\n"
+        "    index for no data) before the first call. Each pixel and band\n"
+        "    is set from the first input that\n"
+        "    isn't nodata there. Any alpha band is set where there is a value\n"
+        "  filled is a uint8 array of the size of the tile that tracks\n"
+        "    which pixels and bands have been set. Should be zeroed before\n"
+        "    the first call. Allows mosaic() to be called again with more\n"
+        "    (lower priority) inputs.\n"
+        "  rescaling and colormap are as for compose()\n"
+        "Inputs are skipped once every pixel has been set.\n"
+        "returns: the number of pixels in the tile not yet completely set\n"
+        "  (-1 if inputs is empty)\n"},
+    {"start_timing", resampler_start_timing, METH_NOARGS,
+        "call signature: start_timing()\n"
+        "Starts (or restarts) timing the kernels called from this thread\n"
+        "until stop_timing() is called. The clocks are only read when\n"
+        "this is on\n"},
+    {"stop_timing", resampler_stop_timing, METH_NOARGS,
+        "call signature: stop_timing()\n"
+        "returns: a dict of the kernels called from this thread since\n"
+        "  start_timing(): 'calls', 'pixels' (output pixels), 'wall' and\n"
+        "  'cpu' (seconds, over all the threads used) and stops timing\n"},
+    {"use_simd", resampler_use_simd, METH_VARARGS,
+        "call signature: use_simd(enable)\n"
+        "where:\n"
+        "  enable is whether to use the vectorised kernels (the default).\n"
+        "    Without them the scalar versions are used, which the fixed\n"
+        "    point bilinear ones match exactly\n"
+        "returns: the previous setting\n"},
+    {"use_fixed_point", resampler_use_fixed_point, METH_VARARGS,
+        "call signature: use_fixed_point(enable)\n"
+        "where:\n"
+        "  enable is whether bilinear uses the fixed point kernels for\n"
+        "    uint8 and uint16 (the default). These round the result to\n"
+        "    nearest. Otherwise floats are used and the result truncated\n"
+        "returns: the previous setting\n"},
+    {"simd", resampler_simd, METH_NOARGS,
+        "call signature: simd()\n"
+        "returns: the name of the instruction set used by the vectorised\n"
+        "  kernels ('neon', 'avx2' or 'none')\n"},
+    {"tuned_supported", resampler_tuned_supported, METH_NOARGS,
+        "call signature: tuned_supported()\n"
+        "returns: whether this CPU can run resampler_tuned, the build of\n"
+        "  this module for the CPU of the Lambda (see setup.py)\n"},
     {NULL}
 };
 
@@ -313,7 +4046,7 @@ static int resampler_clear(PyObject *m)
 
 static struct PyModuleDef moduledef = {
         PyModuleDef_HEAD_INIT,
-        "resampler",
+        RESAMPLER_STR(RESAMPLER_MODULE),
         NULL,
         sizeof(struct ResamplerState),
         ResamplerMethods,
@@ -324,7 +4057,7 @@ static struct PyModuleDef moduledef = {
 };
 
 PyMODINIT_FUNC 
-PyInit_resampler(void)
+RESAMPLER_INIT(RESAMPLER_MODULE)(void)
 {
     PyObject *pModule;
     struct ResamplerState *state;
@@ -332,6 +4065,10 @@ PyInit_resampler(void)
     /* initialize the numpy stuff */
     import_array();
 
+#if defined(RESAMPLER_HAVE_AVX2)
+    g_bHaveAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+
     pModule = PyModule_Create(&moduledef);
     if( pModule == NULL )
         return NULL;
@@ -339,7 +4076,8 @@ PyInit_resampler(void)
     state = GETSTATE(pModule);
 
     /* Create and add our exception type */
-    state->error = PyErr_NewException("resampler.error", NULL, NULL);
+    state->error = PyErr_NewException(RESAMPLER_STR(RESAMPLER_MODULE) ".error", 
+        NULL, NULL);
     if( state->error == NULL )
     {
         Py_DECREF(pModule);
@@ -0,0 +1,23 @@
+/*
+# This file is part of Cibo Tiler.
+# Copyright (C) 2024 Cibolabs.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// The resampler built as resampler_tuned, which setup.py compiles with
+// the flags for the CPU of the Lambda. A separate file so it has its own
+// object file (and PGO profile).
+#define RESAMPLER_MODULE resampler_tuned
+#include "resampler.cpp"
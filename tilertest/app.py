@@ -28,6 +28,7 @@ from aws_lambda_powertools.utilities.typing import LambdaContext
 from aws_lambda_powertools.logging import correlation_paths
 from aws_lambda_powertools import Logger
 from aws_lambda_powertools import Metrics
+from aws_lambda_powertools.metrics import MetricUnit
 from osgeo import gdal
 
 # As a shortcut you can run:
@@ -103,6 +104,36 @@ def makeVRT(paths):
     return warpVRT, tempDir
 
 
+def removeVRT(vrt, tempDir):
+    """
+    Remove a vrt made by makeVRT(). It is dropped from tiling's caches
+    first so they don't keep it (and the files it reads) open, or keep
+    its tiles, as it won't be used again.
+    """
+    tiling.invalidate(vrt)
+    shutil.rmtree(tempDir)
+
+
+def addTileMetrics(stats):
+    """
+    Add the times and counters in a tiling.TileStats to the metrics
+    """
+    info = stats.asDict()
+    for name, times in info['stages'].items():
+        metrics.add_metric(name=name + 'Time', unit=MetricUnit.Seconds,
+            value=times['wall'])
+        metrics.add_metric(name=name + 'CPUTime', unit=MetricUnit.Seconds,
+            value=times['cpu'])
+    metrics.add_metric(name='kernelCPUTime', unit=MetricUnit.Seconds,
+        value=info['kernel']['cpu'])
+    metrics.add_metric(name='bytesRead', unit=MetricUnit.Bytes,
+        value=info['bytesRead'])
+    for name in ('tileCacheHits', 'coalesced', 'blockCacheHits', 
+            'emptyReads', 'outputPixels'):
+        metrics.add_metric(name=name, unit=MetricUnit.Count, 
+            value=info[name])
+
+
 ########################################
 # Below are the single date tests
 
@@ -117,7 +148,7 @@ def doColorMapIntervalTest(z: int, x: int, y: int):
     tile = tiling.getTile(vrt, z, x, y, bands=[1], 
         colormap=colormap)
 
-    shutil.rmtree(tempdir)
+    removeVRT(vrt, tempdir)
 
     return Response(body=tile.getvalue(),
                 status_code=200, headers={'Content-Type': 'image/png'})
@@ -134,7 +165,7 @@ def doColorMapPointTest(z: int, x: int, y: int):
     tile = tiling.getTile(vrt, z, x, y, bands=[1], 
         colormap=colormap)
 
-    shutil.rmtree(tempdir)
+    removeVRT(vrt, tempdir)
 
     return Response(body=tile.getvalue(),
                 status_code=200, headers={'Content-Type': 'image/png'})
@@ -150,7 +181,7 @@ def doRescaleTest(z: int, x: int, y: int):
     tile = tiling.getTile(vrt, z, x, y, bands=[1, 2, 3],
         rescaling=[(0, 1000), (0, 1000), (0, 1000)])
 
-    shutil.rmtree(tempdir)
+    removeVRT(vrt, tempdir)
 
     return Response(body=tile.getvalue(),
                 status_code=200, headers={'Content-Type': 'image/png'})
@@ -167,7 +198,7 @@ def doRescaleTestNN(z: int, x: int, y: int):
         bands=[1, 2, 3], resampling='near',
         rescaling=[(0, 1000), (0, 1000), (0, 1000)])
 
-    shutil.rmtree(tempdir)
+    removeVRT(vrt, tempdir)
 
     return Response(body=tile.getvalue(),
                 status_code=200, headers={'Content-Type': 'image/png'})
@@ -180,11 +211,13 @@ def doRescaleTestBilinear(z: int, x: int, y: int):
     """
     paths = app.current_event.json_body['paths']
     vrt, tempdir = makeVRT(paths)
+    stats = tiling.TileStats()
     tile = tiling.getTile(vrt, z, x, y,
         bands=[1, 2, 3], resampling='bilinear',
-        rescaling=[(0, 1000), (0, 1000), (0, 1000)])
+        rescaling=[(0, 1000), (0, 1000), (0, 1000)], stats=stats)
+    addTileMetrics(stats)
 
-    shutil.rmtree(tempdir)
+    removeVRT(vrt, tempdir)
 
     return Response(body=tile.getvalue(),
                 status_code=200, headers={'Content-Type': 'image/png'})
@@ -210,12 +243,12 @@ def get_all_vrts(paths):
     return vrts, tempdirs
 
 
-def clean_tempdirs(tempdirs):
+def clean_vrts(vrts, tempdirs):
     """
-    Helper to remove a each directory in a list
+    Helper to remove each vrt (and its directory) from get_all_vrts()
     """
-    for t in tempdirs:
-        shutil.rmtree(t)
+    for vrt, t in zip(vrts, tempdirs):
+        removeVRT(vrt, t)
 
 
 @app.post('/test_colormap_interval_mosaic/<z>/<x>/<y>', cors=True)
@@ -229,7 +262,7 @@ def doColorMapIntervalTestMos(z: int, x: int, y: int):
     tile = tiling.getTileMosaic(vrts, z, x, y, bands=[1], 
         colormap=colormap)
 
-    clean_tempdirs(tempdirs)
+    clean_vrts(vrts, tempdirs)
     return Response(body=tile.getvalue(),
                 status_code=200, headers={'Content-Type': 'image/png'})
 
@@ -245,7 +278,7 @@ def doColorMapPointTestMos(z: int, x: int, y: int):
     tile = tiling.getTileMosaic(vrts, z, x, y, bands=[1], 
         colormap=colormap)
 
-    clean_tempdirs(tempdirs)
+    clean_vrts(vrts, tempdirs)
     return Response(body=tile.getvalue(),
                 status_code=200, headers={'Content-Type': 'image/png'})
 
@@ -260,7 +293,7 @@ def doRescaleTestMos(z: int, x: int, y: int):
     tile = tiling.getTileMosaic(vrts, z, x, y, bands=[1, 2, 3],
         rescaling=[(0, 1000), (0, 1000), (0, 1000)])
 
-    clean_tempdirs(tempdirs)
+    clean_vrts(vrts, tempdirs)
     return Response(body=tile.getvalue(),
                 status_code=200, headers={'Content-Type': 'image/png'})
 
@@ -276,7 +309,7 @@ def doRescaleTestNNMos(z: int, x: int, y: int):
         bands=[1, 2, 3], resampling='near',
         rescaling=[(0, 1000), (0, 1000), (0, 1000)])
 
-    clean_tempdirs(tempdirs)
+    clean_vrts(vrts, tempdirs)
     return Response(body=tile.getvalue(),
                 status_code=200, headers={'Content-Type': 'image/png'})
 
@@ -288,11 +321,13 @@ def doRescaleTestBilinearMos(z: int, x: int, y: int):
     """
     paths = app.current_event.json_body['paths']
     vrts, tempdirs = get_all_vrts(paths)
+    stats = tiling.TileStats()
     tile = tiling.getTileMosaic(vrts, z, x, y,
         bands=[1, 2, 3], resampling='bilinear',
-        rescaling=[(0, 1000), (0, 1000), (0, 1000)])
+        rescaling=[(0, 1000), (0, 1000), (0, 1000)], stats=stats)
+    addTileMetrics(stats)
 
-    clean_tempdirs(tempdirs)
+    clean_vrts(vrts, tempdirs)
     return Response(body=tile.getvalue(),
                 status_code=200, headers={'Content-Type': 'image/png'})
 